@@ -67,10 +67,12 @@
 #include "MagneticField/Records/interface/IdealMagneticFieldRecord.h"
 
 #include "RecoParticleFlow/PFClusterTools/interface/PFEnergyResolution.h"
-#include <TMatrixD.h>
-
+#include "KinZfitter/HelperFunction/interface/PtErrCorrectionTable.h"
+#include "KinZfitter/HelperFunction/interface/PhotonResolutionTable.h"
 // fit result covariance matrix
 #include <TMatrixDSym.h>
+#include "Math/SMatrix.h"
+#include "Math/SVector.h"
 
 namespace reco { class Candidate; class Muon; class GsfElectron; class Track; class PFCandidate; }
 namespace edm { class EventSetup; }
@@ -93,19 +95,43 @@ class HelperFunction
 
       void setdebug(int d){debug_= d;};
 
+      /// apply the (pT, |eta|) pT error correction maps to electrons and muons
+      /// (muons with a "correctedPtError" userFloat are already calibrated)
+      void setCorrPTerr(bool corr);
+
+      /// pT error correction maps of the muons and electrons, in data and mc
+      struct PtErrCorrectionTables {
+             boost::shared_ptr<const PtErrCorrectionTable> muData, muMC, elData, elMC;
+      };
+      /// use these maps instead of the ones read from HelperFunction/hists (e.g. a shared mapped copy)
+      void setPtErrCorrections(const PtErrCorrectionTables &tables);
+
       //ForZ
       double pterr(reco::Candidate *c, bool isData);
 
       //double pterr(pat::Electron electron, bool isData);
       //double pterr(pat::Muon muon, bool isData);
       double pterr(TLorentzVector fsrPhoton);
+      // batch version for several fsr photons
+      void pterr(const std::vector<TLorentzVector> &fsrPhotons, std::vector<double> &pTErrs);
 
       double pterr(reco::GsfElectron* electron, bool isData);
       double pterr(reco::Muon* muon, bool isData);
 
+      // per-event memoized versions of the above, keyed by candidate pointer
+      // (leptons) or by (E, eta) (fsr photons); call clearCache() once per event
+      double pterrCached(reco::Candidate *c, bool isData);
+      double pterrCached(TLorentzVector fsrPhoton);
+      void clearCache();
+
       double masserror(std::vector<TLorentzVector> p4s, std::vector<double> pTErrs);
 
+      /// mass error from the full covariance of (px, py, pz) of each 4-vector, 3N x 3N
       double masserrorFullCov(std::vector<TLorentzVector> p4s, TMatrixDSym covMatrix);
+      /// fixed-size version for N 4-vectors, Jacobian on the stack
+      template <unsigned int N>
+      double masserrorFullCov(const std::vector<TLorentzVector> &p4s,
+                              const ROOT::Math::SMatrix<double, 3*N, 3*N, ROOT::Math::MatRepSym<double, 3*N> > &covMatrix);
 
       //double masserror(std::vector<TLorentzVector> p4s, )
 
@@ -114,6 +140,9 @@ class HelperFunction
 
       // ---------- static member functions --------------------
 
+      /// the maps of HelperFunction/hists, read once per process on first use
+      static const PtErrCorrectionTables & defaultPtErrCorrections();
+
       // ---------- member functions ---------------------------
 
    private:
@@ -124,16 +153,56 @@ class HelperFunction
 
       int debug_;
 
-      boost::shared_ptr<TFile>     fmu;
-      boost::shared_ptr<TFile>     fel;
-      boost::shared_ptr<TH2F>      muon_corr_data;
-      boost::shared_ptr<TH2F>      muon_corr_mc;
-      boost::shared_ptr<TH2F>      electron_corr_data;
-      boost::shared_ptr<TH2F>      electron_corr_mc;
+      // event-scoped pT error caches, see pterrCached
+      struct PtErrCacheEntry { double pt; bool isData; double pterr; };
+      std::map<const reco::Candidate*, PtErrCacheEntry> lepPtErrCache_;
+      std::map<std::pair<double,double>, double> phPtErrCache_;
+      // failsafe in case clearCache() is never called
+      static const unsigned int maxCacheSize_ = 1000;
+
+      bool corrPTerr_;
+
+      // loaded once per process and shared by all HelperFunction instances
+      boost::shared_ptr<const PtErrCorrectionTable>      muon_corr_data;
+      boost::shared_ptr<const PtErrCorrectionTable>      muon_corr_mc;
+      boost::shared_ptr<const PtErrCorrectionTable>      electron_corr_data;
+      boost::shared_ptr<const PtErrCorrectionTable>      electron_corr_mc;
 
       // ---------- member data --------------------------------
 
 };
 
 
+template <unsigned int N>
+double HelperFunction::masserrorFullCov(const std::vector<TLorentzVector> &p4s,
+                                        const ROOT::Math::SMatrix<double, 3*N, 3*N, ROOT::Math::MatRepSym<double, 3*N> > &covMatrix){
+
+        double e = 0; double mass = 0;
+        double px = 0; double py = 0; double pz = 0;
+        for (unsigned int ip = 0; ip < N; ip++) {
+
+            e = e + p4s[ip].E();
+            px = px + p4s[ip].Px();
+            py = py + p4s[ip].Py();
+            pz = pz + p4s[ip].Pz();
+        }
+
+        mass = TMath::Sqrt(e*e-px*px-py*py-pz*pz);
+
+        // dm/d(px, py, pz) of each 4-vector
+        ROOT::Math::SVector<double, 3*N> jacobian;
+        for (unsigned int i = 0, o = 0; i < N; i++, o += 3) {
+
+                double ei = p4s[i].E();
+
+                jacobian[o+0] = (e*(p4s[i].Px()/ei) - px)/mass;
+                jacobian[o+1] = (e*(p4s[i].Py()/ei) - py)/mass;
+                jacobian[o+2] = (e*(p4s[i].Pz()/ei) - pz)/mass;
+        }
+
+        double dm2 = ROOT::Math::Similarity(jacobian, covMatrix);
+        return (dm2 > 0 ? std::sqrt(dm2) : 0.0);
+
+}
+
 #endif
@@ -0,0 +1,68 @@
+#ifndef PhotonResolutionTable_H
+#define PhotonResolutionTable_H
+// -*- C++ -*-
+//
+// Package:     KinZfitter/HelperFunction
+// Class  :     PhotonResolutionTable
+//
+/**\class PhotonResolutionTable PhotonResolutionTable.h "PhotonResolutionTable.h"
+
+ Description: tabulated PFEnergyResolution::getEnergyResolutionEm
+
+ Usage:
+    The EM resolution has the form sigma(E)^2 = C^2 E^2 + S^2 E + N^2 with
+    |eta| dependent terms. At construction the three coefficients are extracted
+    from PFEnergyResolution in every |eta| bin of a fine grid and checked against
+    it, so the evaluation is an inlined closed form with no object construction.
+    If the check fails (resolution function not of that form) the table falls
+    back to calling PFEnergyResolution.
+
+*/
+//
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+class PhotonResolutionTable
+{
+
+   public:
+      PhotonResolutionTable();
+
+      /// process-wide instance, built on first use
+      static const PhotonResolutionTable & instance();
+
+      /// energy resolution of a photon of energy E at eta
+      double energyResolution(double E, double eta) const {
+             if (!valid_) return energyResolutionRef(E, eta);
+             int i = std::min(int(std::fabs(eta)*invBinWidth_), nBins_-1);
+             double err2 = c2_[i]*E*E + s2_[i]*E + n2_[i];
+             return err2 > 0 ? std::sqrt(err2) : 0.0;
+      }
+
+      /// pT error of a photon, i.e. energyResolution*pT/p
+      double pterr(double E, double eta) const {
+             return energyResolution(E, eta)/std::cosh(eta);
+      }
+
+      /// batch version of pterr over n photons
+      void pterr(const double *E, const double *eta, double *pterrs, int n) const;
+
+      bool valid() const { return valid_; }
+
+   private:
+
+      double energyResolutionRef(double E, double eta) const;
+
+      static const int nBins_ = 500;
+      static const double etaMax_;
+
+      double invBinWidth_;
+      bool valid_;
+      // sigma^2 = c2 E^2 + s2 E + n2 per |eta| bin
+      std::vector<double> c2_, s2_, n2_;
+
+};
+
+#endif
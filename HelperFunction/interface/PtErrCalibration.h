@@ -0,0 +1,158 @@
+#ifndef PtErrCalibration_H
+#define PtErrCalibration_H
+// -*- C++ -*-
+//
+// Package:     KinZfitter/HelperFunction
+// Class  :     PtErrCalibration
+//
+/**\class PtErrCalibration PtErrCalibration.h "PtErrCalibration.h"
+
+ Description: (pT, |eta|) pT error scale factors from Z->ll events, in the format of PtErrCorrectionTable
+
+ Usage:
+    Each reading thread fills its own accumulator(thread) with the dileptons in the mass
+    window, no locks. fit() then finds the scale factors lambda of the bins such that the
+    dilepton masses follow a Voigt profile (Z pole x Gaussian) with the per-event mass
+    error sigma_m^2 = (lambda_1 m/2 pTErr_1/pT_1)^2 + (lambda_2 m/2 pTErr_2/pT_2)^2,
+    normalized to the window. Every iteration fits each bin with the others fixed, the bins
+    in parallel, and moves the scale factors half way (in lambda^2) to the fitted ones,
+    until they are stable. The pT scale corrections are to be applied before; as the bins
+    are in reco pT, an edge close to the Jacobian peak (pT ~ mZ/2) selects fluctuations
+    and biases the bins next to it. write() stores them as a TH2F
+    (x = pT, y = |eta|) that PtErrCorrectionTable::load reads; the factors multiply the pT
+    errors that were filled, so fill uncorrected errors to get a correction map.
+    Entries outside the binning go to the closest bin, as in the lookup.
+
+*/
+//
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "TLorentzVector.h"
+#include <boost/shared_ptr.hpp>
+
+#include "KinZfitter/HelperFunction/interface/PtErrCorrectionTable.h"
+
+class PtErrCalibration
+{
+
+   public:
+      PtErrCalibration(const std::vector<double> &ptEdges, const std::vector<double> &absEtaEdges, int nThreads);
+      /// same binning as an existing correction map
+      PtErrCalibration(const PtErrCorrectionTable &binning, int nThreads);
+
+      /// Z pole and width of the Voigt profile (default 91.1876, 2.4952), before filling
+      void setZPole(double mZ, double gammaZ);
+      /// dilepton mass window (default 75-105 GeV), before filling
+      void setMassWindow(double low, double high);
+      /// bins with fewer events keep the scale factor 1 (default 100)
+      void setMinEvents(int minEvents);
+      void setdebug(int d) { debug_ = d; }
+
+      /// per-thread event store and pull statistics, filled by one thread only
+      class Accumulator
+      {
+
+         public:
+            /// a Z->ll candidate; dm/dpT = m/(2 pT) as for massless leptons
+            void fill(const TLorentzVector &lep1, double pTErr1, const TLorentzVector &lep2, double pTErr2);
+
+            long nEvents() const { return events_.size(); }
+
+         private:
+            friend class PtErrCalibration;
+
+            explicit Accumulator(const PtErrCalibration &calibration);
+
+            Accumulator(const Accumulator&);
+            const Accumulator& operator=(const Accumulator&);
+
+            const PtErrCalibration &calibration_;
+
+            /// mass and unscaled mass error contributions, bins of the two leptons
+            struct Event {
+                   float m, w1, w2;
+                   uint32_t bin1, bin2;
+            };
+            std::vector<Event> events_;
+
+            /// (m-mZ)/sigma_m of the events with a lepton in the bin, before calibration
+            struct PullStats {
+                   double n, sum, sum2;
+            };
+            std::vector<PullStats> pulls_;
+
+      };
+
+      int nThreads() const { return accumulators_.size(); }
+      Accumulator & accumulator(int thread) { return *accumulators_[thread]; }
+
+      /// fit the scale factors from all accumulators (which are emptied) on nThreads()
+      /// threads; false if not converged after maxIterations
+      bool fit(int maxIterations = 100, double tolerance = 1e-4);
+
+      int nBinsX() const { return ptEdges_.size()-1; }
+      int nBinsY() const { return etaEdges_.size()-1; }
+
+      /// results of fit() in bin (ix, iy), from 0
+      double scaleFactor(int ix, int iy) const { return lambda_[ix*nBinsY() + iy]; }
+      /// statistical error, 0 for bins below setMinEvents
+      double scaleFactorError(int ix, int iy) const { return lambdaErr_[ix*nBinsY() + iy]; }
+      long nEvents(int ix, int iy) const { return long(pulls_[ix*nBinsY() + iy].n); }
+      /// mean and rms of the uncalibrated mass pulls
+      double pullMean(int ix, int iy) const;
+      double pullRMS(int ix, int iy) const;
+      /// shift of the mass peak w.r.t. mZ, common to all bins
+      double massShift() const { return shift_; }
+
+      /// write the scale factors as a TH2F histName into fileName (updated if it exists)
+      bool write(const std::string &fileName, const std::string &histName) const;
+      /// the scale factors as a lookup table, e.g. for HelperFunction::setPtErrCorrections
+      boost::shared_ptr<const PtErrCorrectionTable> table() const;
+
+   private:
+
+      PtErrCalibration(const PtErrCalibration&); // stop default
+      const PtErrCalibration& operator=(const PtErrCalibration&); // stop default
+
+      void init(int nThreads);
+
+      /// bin index of a lepton, closest bin outside the binning
+      int findBin(double pt, double abseta) const;
+
+      /// -log likelihood of the events of bin with the scale factor lambda there
+      double binNLL(uint32_t bin, double lambda) const;
+      /// fit step of one bin with the other bins fixed: scale factor and error
+      void fitBin(uint32_t bin, double &lambda, double &error) const;
+      /// window normalization of the Voigt profile for sigma_m, tabulated in sigma_m
+      void buildNormalization();
+      double normalization(double sigma) const;
+
+      /// worker of fit(): takes the next bin not taken by another thread
+      void fitBins(std::vector<double> &lambda, std::vector<double> &error, std::atomic<int> &next) const;
+
+      std::vector<double> ptEdges_, etaEdges_;
+      double mZ_, gammaZ_, mLow_, mHigh_;
+      int minEvents_;
+      int debug_;
+
+      std::vector<boost::shared_ptr<Accumulator> > accumulators_;
+
+      // merged by fit()
+      std::vector<Accumulator::Event> events_;
+      std::vector<Accumulator::PullStats> pulls_;
+      /// events with a lepton in each bin
+      std::vector<std::vector<uint32_t> > binEvents_;
+
+      double shift_;
+      std::vector<double> lambda_, lambdaErr_;
+
+      double normStep_;
+      std::vector<double> norm_;
+
+};
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef PtErrCorrectionTable_H
+#define PtErrCorrectionTable_H
+// -*- C++ -*-
+//
+// Package:     KinZfitter/HelperFunction
+// Class  :     PtErrCorrectionTable
+//
+/**\class PtErrCorrectionTable PtErrCorrectionTable.h "PtErrCorrectionTable.h"
+
+ Description: immutable (pT, |eta|) lookup table of per-lepton pT error corrections
+
+ Usage:
+    The TH2F correction maps (x = pT, y = |eta|) are copied once into flat arrays,
+    the lookup does not touch ROOT and can be shared by all threads.
+    Entries outside the histogram range use the closest bin.
+    A table can also be a view of arrays owned by someone else (a mapped file),
+    kept alive by the owner pointer.
+
+*/
+//
+
+#include <string>
+#include <vector>
+
+#include "TH2.h"
+#include <boost/shared_ptr.hpp>
+
+class PtErrCorrectionTable
+{
+
+   public:
+      explicit PtErrCorrectionTable(const TH2F &hist);
+      PtErrCorrectionTable(int nx, int ny, const double *xEdges, const double *yEdges, const double *values,
+                           const boost::shared_ptr<const void> &owner);
+
+      /// correction factor for the lepton pT error
+      double correction(double pt, double abseta) const {
+             return values_[findBin(xEdges_, nx_, pt)*ny_ + findBin(yEdges_, ny_, abseta)];
+      }
+
+      int nBinsX() const { return nx_; }
+      int nBinsY() const { return ny_; }
+      /// nBinsX()+1 and nBinsY()+1 edges, nBinsX()*nBinsY() values
+      const double * xEdges() const { return xEdges_; }
+      const double * yEdges() const { return yEdges_; }
+      const double * values() const { return values_; }
+
+      /// read histName from fileName, returns an empty pointer if not found
+      static boost::shared_ptr<const PtErrCorrectionTable> load(const std::string &fileName, const std::string &histName);
+
+   private:
+
+      // the pointers may refer to storage_
+      PtErrCorrectionTable(const PtErrCorrectionTable&);
+      const PtErrCorrectionTable& operator=(const PtErrCorrectionTable&);
+
+      /// index of the bin containing x, clamped to [0, nbins-1];
+      /// fixed-trip binary search with conditional moves, no data dependent branches
+      static int findBin(const double *edges, int nbins, double x) {
+             const double *base = edges;
+             int n = nbins;
+             while (n > 1) {
+                   int half = n/2;
+                   base = (base[half] <= x) ? base + half : base;
+                   n -= half;
+             }
+             return base - edges;
+      }
+
+      int nx_, ny_;
+      // row major in pT: values_[ix*ny_ + iy]
+      const double *xEdges_, *yEdges_, *values_;
+
+      // own copy (TH2F constructor) or the owner of the external arrays
+      std::vector<double> storage_;
+      boost::shared_ptr<const void> owner_;
+
+};
+
+#endif
@@ -28,6 +28,31 @@
 // static data member definitions
 //
 
+const HelperFunction::PtErrCorrectionTables & HelperFunction::defaultPtErrCorrections(){
+
+        // thread-safe initialization of function-local statics
+        struct Loader : public PtErrCorrectionTables {
+
+          Loader() {
+
+            std::string fmu_s = edm::FileInPath ( "KinZfitter/HelperFunction/hists/ebeOverallCorrections.Legacy2013.v0.root" ).fullPath();
+            std::string fel_s = edm::FileInPath ( "KinZfitter/HelperFunction/hists/ebeOverallCorrections.Legacy2013.v0.root" ).fullPath();
+
+            muData = PtErrCorrectionTable::load(fmu_s, "mu_reco53x");
+            muMC = PtErrCorrectionTable::load(fmu_s, "mu_mc53x");
+
+            elData = PtErrCorrectionTable::load(fel_s, "el_reco53x");
+            elMC = PtErrCorrectionTable::load(fel_s, "el_mc53x");
+
+          }
+
+        };
+
+        static const Loader corrections;
+        return corrections;
+
+}
+
 //
 // constructors and destructor
 //
@@ -36,20 +61,7 @@ HelperFunction::HelperFunction()
 
         //declarations
         debug_ = 0;
-
-/*
-        TString fmu_s = TString(edm::FileInPath ( "KinZfitter/HelperFunction/hists/ebeOverallCorrections.Legacy2013.v0.root" ).fullPath());
-        TString fel_s = TString(edm::FileInPath ( "KinZfitter/HelperFunction/hists/ebeOverallCorrections.Legacy2013.v0.root" ).fullPath());
-
-        fmu = boost::shared_ptr<TFile>( new TFile(fmu_s));
-        fel = boost::shared_ptr<TFile>( new TFile(fel_s));
-                
-        muon_corr_data = boost::shared_ptr<TH2F>(  (static_cast<TH2F*>(fmu->Get( "mu_reco53x" )->Clone() )) );
-        muon_corr_mc = boost::shared_ptr<TH2F>(  (static_cast<TH2F*>(fmu->Get( "mu_mc53x" )->Clone() )) );
-                
-        electron_corr_data = boost::shared_ptr<TH2F>(  (static_cast<TH2F*>(fel->Get( "el_reco53x" )->Clone() )) );
-        electron_corr_mc = boost::shared_ptr<TH2F>(  (static_cast<TH2F*>(fel->Get( "el_mc53x" )->Clone() )) );
-*/
+        corrPTerr_ = false;
 
 }
 
@@ -78,41 +90,65 @@ HelperFunction::~HelperFunction()
 // member functions
 //
 
-double HelperFunction:: masserrorFullCov(std::vector<TLorentzVector> p4s, TMatrixDSym covMatrix){
+void HelperFunction::setCorrPTerr(bool corr){
 
-        int ndim = 3*p4s.size();
-        if(debug_) cout<<""<<endl;
+        corrPTerr_ = corr;
 
-        TMatrixD jacobian(1,ndim);
+        if(corrPTerr_ && !muon_corr_data) setPtErrCorrections(defaultPtErrCorrections());
 
-        double e = 0; double mass = 0;
-        double px = 0; double py = 0; double pz = 0;
-        for (unsigned int ip = 0; ip < p4s.size(); ip++) {
-         
-            e = e + p4s[ip].E();
-            px = px + p4s[ip].Px();
-            py = py + p4s[ip].Py();
-            pz = pz + p4s[ip].Pz();
+        // cached errors may have been computed with the other setting
+        clearCache();
+
+}
+
+void HelperFunction::setPtErrCorrections(const PtErrCorrectionTables &tables){
+
+        muon_corr_data = tables.muData;
+        muon_corr_mc = tables.muMC;
+        electron_corr_data = tables.elData;
+        electron_corr_mc = tables.elMC;
+
+        clearCache();
+
+}
+
+namespace {
+
+  template <unsigned int N>
+  double MassErrorFixedSize(HelperFunction &helper, const std::vector<TLorentzVector> &p4s, const TMatrixDSym &covMatrix){
+
+        ROOT::Math::SMatrix<double, 3*N, 3*N, ROOT::Math::MatRepSym<double, 3*N> > cov;
+        for (unsigned int i = 0; i < 3*N; i++) {
+            for (unsigned int j = i; j < 3*N; j++) cov(i,j) = covMatrix(i,j);
         }
 
-        mass = TMath::Sqrt(e*e-px*px-py*py-pz*pz);
+        return helper.masserrorFullCov<N>(p4s, cov);
 
-        for (unsigned int i = 0, o = 0; i < p4s.size(); i++, o += 3) {
+  }
 
-                double pxi = p4s[i].Px();
-                double pyi = p4s[i].Py();
-                double pzi = p4s[i].Pz();
-                double ei = p4s[i].E();
+}
+
+double HelperFunction:: masserrorFullCov(std::vector<TLorentzVector> p4s, TMatrixDSym covMatrix){
 
-                jacobian(0, o+0) = (e*(pxi/ei) - px)/mass;
-                jacobian(0, o+1) = (e*(pyi/ei) - py)/mass;
-                jacobian(0, o+2) = (e*(pzi/ei) - pz)/mass;
+        if (covMatrix.GetNcols() != int(3*p4s.size())) {
+           if(debug_) cout<<"masserrorFullCov: covariance of dimension "<<covMatrix.GetNcols()<<" for "<<p4s.size()<<" 4-vectors"<<endl;
+           return 0.0;
         }
 
-        TMatrixDSym massCov = covMatrix.Similarity(jacobian);
+        // up to 4 leptons and 4 fsr photons
+        switch (p4s.size()) {
+          case 1: return MassErrorFixedSize<1>(*this, p4s, covMatrix);
+          case 2: return MassErrorFixedSize<2>(*this, p4s, covMatrix);
+          case 3: return MassErrorFixedSize<3>(*this, p4s, covMatrix);
+          case 4: return MassErrorFixedSize<4>(*this, p4s, covMatrix);
+          case 5: return MassErrorFixedSize<5>(*this, p4s, covMatrix);
+          case 6: return MassErrorFixedSize<6>(*this, p4s, covMatrix);
+          case 7: return MassErrorFixedSize<7>(*this, p4s, covMatrix);
+          case 8: return MassErrorFixedSize<8>(*this, p4s, covMatrix);
+        }
 
-        double dm2 = massCov(0,0);
-        return (dm2 > 0 ? std::sqrt(dm2) : 0.0);
+        if(debug_) cout<<"masserrorFullCov: "<<p4s.size()<<" 4-vectors not supported"<<endl;
+        return 0.0;
 
 }
 
@@ -156,21 +192,30 @@ double HelperFunction::pterr( reco::Candidate *c, bool isData){
   if ((gsf = dynamic_cast<reco::GsfElectron *> (&(*c)) ) != 0)
   {
     pterrLep=pterr(gsf, isData);
+
+    const PtErrCorrectionTable *corr = isData ? electron_corr_data.get() : electron_corr_mc.get();
+    if(corrPTerr_ && corr) pterrLep *= corr->correction(c->pt(), fabs(c->eta()));
   }
   else if ((mu = dynamic_cast<reco::Muon *> (&(*c)) ) != 0)
   {
     pterrLep=pterr(mu, isData);
     if(debug_)cout<<"reco pt err is "<<pterrLep<<endl;
 
+    bool calibrated = false;
+
     if( (patmu = dynamic_cast<pat::Muon *> (&(*c)) )!=0){
 
      if ( patmu->hasUserFloat("correctedPtError") == true ) {
        if(debug_) cout<<"use userFloat for muon pt err"<<endl;
        pterrLep = patmu->userFloat("correctedPtError");
+       calibrated = true;
        if(debug_) cout<<"calib pt err is "<<pterrLep<<endl;
      }
  
     }
+
+    const PtErrCorrectionTable *corr = isData ? muon_corr_data.get() : muon_corr_mc.get();
+    if(corrPTerr_ && !calibrated && corr) pterrLep *= corr->correction(c->pt(), fabs(c->eta()));
   }
   else if ((pf = dynamic_cast<reco::PFCandidate *> (&(*c)) ) != 0)
   { 
@@ -182,6 +227,48 @@ double HelperFunction::pterr( reco::Candidate *c, bool isData){
 
 }
 
+double HelperFunction::pterrCached( reco::Candidate *c, bool isData){
+
+  if(lepPtErrCache_.size() > maxCacheSize_) lepPtErrCache_.clear();
+
+  // the pT is stored along with the error so that a pointer reused by a
+  // different object (i.e. clearCache() forgotten between events) is not trusted
+  std::map<const reco::Candidate*, PtErrCacheEntry>::const_iterator it = lepPtErrCache_.find(c);
+  if(it != lepPtErrCache_.end() && it->second.pt == c->pt() && it->second.isData == isData)
+    return it->second.pterr;
+
+  PtErrCacheEntry entry;
+  entry.pt = c->pt(); entry.isData = isData;
+  entry.pterr = pterr(c, isData);
+  lepPtErrCache_[c] = entry;
+
+  return entry.pterr;
+
+}
+
+double HelperFunction::pterrCached(TLorentzVector ph){
+
+  if(phPtErrCache_.size() > maxCacheSize_) phPtErrCache_.clear();
+
+  // pterr(TLorentzVector) only depends on E and eta
+  std::pair<double,double> key = std::make_pair(ph.E(), ph.Eta());
+  std::map<std::pair<double,double>, double>::const_iterator it = phPtErrCache_.find(key);
+  if(it != phPtErrCache_.end()) return it->second;
+
+  double pterrPh = pterr(ph);
+  phPtErrCache_[key] = pterrPh;
+
+  return pterrPh;
+
+}
+
+void HelperFunction::clearCache(){
+
+  lepPtErrCache_.clear();
+  phPtErrCache_.clear();
+
+}
+
 double HelperFunction::pterr( reco::Muon* mu, bool isData){
 
         double pterr = mu->muonBestTrack()->ptError();
@@ -228,13 +315,26 @@ double HelperFunction::pterr(TLorentzVector ph){
 
          if(debug_) cout<<"perr for pf photon"<<endl;
 
-         double perr = PFEnergyResolution().getEnergyResolutionEm(ph.E(), ph.Eta());
-
-         double pterr = perr*ph.Pt()/ph.P();
+         // tabulated PFEnergyResolution().getEnergyResolutionEm(E, eta), times pT/p
+         double pterr = PhotonResolutionTable::instance().pterr(ph.E(), ph.Eta());
 
          return pterr;
 }
 
+void HelperFunction::pterr(const std::vector<TLorentzVector> &phs, std::vector<double> &pTErrs){
+
+         std::vector<double> E(phs.size()), eta(phs.size());
+         for(unsigned int i = 0; i < phs.size(); i++){
+            E[i] = phs[i].E(); eta[i] = phs[i].Eta();
+         }
+
+         pTErrs.resize(phs.size());
+         if(phs.empty()) return;
+
+         PhotonResolutionTable::instance().pterr(&E[0], &eta[0], &pTErrs[0], phs.size());
+
+}
+
 //
 // const member functions
 //
@@ -0,0 +1,80 @@
+// -*- C++ -*-
+//
+// Package:     KinZfitter/HelperFunction
+// Class  :     PhotonResolutionTable
+//
+
+#include "KinZfitter/HelperFunction/interface/PhotonResolutionTable.h"
+
+#include <iostream>
+#include "RecoParticleFlow/PFClusterTools/interface/PFEnergyResolution.h"
+
+const double PhotonResolutionTable::etaMax_ = 5.0;
+
+PhotonResolutionTable::PhotonResolutionTable()
+{
+
+        invBinWidth_ = nBins_/etaMax_;
+        c2_.resize(nBins_); s2_.resize(nBins_); n2_.resize(nBins_);
+
+        // sampling energies used to extract and check the coefficients
+        const double E1 = 1.0, E2 = 10.0, E3 = 100.0;
+        const double Echeck[] = { 0.5, 3.0, 30.0, 300.0 };
+
+        valid_ = true;
+
+        for (int i = 0; i < nBins_; i++) {
+
+            double etaLow = i/invBinWidth_, etaHigh = (i+1)/invBinWidth_;
+            double eta = 0.5*(etaLow + etaHigh);
+
+            double y1 = pow(energyResolutionRef(E1, eta), 2);
+            double y2 = pow(energyResolutionRef(E2, eta), 2);
+            double y3 = pow(energyResolutionRef(E3, eta), 2);
+
+            // quadratic through the three points
+            double d12 = (y2 - y1)/(E2 - E1);
+            double d23 = (y3 - y2)/(E3 - E2);
+            c2_[i] = (d23 - d12)/(E3 - E1);
+            s2_[i] = d12 - c2_[i]*(E1 + E2);
+            n2_[i] = y1 - c2_[i]*E1*E1 - s2_[i]*E1;
+
+            // also check close to the bin edges, to catch a region boundary inside the bin
+            double etaCheck[] = { etaLow + 1e-6, eta, etaHigh - 1e-6 };
+            for (unsigned int ie = 0; ie < 3; ie++) {
+                for (unsigned int iE = 0; iE < 4; iE++) {
+
+                    double ref = energyResolutionRef(Echeck[iE], etaCheck[ie]);
+                    double tab = sqrt(std::max(0.0, c2_[i]*Echeck[iE]*Echeck[iE] + s2_[i]*Echeck[iE] + n2_[i]));
+                    if (fabs(tab - ref) > 1e-6*ref) valid_ = false;
+
+                }
+            }
+
+        }
+
+        if (!valid_) std::cout << "PhotonResolutionTable: tabulation check failed, using PFEnergyResolution directly" << std::endl;
+
+}
+
+const PhotonResolutionTable & PhotonResolutionTable::instance()
+{
+
+        static const PhotonResolutionTable table;
+        return table;
+
+}
+
+void PhotonResolutionTable::pterr(const double *E, const double *eta, double *pterrs, int n) const
+{
+
+        for (int i = 0; i < n; i++) pterrs[i] = pterr(E[i], eta[i]);
+
+}
+
+double PhotonResolutionTable::energyResolutionRef(double E, double eta) const
+{
+
+        return PFEnergyResolution().getEnergyResolutionEm(E, eta);
+
+}
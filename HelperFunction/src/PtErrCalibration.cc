@@ -0,0 +1,361 @@
+// -*- C++ -*-
+//
+// Package:     KinZfitter/HelperFunction
+// Class  :     PtErrCalibration
+//
+
+#include "KinZfitter/HelperFunction/interface/PtErrCalibration.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <thread>
+
+#include "TFile.h"
+#include "TH2.h"
+#include "TMath.h"
+
+namespace {
+
+  // scale factor search range of a bin
+  const double kLambdaMin = 0.2, kLambdaMax = 5;
+  // normalization table: points in sigma_m, Simpson intervals over the window
+  const int kNormPoints = 1024, kNormIntervals = 600;
+  const double kNormSigmaMax = 50;
+
+}
+
+PtErrCalibration::PtErrCalibration(const std::vector<double> &ptEdges, const std::vector<double> &absEtaEdges, int nThreads)
+    : ptEdges_(ptEdges), etaEdges_(absEtaEdges)
+{
+
+        init(nThreads);
+
+}
+
+PtErrCalibration::PtErrCalibration(const PtErrCorrectionTable &binning, int nThreads)
+    : ptEdges_(binning.xEdges(), binning.xEdges() + binning.nBinsX()+1),
+      etaEdges_(binning.yEdges(), binning.yEdges() + binning.nBinsY()+1)
+{
+
+        init(nThreads);
+
+}
+
+void PtErrCalibration::init(int nThreads)
+{
+
+        setZPole(91.1876, 2.4952);
+        setMassWindow(75, 105);
+        setMinEvents(100);
+        debug_ = 0;
+        shift_ = 0;
+        normStep_ = 0;
+
+        int nBins = nBinsX()*nBinsY();
+        Accumulator::PullStats empty = {0, 0, 0};
+        pulls_.assign(nBins, empty);
+        lambda_.assign(nBins, 1.0);
+        lambdaErr_.assign(nBins, 0.0);
+
+        if (nThreads <= 0) nThreads = std::max(int(std::thread::hardware_concurrency()), 1);
+        for (int t = 0; t < nThreads; t++) accumulators_.push_back(boost::shared_ptr<Accumulator>(new Accumulator(*this)));
+
+}
+
+void PtErrCalibration::setZPole(double mZ, double gammaZ)
+{
+
+        mZ_ = mZ; gammaZ_ = gammaZ;
+
+}
+
+void PtErrCalibration::setMassWindow(double low, double high)
+{
+
+        mLow_ = low; mHigh_ = high;
+
+}
+
+void PtErrCalibration::setMinEvents(int minEvents)
+{
+
+        minEvents_ = minEvents;
+
+}
+
+int PtErrCalibration::findBin(double pt, double abseta) const
+{
+
+        // as PtErrCorrectionTable::correction: the bin containing x, clamped
+        int ix = std::upper_bound(ptEdges_.begin(), ptEdges_.end(), pt) - ptEdges_.begin() - 1;
+        int iy = std::upper_bound(etaEdges_.begin(), etaEdges_.end(), abseta) - etaEdges_.begin() - 1;
+        ix = std::min(std::max(ix, 0), nBinsX()-1);
+        iy = std::min(std::max(iy, 0), nBinsY()-1);
+
+        return ix*nBinsY() + iy;
+
+}
+
+PtErrCalibration::Accumulator::Accumulator(const PtErrCalibration &calibration)
+    : calibration_(calibration)
+{
+
+        PullStats empty = {0, 0, 0};
+        pulls_.assign(calibration.nBinsX()*calibration.nBinsY(), empty);
+
+}
+
+void PtErrCalibration::Accumulator::fill(const TLorentzVector &lep1, double pTErr1, const TLorentzVector &lep2, double pTErr2)
+{
+
+        double pt1 = lep1.Pt(), pt2 = lep2.Pt();
+        if (pt1 <= 0 || pt2 <= 0 || pTErr1 <= 0 || pTErr2 <= 0) return;
+
+        double m = (lep1 + lep2).M();
+        if (m < calibration_.mLow_ || m > calibration_.mHigh_) return;
+
+        Event event;
+        event.m = m;
+        event.w1 = 0.5*m*pTErr1/pt1;
+        event.w2 = 0.5*m*pTErr2/pt2;
+        event.bin1 = calibration_.findBin(pt1, fabs(lep1.Eta()));
+        event.bin2 = calibration_.findBin(pt2, fabs(lep2.Eta()));
+        events_.push_back(event);
+
+        double pull = (m - calibration_.mZ_)/sqrt(event.w1*event.w1 + event.w2*event.w2);
+        PullStats &stats1 = pulls_[event.bin1];
+        stats1.n += 1; stats1.sum += pull; stats1.sum2 += pull*pull;
+        if (event.bin2 != event.bin1) {
+           PullStats &stats2 = pulls_[event.bin2];
+           stats2.n += 1; stats2.sum += pull; stats2.sum2 += pull*pull;
+        }
+
+}
+
+double PtErrCalibration::pullMean(int ix, int iy) const
+{
+
+        const Accumulator::PullStats &stats = pulls_[ix*nBinsY() + iy];
+        return stats.n > 0 ? stats.sum/stats.n : 0;
+
+}
+
+double PtErrCalibration::pullRMS(int ix, int iy) const
+{
+
+        const Accumulator::PullStats &stats = pulls_[ix*nBinsY() + iy];
+        if (stats.n <= 0) return 0;
+        double mean = stats.sum/stats.n;
+        return sqrt(std::max(stats.sum2/stats.n - mean*mean, 0.0));
+
+}
+
+void PtErrCalibration::buildNormalization()
+{
+
+        // the largest sigma_m the fit can reach
+        double sigmaMax = 0;
+        for (unsigned int i = 0; i < events_.size(); i++)
+            sigmaMax = std::max(sigmaMax, kLambdaMax*sqrt(events_[i].w1*events_[i].w1 + events_[i].w2*events_[i].w2));
+        sigmaMax = std::min(std::max(sigmaMax, 1.0), kNormSigmaMax);
+
+        normStep_ = sigmaMax/(kNormPoints-1);
+        norm_.resize(kNormPoints);
+
+        double low = mLow_ - mZ_ - shift_, high = mHigh_ - mZ_ - shift_;
+        double h = (high - low)/kNormIntervals;
+
+        for (int k = 0; k < kNormPoints; k++) {
+            double sigma = k*normStep_;
+            double sum = TMath::Voigt(low, sigma, gammaZ_) + TMath::Voigt(high, sigma, gammaZ_);
+            for (int i = 1; i < kNormIntervals; i++) sum += (i % 2 ? 4 : 2)*TMath::Voigt(low + i*h, sigma, gammaZ_);
+            norm_[k] = sum*h/3;
+        }
+
+}
+
+double PtErrCalibration::normalization(double sigma) const
+{
+
+        double x = sigma/normStep_;
+        if (x >= kNormPoints-1) return norm_[kNormPoints-1];
+        int k = int(x);
+        return norm_[k] + (x - k)*(norm_[k+1] - norm_[k]);
+
+}
+
+double PtErrCalibration::binNLL(uint32_t bin, double lambda) const
+{
+
+        const std::vector<uint32_t> &events = binEvents_[bin];
+
+        double nll = 0;
+        for (unsigned int i = 0; i < events.size(); i++) {
+
+            const Accumulator::Event &event = events_[events[i]];
+            double lambda1 = event.bin1 == bin ? lambda : lambda_[event.bin1];
+            double lambda2 = event.bin2 == bin ? lambda : lambda_[event.bin2];
+            double sigma = sqrt(lambda1*lambda1*event.w1*event.w1 + lambda2*lambda2*event.w2*event.w2);
+
+            double voigt = TMath::Voigt(event.m - mZ_ - shift_, sigma, gammaZ_);
+            nll -= log(std::max(voigt, 1e-300)/normalization(sigma));
+
+        }
+
+        return nll;
+
+}
+
+void PtErrCalibration::fitBin(uint32_t bin, double &lambda, double &error) const
+{
+
+        // one Newton step from the current scale factor, fit() iterates anyway
+        double start = lambda_[bin], h = 1e-3*start;
+        double f0 = binNLL(bin, start), fUp = binNLL(bin, start + h), fDown = binNLL(bin, start - h);
+        double d1 = (fUp - fDown)/(2*h), d2 = (fUp - 2*f0 + fDown)/(h*h);
+
+        if (d2 > 0) {
+           double step = std::min(std::max(-d1/d2, -0.5*start), 0.5*start);
+           lambda = std::min(std::max(start + step, kLambdaMin), kLambdaMax);
+           error = 1/sqrt(d2);
+           return;
+        }
+
+        // not convex there: golden section over the whole range
+        const double g = 0.5*(sqrt(5.0) - 1);
+        double a = kLambdaMin, b = kLambdaMax;
+        double c = b - g*(b - a), d = a + g*(b - a);
+        double fc = binNLL(bin, c), fd = binNLL(bin, d);
+
+        while (b - a > 1e-4) {
+              if (fc < fd) { b = d; d = c; fd = fc; c = b - g*(b - a); fc = binNLL(bin, c); }
+              else { a = c; c = d; fc = fd; d = a + g*(b - a); fd = binNLL(bin, d); }
+        }
+
+        lambda = 0.5*(a + b);
+        error = 0;
+
+}
+
+void PtErrCalibration::fitBins(std::vector<double> &lambda, std::vector<double> &error, std::atomic<int> &next) const
+{
+
+        for (int bin = next++; bin < int(lambda.size()); bin = next++) {
+            if (int(binEvents_[bin].size()) < minEvents_) continue;
+            fitBin(bin, lambda[bin], error[bin]);
+        }
+
+}
+
+bool PtErrCalibration::fit(int maxIterations, double tolerance)
+{
+
+        // merge the accumulators
+        for (unsigned int t = 0; t < accumulators_.size(); t++) {
+
+            Accumulator &accumulator = *accumulators_[t];
+            events_.insert(events_.end(), accumulator.events_.begin(), accumulator.events_.end());
+            std::vector<Accumulator::Event>().swap(accumulator.events_);
+
+            for (unsigned int bin = 0; bin < pulls_.size(); bin++) {
+                Accumulator::PullStats &stats = accumulator.pulls_[bin];
+                pulls_[bin].n += stats.n; pulls_[bin].sum += stats.sum; pulls_[bin].sum2 += stats.sum2;
+                stats.n = 0; stats.sum = 0; stats.sum2 = 0;
+            }
+
+        }
+
+        if (events_.empty()) { std::cout << "PtErrCalibration: no events" << std::endl; return false; }
+
+        // peak position: median of the masses, the Voigt profile being symmetric
+        std::vector<float> masses(events_.size());
+        for (unsigned int i = 0; i < events_.size(); i++) masses[i] = events_[i].m;
+        std::nth_element(masses.begin(), masses.begin() + masses.size()/2, masses.end());
+        shift_ = masses[masses.size()/2] - mZ_;
+
+        binEvents_.assign(pulls_.size(), std::vector<uint32_t>());
+        for (unsigned int i = 0; i < events_.size(); i++) {
+            binEvents_[events_[i].bin1].push_back(i);
+            if (events_[i].bin2 != events_[i].bin1) binEvents_[events_[i].bin2].push_back(i);
+        }
+
+        buildNormalization();
+
+        if (debug_) std::cout << "PtErrCalibration: " << events_.size() << " events, mass shift " << shift_ << std::endl;
+
+        // every iteration fits all bins from the scale factors of the previous one (Jacobi)
+        bool converged = false;
+        for (int iteration = 0; iteration < maxIterations && !converged; iteration++) {
+
+            std::vector<double> lambda(lambda_), error(lambdaErr_);
+            std::atomic<int> next(0);
+
+            std::vector<std::thread> threads;
+            for (int t = 0; t < nThreads(); t++)
+                threads.push_back(std::thread(&PtErrCalibration::fitBins, this, std::ref(lambda), std::ref(error), std::ref(next)));
+            for (unsigned int t = 0; t < threads.size(); t++) threads[t].join();
+
+            // the bins sharing events pull in opposite directions (a bin fitted alone takes up all
+            // of the mismatch of its events), half steps in lambda^2 converge
+            double maxChange = 0;
+            for (unsigned int bin = 0; bin < lambda.size(); bin++) {
+                lambda[bin] = sqrt(0.5*(lambda_[bin]*lambda_[bin] + lambda[bin]*lambda[bin]));
+                maxChange = std::max(maxChange, fabs(lambda[bin] - lambda_[bin]));
+            }
+
+            lambda_.swap(lambda);
+            lambdaErr_.swap(error);
+            converged = maxChange < tolerance;
+
+            if (debug_) std::cout << "PtErrCalibration: iteration " << iteration << " max change " << maxChange << std::endl;
+
+        }
+
+        return converged;
+
+}
+
+boost::shared_ptr<const PtErrCorrectionTable> PtErrCalibration::table() const
+{
+
+        // xEdges | yEdges | values, owned by the table
+        boost::shared_ptr<std::vector<double> > storage(new std::vector<double>(ptEdges_));
+        storage->insert(storage->end(), etaEdges_.begin(), etaEdges_.end());
+        storage->insert(storage->end(), lambda_.begin(), lambda_.end());
+
+        const double *xEdges = &(*storage)[0];
+        const double *yEdges = xEdges + ptEdges_.size();
+
+        return boost::shared_ptr<const PtErrCorrectionTable>(
+               new PtErrCorrectionTable(nBinsX(), nBinsY(), xEdges, yEdges, yEdges + etaEdges_.size(), storage));
+
+}
+
+bool PtErrCalibration::write(const std::string &fileName, const std::string &histName) const
+{
+
+        TFile *f = TFile::Open(fileName.c_str(), "UPDATE");
+        if (!f || f->IsZombie()) {
+           std::cout << "PtErrCalibration: cannot open " << fileName << std::endl;
+           delete f;
+           return false;
+        }
+
+        TH2F hist(histName.c_str(), "pT error scale factor;p_{T} [GeV];|#eta|", nBinsX(), &ptEdges_[0], nBinsY(), &etaEdges_[0]);
+        hist.SetDirectory(0);
+        for (int ix = 0; ix < nBinsX(); ix++) {
+            for (int iy = 0; iy < nBinsY(); iy++) {
+                hist.SetBinContent(ix+1, iy+1, scaleFactor(ix, iy));
+                hist.SetBinError(ix+1, iy+1, scaleFactorError(ix, iy));
+            }
+        }
+
+        bool ok = f->WriteTObject(&hist, histName.c_str(), "Overwrite") > 0;
+
+        f->Close();
+        delete f;
+
+        return ok;
+
+}
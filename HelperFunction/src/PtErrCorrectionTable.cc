@@ -0,0 +1,62 @@
+// -*- C++ -*-
+//
+// Package:     KinZfitter/HelperFunction
+// Class  :     PtErrCorrectionTable
+//
+
+#include "KinZfitter/HelperFunction/interface/PtErrCorrectionTable.h"
+
+#include <iostream>
+#include "TFile.h"
+
+PtErrCorrectionTable::PtErrCorrectionTable(const TH2F &hist)
+{
+
+        nx_ = hist.GetXaxis()->GetNbins();
+        ny_ = hist.GetYaxis()->GetNbins();
+
+        // xEdges | yEdges | values
+        storage_.reserve((nx_+1) + (ny_+1) + nx_*ny_);
+        for (int ix = 1; ix <= nx_+1; ix++) storage_.push_back(hist.GetXaxis()->GetBinLowEdge(ix));
+        for (int iy = 1; iy <= ny_+1; iy++) storage_.push_back(hist.GetYaxis()->GetBinLowEdge(iy));
+
+        for (int ix = 0; ix < nx_; ix++) {
+            for (int iy = 0; iy < ny_; iy++) {
+                storage_.push_back(hist.GetBinContent(ix+1, iy+1));
+            }
+        }
+
+        xEdges_ = &storage_[0];
+        yEdges_ = xEdges_ + nx_+1;
+        values_ = yEdges_ + ny_+1;
+
+}
+
+PtErrCorrectionTable::PtErrCorrectionTable(int nx, int ny, const double *xEdges, const double *yEdges, const double *values,
+                                           const boost::shared_ptr<const void> &owner)
+    : nx_(nx), ny_(ny), xEdges_(xEdges), yEdges_(yEdges), values_(values), owner_(owner)
+{
+}
+
+boost::shared_ptr<const PtErrCorrectionTable> PtErrCorrectionTable::load(const std::string &fileName, const std::string &histName)
+{
+
+        boost::shared_ptr<const PtErrCorrectionTable> table;
+
+        TFile *f = TFile::Open(fileName.c_str());
+        if (!f || f->IsZombie()) {
+           std::cout << "PtErrCorrectionTable: cannot open " << fileName << std::endl;
+           delete f;
+           return table;
+        }
+
+        TH2F *hist = dynamic_cast<TH2F*>(f->Get(histName.c_str()));
+        if (hist) table.reset(new PtErrCorrectionTable(*hist));
+        else std::cout << "PtErrCorrectionTable: no TH2F " << histName << " in " << fileName << std::endl;
+
+        f->Close();
+        delete f;
+
+        return table;
+
+}
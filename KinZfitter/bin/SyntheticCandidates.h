@@ -0,0 +1,80 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef SyntheticCandidates_h
+#define SyntheticCandidates_h
+
+// synthetic ZZ candidates for the test executables: kCycle consecutive indices cycle
+// through all final states, 0-2 fsr photons per Z and m4l below and above 140 GeV
+// and the cutoff, so every model is exercised
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "TRandom3.h"
+#include "TVector3.h"
+#include "TLorentzVector.h"
+
+namespace SyntheticCandidates {
+
+  const int kCycle = 36;
+
+  // Z decaying to two leptons of mass m, boosted with pT up to maxPt
+  inline void MakeZ(TRandom3 &rnd, double mZ, double m, double maxPt, TLorentzVector &l1, TLorentzVector &l2) {
+
+       double p = sqrt(std::max(mZ*mZ/4 - m*m, 0.0));
+       double cosTheta = rnd.Uniform(-1, 1), phi = rnd.Uniform(-M_PI, M_PI);
+       double sinTheta = sqrt(1 - cosTheta*cosTheta);
+
+       TVector3 dir(sinTheta*cos(phi), sinTheta*sin(phi), cosTheta);
+       l1.SetVectM(p*dir, m);
+       l2.SetVectM(-p*dir, m);
+
+       TLorentzVector z;
+       z.SetPtEtaPhiM(rnd.Uniform(0, maxPt), rnd.Uniform(-1.5, 1.5), rnd.Uniform(-M_PI, M_PI), mZ);
+       l1.Boost(z.BoostVector());
+       l2.Boost(z.BoostVector());
+
+  }
+
+  inline KinZfitter::RefitCandidate MakeCandidate(TRandom3 &rnd, int index) {
+
+       KinZfitter::RefitCandidate candidate;
+
+       // 4e, 4mu, 2e2mu, 2mu2e
+       int id1 = (index & 1) ? 13 : 11, id2 = (index & 2) ? 13 : 11;
+       double m1 = id1 == 11 ? 0.000511 : 0.1057, m2 = id2 == 11 ? 0.000511 : 0.1057;
+
+       // m4l below 140, between 140 and the cutoff and above the cutoff
+       double maxPt = (index/4) % 3 == 0 ? 20 : ((index/4) % 3 == 1 ? 60 : 200);
+
+       MakeZ(rnd, rnd.Gaus(91.187, 3), m1, maxPt, candidate.leptons[0], candidate.leptons[1]);
+       MakeZ(rnd, rnd.Uniform(20, 95), m2, maxPt, candidate.leptons[2], candidate.leptons[3]);
+
+       for (int i = 0; i < 4; i++) {
+
+           candidate.ids[i] = (i < 2 ? id1 : id2)*(i % 2 == 0 ? 1 : -1);
+           candidate.pTErrs[i] = candidate.leptons[i].Pt()*rnd.Uniform(0.01, 0.03);
+
+           // 0, 1 or 2 photons per Z
+           candidate.fsrPhotons[i].SetPxPyPzE(0, 0, 0, 0);
+           candidate.fsrPTErrs[i] = 0;
+
+           int nFsr = (index/12) % 3;
+           if (i % 2 >= nFsr) continue;
+
+           TLorentzVector &lep = candidate.leptons[i];
+           candidate.fsrPhotons[i].SetPtEtaPhiM(rnd.Uniform(2, 10), lep.Eta() + rnd.Gaus(0, 0.1), lep.Phi() + rnd.Gaus(0, 0.1), 0);
+           candidate.fsrPTErrs[i] = 0.1*candidate.fsrPhotons[i].Pt();
+
+           }
+
+       return candidate;
+
+  }
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+// pT error scale factors from Z->ll events (PtErrCalibration), written as a correction map:
+//   calibratePtErr [mu|el] [threads=0] [binning=file.root:hist] output.root histName tree file1.root [file2.root ...]
+// The tree has one dilepton per entry, float branches pT1 eta1 phi1 pTErr1 pT2 eta2 phi2 pTErr2
+// with the uncorrected pT errors. Each thread reads its own range of entries into its
+// accumulator; the fit runs on the same threads. The binning is that of the current data
+// map of the flavour (HelperFunction::defaultPtErrCorrections) unless given.
+// The histogram is added to output.root (replacing one of the same name), e.g. mu_reco53x,
+// so the four maps can be collected in one file for HelperFunction.
+
+#include "KinZfitter/HelperFunction/interface/HelperFunction.h"
+#include "KinZfitter/HelperFunction/interface/PtErrCalibration.h"
+#include "KinZfitter/KinZfitter/interface/FitBudget.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "TChain.h"
+#include "TROOT.h"
+
+namespace {
+
+  // fills the accumulator of one thread with the entries [first, last) of the files
+  void ReadEntries(const std::string &treeName, const std::vector<std::string> &files, long first, long last,
+                   PtErrCalibration::Accumulator *accumulator) {
+
+       TChain chain(treeName.c_str());
+       for (unsigned int i = 0; i < files.size(); i++) chain.Add(files[i].c_str());
+
+       float pT[2], eta[2], phi[2], pTErr[2];
+       const char *index[2] = {"1", "2"};
+       for (int l = 0; l < 2; l++) {
+           chain.SetBranchAddress((std::string("pT") + index[l]).c_str(), &pT[l]);
+           chain.SetBranchAddress((std::string("eta") + index[l]).c_str(), &eta[l]);
+           chain.SetBranchAddress((std::string("phi") + index[l]).c_str(), &phi[l]);
+           chain.SetBranchAddress((std::string("pTErr") + index[l]).c_str(), &pTErr[l]);
+           }
+
+       for (long entry = first; entry < last; entry++) {
+           chain.GetEntry(entry);
+           TLorentzVector lep1, lep2;
+           lep1.SetPtEtaPhiM(pT[0], eta[0], phi[0], 0);
+           lep2.SetPtEtaPhiM(pT[1], eta[1], phi[1], 0);
+           accumulator->fill(lep1, pTErr[0], lep2, pTErr[1]);
+           }
+
+  }
+
+}
+
+int main(int argc, char **argv) {
+
+    std::string flavour = "mu", binningFile, binningHist;
+    int nThreads = 0;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "mu" || arg == "el") flavour = arg;
+        else if (arg.compare(0, 8, "threads=") == 0) nThreads = atoi(arg.c_str() + 8);
+        else if (arg.compare(0, 8, "binning=") == 0 && arg.find(':') != std::string::npos) {
+                binningFile = arg.substr(8, arg.find(':') - 8);
+                binningHist = arg.substr(arg.find(':') + 1);
+                }
+        else args.push_back(arg);
+        }
+
+    if (args.size() < 4) {
+       std::cout << "usage: " << argv[0] << " [mu|el] [threads=n] [binning=file.root:hist] output.root histName tree file1.root [file2.root ...]" << std::endl;
+       return 1;
+       }
+
+    std::string output = args[0], histName = args[1], treeName = args[2];
+    std::vector<std::string> files(args.begin() + 3, args.end());
+
+    boost::shared_ptr<const PtErrCorrectionTable> binning;
+    if (!binningFile.empty()) binning = PtErrCorrectionTable::load(binningFile, binningHist);
+    else binning = flavour == "mu" ? HelperFunction::defaultPtErrCorrections().muData : HelperFunction::defaultPtErrCorrections().elData;
+    if (!binning) { std::cout << "calibratePtErr: no binning" << std::endl; return 1; }
+
+    ROOT::EnableThreadSafety();
+
+    PtErrCalibration calibration(*binning, nThreads);
+
+    TChain chain(treeName.c_str());
+    for (unsigned int i = 0; i < files.size(); i++) chain.Add(files[i].c_str());
+    long nEntries = chain.GetEntries();
+
+    FitBudget timer(0, 0, 0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < calibration.nThreads(); t++) {
+        long first = nEntries*t/calibration.nThreads(), last = nEntries*(t+1)/calibration.nThreads();
+        threads.push_back(std::thread(ReadEntries, treeName, std::cref(files), first, last, &calibration.accumulator(t)));
+        }
+    for (unsigned int t = 0; t < threads.size(); t++) threads[t].join();
+
+    double readSeconds = timer.Seconds();
+    bool converged = calibration.fit();
+
+    std::cout << "calibratePtErr: " << nEntries << " entries read in " << readSeconds << " s, fitted in "
+              << timer.Seconds() - readSeconds << " s on " << calibration.nThreads() << " threads"
+              << (converged ? "" : ", NOT converged") << "; mass shift " << calibration.massShift() << " GeV" << std::endl;
+
+    std::cout << "pT bin, |eta| bin, events, pull mean, pull rms, scale factor, error" << std::endl;
+    for (int ix = 0; ix < calibration.nBinsX(); ix++) {
+        for (int iy = 0; iy < calibration.nBinsY(); iy++) {
+            std::cout << ix << " " << iy << " " << calibration.nEvents(ix, iy) << " " << calibration.pullMean(ix, iy)
+                      << " " << calibration.pullRMS(ix, iy) << " " << calibration.scaleFactor(ix, iy)
+                      << " " << calibration.scaleFactorError(ix, iy) << std::endl;
+            }
+        }
+
+    if (!calibration.write(output, histName)) return 1;
+
+    return converged ? 0 : 1;
+
+}
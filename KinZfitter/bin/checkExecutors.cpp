@@ -0,0 +1,251 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+// check of the multi-threaded refit executors against the serial KinZfitter
+//   checkExecutors [nCandidates=2000] [threads=4] [maxInFlight=8]
+// Synthetic candidates are refitted one by one by a serial fitter (the reference), by
+// KinZfitterBatch and by KinZfitterAsync (with Submit, then with TrySubmit), all with
+// the tabulated engine; each result has to match the reference of the same candidate
+// (m4l, mZ1, mZ2, m4l error, pTs, status), which also checks that the results come back
+// in input order. Async: never more than maxInFlight refits in flight, none after Wait.
+// A candidate KinZfitter::Setup rejects has to throw that exception from Refit (batch)
+// or from its future (async) without affecting the other candidates. An async pool
+// configured with kRooFitEngine has to be refused by its constructor.
+// Exits non-zero on any mismatch.
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+#include "KinZfitter/KinZfitter/interface/KinZfitterBatch.h"
+#include "KinZfitter/KinZfitter/interface/KinZfitterAsync.h"
+#include "KinZfitter/KinZfitter/interface/FitBudget.h"
+#include "KinZfitter/KinZfitter/bin/SyntheticCandidates.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "TRandom3.h"
+
+namespace {
+
+  void Configure(KinZfitter &kinZfitter) {
+
+       kinZfitter.SetFitEngine(KinZfitter::kTabulatedEngine);
+
+  }
+
+  void ConfigureRooFit(KinZfitter &kinZfitter) {
+
+       kinZfitter.SetFitEngine(KinZfitter::kRooFitEngine);
+
+  }
+
+  bool Close(double a, double b) {
+
+       if (a != a && b != b) return true;
+       return fabs(a - b) <= 1e-9*std::max(fabs(a), fabs(b));
+
+  }
+
+  bool Same(const KinZfitter::RefitResult &a, const KinZfitter::RefitResult &b) {
+
+       if (a.status != b.status || a.p4s.size() != b.p4s.size()) return false;
+       if (!Close(a.m4l, b.m4l) || !Close(a.mZ1, b.mZ1) || !Close(a.mZ2, b.mZ2) || !Close(a.m4lErr, b.m4lErr)) return false;
+       for (unsigned int i = 0; i < a.p4s.size(); i++) {
+           if (!Close(a.p4s[i].Pt(), b.p4s[i].Pt())) return false;
+           }
+       return true;
+
+  }
+
+  // candidates whose result differs from the reference, the first few are printed
+  int Compare(const std::string &name, const std::vector<KinZfitter::RefitResult> &reference,
+              const std::vector<KinZfitter::RefitResult> &results) {
+
+       if (results.size() != reference.size()) {
+          std::cout << name << ": " << results.size() << " results for " << reference.size() << " candidates" << std::endl;
+          return std::max(reference.size(), results.size());
+          }
+
+       int nMismatch = 0;
+       for (unsigned int i = 0; i < reference.size(); i++) {
+           if (Same(reference[i], results[i])) continue;
+           if (nMismatch++ < 10)
+              std::cout << "  " << name << " candidate " << i << ": m4l " << results[i].m4l << " status " << results[i].status
+                        << ", serial m4l " << reference[i].m4l << " status " << reference[i].status << std::endl;
+           }
+
+       return nMismatch;
+
+  }
+
+  // result of a future, false if it threw
+  bool Get(std::future<KinZfitter::RefitResult> &future, KinZfitter::RefitResult &result, std::string &error) {
+
+       try { result = future.get(); }
+       catch (const std::exception &e) {
+             error = e.what();
+             return false;
+             }
+       return true;
+
+  }
+
+}
+
+int main(int argc, char **argv) {
+
+    long nCandidates = argc > 1 ? atol(argv[1]) : 2000;
+    int nThreads = argc > 2 ? atoi(argv[2]) : 4;
+    int maxInFlight = argc > 3 ? atoi(argv[3]) : 8;
+
+    if (nCandidates <= 0 || nThreads <= 0 || maxInFlight <= 0) {
+       std::cout << "usage: " << argv[0] << " [nCandidates] [threads] [maxInFlight]" << std::endl;
+       return 1;
+       }
+
+    TRandom3 rnd(4321);
+    std::vector<KinZfitter::RefitCandidate> candidates;
+    for (long i = 0; i < nCandidates; i++) candidates.push_back(SyntheticCandidates::MakeCandidate(rnd, i % SyntheticCandidates::kCycle));
+
+    // the reference: one fitter, one candidate after the other, as the executors run them
+    KinZfitter serial(false);
+    Configure(serial);
+
+    FitBudget timer(0, 0, 0);
+    std::vector<KinZfitter::RefitResult> reference;
+    for (long i = 0; i < nCandidates; i++) {
+        serial.ClearCache();
+        serial.Setup(candidates[i]);
+        serial.KinRefitZ();
+        reference.push_back(serial.GetRefitResult());
+        }
+    double serialSeconds = timer.Seconds();
+
+    bool ok = true;
+
+    // batch: results in input order, every candidate done once
+    KinZfitterBatch batch(false, nThreads, Configure);
+
+    double start = timer.Seconds();
+    std::vector<KinZfitter::RefitResult> results = batch.Refit(candidates);
+    double batchSeconds = timer.Seconds() - start;
+
+    int nMismatch = Compare("batch", reference, results);
+    int nDone = 0, nStolen = 0;
+    for (int t = 0; t < batch.NThreads(); t++) { nDone += batch.NDone()[t]; nStolen += batch.NStolen()[t]; }
+
+    std::cout << "batch: " << batch.NThreads() << " threads, speedup " << (batchSeconds > 0 ? serialSeconds/batchSeconds : 0)
+              << ", " << nDone << " done, " << nStolen << " stolen, " << nMismatch << " mismatches" << std::endl;
+    ok = ok && nMismatch == 0 && nDone == nCandidates;
+
+    // batch with a candidate Setup rejects (tau leptons) in the middle: the exception reaches the caller
+    std::vector<KinZfitter::RefitCandidate> withBad = candidates;
+    for (int i = 0; i < 4; i++) withBad[nCandidates/2].ids[i] = (i % 2 == 0 ? 15 : -15);
+
+    bool thrown = false;
+    try { batch.Refit(withBad); }
+    catch (const std::exception &e) {
+          thrown = true;
+          std::cout << "batch: exception forwarded: " << e.what() << std::endl;
+          }
+    if (!thrown) std::cout << "batch: the rejected candidate did not throw" << std::endl;
+    ok = ok && thrown;
+
+    // and the batch is still usable
+    nMismatch = Compare("batch after exception", reference, batch.Refit(candidates));
+    std::cout << "batch after exception: " << nMismatch << " mismatches" << std::endl;
+    ok = ok && nMismatch == 0;
+
+    // async with Submit, the rejected candidate included: every future in input order,
+    // the rejected one throws, never more than maxInFlight in flight
+    {
+      KinZfitterAsync async(false, nThreads, maxInFlight, Configure);
+
+      start = timer.Seconds();
+      std::vector<std::future<KinZfitter::RefitResult> > futures;
+      int maxSeen = 0;
+      for (long i = 0; i < nCandidates; i++) {
+          futures.push_back(async.Submit(withBad[i]));
+          maxSeen = std::max(maxSeen, async.InFlight());
+          }
+
+      std::vector<KinZfitter::RefitResult> asyncResults(nCandidates);
+      std::string error;
+      long nThrown = 0, badIndex = nCandidates/2;
+      bool badThrown = false;
+      for (long i = 0; i < nCandidates; i++) {
+          if (Get(futures[i], asyncResults[i], error)) continue;
+          nThrown++;
+          if (i != badIndex) std::cout << "  async candidate " << i << " threw: " << error << std::endl;
+          else {
+               badThrown = true;
+               std::cout << "async: exception forwarded: " << error << std::endl;
+               }
+          }
+      if (!badThrown) std::cout << "async: the rejected candidate did not throw" << std::endl;
+      double asyncSeconds = timer.Seconds() - start;
+
+      // the rejected candidate has no result to compare
+      asyncResults[badIndex] = reference[badIndex];
+      nMismatch = Compare("async", reference, asyncResults);
+
+      std::cout << "async Submit: " << nThreads << " threads, speedup " << (asyncSeconds > 0 ? serialSeconds/asyncSeconds : 0)
+                << ", at most " << maxSeen << " in flight (limit " << maxInFlight << "), " << nThrown << " thrown, "
+                << nMismatch << " mismatches" << std::endl;
+      ok = ok && nMismatch == 0 && maxSeen <= maxInFlight && badThrown && nThrown == 1;
+
+      // TrySubmit: refused when full, then the oldest pending result is collected first;
+      // a result not collected keeps no 4-vectors and shows up as a mismatch
+      KinZfitter::RefitResult none;
+      none.m4l = none.mZ1 = none.mZ2 = none.m4lErr = -1;
+      none.status = KinZfitter::kFitOK;
+      asyncResults.assign(nCandidates, none);
+
+      std::deque<std::pair<long, std::future<KinZfitter::RefitResult> > > pending;
+      long nRefused = 0;
+      for (long i = 0; i < nCandidates; i++) {
+
+          std::future<KinZfitter::RefitResult> future;
+          while (!async.TrySubmit(candidates[i], future)) {
+                nRefused++;
+                if (pending.empty()) { std::this_thread::yield(); continue; }
+                asyncResults[pending.front().first] = pending.front().second.get();
+                pending.pop_front();
+                }
+          maxSeen = std::max(maxSeen, async.InFlight());
+          pending.push_back(std::make_pair(i, std::move(future)));
+
+          }
+      for (; !pending.empty(); pending.pop_front()) asyncResults[pending.front().first] = pending.front().second.get();
+
+      async.Wait();
+      int inFlight = async.InFlight();
+
+      nMismatch = Compare("async TrySubmit", reference, asyncResults);
+      std::cout << "async TrySubmit: " << nRefused << " refused, at most " << maxSeen << " in flight, "
+                << inFlight << " after Wait, " << nMismatch << " mismatches" << std::endl;
+      ok = ok && nMismatch == 0 && maxSeen <= maxInFlight && inFlight == 0;
+    }
+
+    // RooFit is not thread-safe, the pool refuses it
+    thrown = false;
+    try { KinZfitterAsync rooFit(false, 1, maxInFlight, ConfigureRooFit); }
+    catch (const std::exception &e) {
+          thrown = true;
+          std::cout << "async: kRooFitEngine refused: " << e.what() << std::endl;
+          }
+    if (!thrown) std::cout << "async: kRooFitEngine was not refused" << std::endl;
+    ok = ok && thrown;
+
+    std::cout << "checkExecutors: " << nCandidates << " candidates: " << (ok ? "OK" : "FAILED") << std::endl;
+
+    return ok ? 0 : 1;
+
+}
@@ -0,0 +1,245 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+// A/B test of the fast fit engines against the RooFit reference (MakeModel):
+// every candidate is refitted in the same process by one KinZfitter per engine,
+// the reference with the Minuit HESSE covariance (SetAnalyticCovariance(false))
+//   compareEngines [nCandidates=10000] [seed=4321] [toleranceScale=1]
+// Prints per engine and quantity the deviation from RooFit (mean, rms, median and
+// p99 of |deviation|, max), the speedup and the candidates out of tolerance:
+//   m4l, mZ1, mZ2:  GeV                       tolerance 0.05
+//   m4lErr:         relative                  tolerance 0.02
+//   pT_l1..pT_l4:   relative (pT scale)       tolerance 0.001
+//   cov<Z>_<a>_<b>: in units of the RooFit errors, sqrt(cov_aa cov_bb), of the
+//                   Z fit covariance elements, matched by name; tolerance 0.02
+// all tolerances times toleranceScale. Exits non-zero if any candidate is out of
+// tolerance or gets another fit status, so it can gate a change of backend.
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+#include "KinZfitter/KinZfitter/interface/FitBudget.h"
+#include "KinZfitter/KinZfitter/bin/SyntheticCandidates.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "TRandom3.h"
+
+namespace {
+
+  // refit of one candidate by one engine
+  struct EngineResult {
+
+         KinZfitter::RefitResult result;
+         TMatrixDSym covZ[2];
+         std::vector<TString> covNames[2];
+         double seconds;
+
+         };
+
+  EngineResult Refit(KinZfitter &kinZfitter, const KinZfitter::RefitCandidate &candidate) {
+
+       EngineResult engine;
+       FitBudget timer(0, 0, 0);
+
+       kinZfitter.ClearCache();
+       kinZfitter.Setup(candidate);
+       kinZfitter.KinRefitZ();
+       engine.result = kinZfitter.GetRefitResult();
+       engine.seconds = timer.Seconds();
+
+       for (int iZ = 0; iZ < 2; iZ++) {
+           TMatrixDSym cov = kinZfitter.GetRefitCovZ(iZ+1, engine.covNames[iZ]);
+           engine.covZ[iZ].ResizeTo(cov.GetNrows(), cov.GetNcols());
+           engine.covZ[iZ] = cov;
+           }
+
+       return engine;
+
+  }
+
+  struct Outlier {
+
+         long candidate;
+         std::string quantity;
+         double reference, value;
+
+         };
+
+  // deviations of one engine from the reference
+  struct Comparison {
+
+         std::string name;
+         std::map<std::string, std::vector<double> > deviations;
+         std::vector<Outlier> outliers;
+         int nStatusMismatch;
+         double seconds;
+         std::vector<double> speedups;
+
+         Comparison(const std::string &engineName) : name(engineName), nStatusMismatch(0), seconds(0) {}
+
+         void Add(long candidate, const std::string &quantity, double deviation, double tolerance, double reference, double value) {
+
+              deviations[quantity].push_back(deviation);
+              if (fabs(deviation) <= tolerance) return;
+
+              Outlier outlier = {candidate, quantity, reference, value};
+              outliers.push_back(outlier);
+
+         }
+
+         };
+
+  void Compare(long candidate, const EngineResult &reference, const EngineResult &engine, double scale, Comparison &comparison) {
+
+       const KinZfitter::RefitResult &ref = reference.result, &alt = engine.result;
+
+       comparison.Add(candidate, "m4l", alt.m4l - ref.m4l, 0.05*scale, ref.m4l, alt.m4l);
+       comparison.Add(candidate, "mZ1", alt.mZ1 - ref.mZ1, 0.05*scale, ref.mZ1, alt.mZ1);
+       comparison.Add(candidate, "mZ2", alt.mZ2 - ref.mZ2, 0.05*scale, ref.mZ2, alt.mZ2);
+       if (ref.m4lErr > 0)
+          comparison.Add(candidate, "m4lErr", alt.m4lErr/ref.m4lErr - 1, 0.02*scale, ref.m4lErr, alt.m4lErr);
+
+       for (unsigned int i = 0; i < ref.p4s.size() && i < alt.p4s.size(); i++) {
+           if (ref.p4s[i].Pt() <= 0) continue;
+           comparison.Add(candidate, TString::Format("pT_l%d", i+1).Data(), alt.p4s[i].Pt()/ref.p4s[i].Pt() - 1, 0.001*scale,
+                          ref.p4s[i].Pt(), alt.p4s[i].Pt());
+           }
+
+       // covariance elements by name, the engines may float other photons
+       for (int iZ = 0; iZ < 2; iZ++) {
+
+           const std::vector<TString> &refNames = reference.covNames[iZ], &altNames = engine.covNames[iZ];
+
+           for (unsigned int a = 0; a < refNames.size(); a++) {
+               for (unsigned int b = a; b < refNames.size(); b++) {
+
+                   int altA = find(altNames.begin(), altNames.end(), refNames[a]) - altNames.begin();
+                   int altB = find(altNames.begin(), altNames.end(), refNames[b]) - altNames.begin();
+                   if (altA == int(altNames.size()) || altB == int(altNames.size())) continue;
+
+                   double refCov = reference.covZ[iZ](a,b), altCov = engine.covZ[iZ](altA,altB);
+                   double norm = sqrt(reference.covZ[iZ](a,a)*reference.covZ[iZ](b,b));
+                   if (!(norm > 0)) continue;
+
+                   TString quantity = TString::Format("covZ%d_%s_%s", iZ+1, refNames[a].Data(), refNames[b].Data());
+                   comparison.Add(candidate, quantity.Data(), (altCov - refCov)/norm, 0.02*scale, refCov, altCov);
+
+                   }
+               }
+
+           }
+
+       if (alt.status != ref.status) comparison.nStatusMismatch++;
+
+       comparison.seconds += engine.seconds;
+       if (engine.seconds > 0) comparison.speedups.push_back(reference.seconds/engine.seconds);
+
+  }
+
+  double Quantile(std::vector<double> values, double q) {
+
+       if (values.empty()) return 0;
+       sort(values.begin(), values.end());
+       return values[std::min(size_t(q*values.size()), values.size() - 1)];
+
+  }
+
+  void Print(const Comparison &comparison, double referenceSeconds, int maxOutliers) {
+
+       std::cout << std::endl << comparison.name << " vs roofit: speedup " << (comparison.seconds > 0 ? referenceSeconds/comparison.seconds : 0)
+                 << " (total), " << Quantile(comparison.speedups, 0.5) << " (median per candidate); "
+                 << comparison.nStatusMismatch << " status mismatches, " << comparison.outliers.size() << " out of tolerance" << std::endl;
+
+       std::cout << std::setw(36) << std::left << "quantity" << std::right << std::setw(10) << "n" << std::setw(13) << "mean"
+                 << std::setw(13) << "rms" << std::setw(13) << "p50|dev|" << std::setw(13) << "p99|dev|" << std::setw(13) << "max|dev|" << std::endl;
+
+       for (std::map<std::string, std::vector<double> >::const_iterator it = comparison.deviations.begin(); it != comparison.deviations.end(); ++it) {
+
+           const std::vector<double> &deviations = it->second;
+           double sum = 0, sum2 = 0;
+           std::vector<double> absolute;
+           for (unsigned int i = 0; i < deviations.size(); i++) {
+               sum += deviations[i]; sum2 += deviations[i]*deviations[i];
+               absolute.push_back(fabs(deviations[i]));
+               }
+           double mean = sum/deviations.size();
+
+           std::cout << std::setw(36) << std::left << it->first << std::right << std::setw(10) << deviations.size() << std::scientific << std::setprecision(3)
+                     << std::setw(13) << mean << std::setw(13) << sqrt(std::max(sum2/deviations.size() - mean*mean, 0.0))
+                     << std::setw(13) << Quantile(absolute, 0.5) << std::setw(13) << Quantile(absolute, 0.99)
+                     << std::setw(13) << Quantile(absolute, 1) << std::endl;
+           std::cout.unsetf(std::ios::scientific);
+
+           }
+
+       for (unsigned int i = 0; i < comparison.outliers.size() && int(i) < maxOutliers; i++) {
+           const Outlier &outlier = comparison.outliers[i];
+           std::cout << "  candidate " << outlier.candidate << " " << outlier.quantity << ": roofit " << outlier.reference
+                     << " " << comparison.name << " " << outlier.value << std::endl;
+           }
+       if (int(comparison.outliers.size()) > maxOutliers)
+          std::cout << "  ... " << comparison.outliers.size() - maxOutliers << " more" << std::endl;
+
+  }
+
+}
+
+int main(int argc, char **argv) {
+
+    long nCandidates = argc > 1 ? atol(argv[1]) : 10000;
+    int seed = argc > 2 ? atoi(argv[2]) : 4321;
+    double scale = argc > 3 ? atof(argv[3]) : 1;
+
+    if (nCandidates <= 0 || scale <= 0) {
+       std::cout << "usage: " << argv[0] << " [nCandidates] [seed] [toleranceScale]" << std::endl;
+       return 1;
+       }
+
+    // the reference covariance from Minuit HESSE, not the analytic hessian of the fast engines
+    KinZfitter reference(false);
+    reference.SetAnalyticCovariance(false);
+
+    KinZfitter tabulated(false);
+    tabulated.SetFitEngine(KinZfitter::kTabulatedEngine);
+
+    KinZfitter floatKernel(false);
+    floatKernel.SetFitEngine(KinZfitter::kTabulatedEngine);
+    floatKernel.SetFitPrecision(KinZfitter::kFloatPrecision);
+
+    KinZfitter *engines[2] = {&tabulated, &floatKernel};
+    std::vector<Comparison> comparisons;
+    comparisons.push_back(Comparison("tabulated"));
+    comparisons.push_back(Comparison("float"));
+
+    TRandom3 rnd(seed);
+    double referenceSeconds = 0;
+
+    for (long i = 0; i < nCandidates; i++) {
+
+        KinZfitter::RefitCandidate candidate = SyntheticCandidates::MakeCandidate(rnd, i % SyntheticCandidates::kCycle);
+
+        EngineResult ref = Refit(reference, candidate);
+        referenceSeconds += ref.seconds;
+
+        for (int e = 0; e < 2; e++) Compare(i, ref, Refit(*engines[e], candidate), scale, comparisons[e]);
+
+        }
+
+    bool ok = true;
+    for (unsigned int e = 0; e < comparisons.size(); e++) {
+        Print(comparisons[e], referenceSeconds, 20);
+        ok = ok && comparisons[e].outliers.empty() && comparisons[e].nStatusMismatch == 0;
+        }
+
+    std::cout << std::endl << "compareEngines: " << nCandidates << " candidates, roofit " << 1e6*referenceSeconds/nCandidates
+              << " us per candidate: " << (ok ? "OK" : "FAILED") << std::endl;
+
+    return ok ? 0 : 1;
+
+}
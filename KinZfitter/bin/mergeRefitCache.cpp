@@ -0,0 +1,25 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+// merge the refit journals of several jobs (and existing stores) into one store:
+//   mergeRefitCache store.kzf store.kzf job1.kzfj job2.kzfj ...
+// the output may be one of the inputs; the store is replaced atomically, so jobs
+// reading it at the same time are not affected.
+
+#include "KinZfitter/KinZfitter/interface/RefitDiskCache.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv) {
+
+    if (argc < 3) {
+       std::cout << "usage: " << argv[0] << " output input1 [input2 ...]" << std::endl;
+       return 1;
+       }
+
+    std::vector<std::string> inputs(argv + 2, argv + argc);
+    return RefitDiskCache::Merge(inputs, argv[1]) ? 0 : 1;
+
+}
@@ -0,0 +1,100 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+// reruns the Z fits logged by KinZfitter::SetFitRecorder, without the events
+//   replayFits [recorded|roofit|tabulated|float] [repeat=1] [nobudget] file1 [file2 ...]
+// recorded: the engine and precision of each record; repeat: each fit is rerun n
+// times and the fastest is reported; nobudget: without the recorded fit budget.
+// Prints per fit the recorded and replayed time and status and the largest pT
+// difference (in units of the input pT error), then a summary.
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv) {
+
+    std::string engine = "recorded";
+    int repeat = 1;
+    bool useBudget = true;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "recorded" || arg == "roofit" || arg == "tabulated" || arg == "float") engine = arg;
+        else if (arg == "nobudget") useBudget = false;
+        else if (arg.find_first_not_of("0123456789") == std::string::npos) repeat = std::max(atoi(arg.c_str()), 1);
+        else files.push_back(arg);
+        }
+
+    if (files.empty()) {
+       std::cout << "usage: " << argv[0] << " [recorded|roofit|tabulated|float] [repeat] [nobudget] file1 [file2 ...]" << std::endl;
+       return 1;
+       }
+
+    std::vector<FitRecorder::Record> records;
+    for (unsigned int i = 0; i < files.size(); i++) {
+        if (!FitRecorder::Read(files[i], records)) {
+           std::cout << "replayFits: " << files[i] << " is not a fit recorder file (version " << FitRecorder::kVersion << ")" << std::endl;
+           return 1;
+           }
+        }
+
+    int fitEngine = -1, precision = -1;
+    if (engine == "roofit") fitEngine = KinZfitter::kRooFitEngine;
+    if (engine == "tabulated" || engine == "float") fitEngine = KinZfitter::kTabulatedEngine;
+    if (engine == "tabulated") precision = KinZfitter::kDoublePrecision;
+    if (engine == "float") precision = KinZfitter::kFloatPrecision;
+
+    KinZfitter kinZfitter(false);
+
+    double recordedSeconds = 0, replayedSeconds = 0, maxDiff = 0;
+    int nRecordedBad = 0, nReplayedBad = 0;
+
+    std::cout << "fit fs nFsr engine status recorded(us) -> status replayed(us) max|dpT|/pTErr" << std::endl;
+
+    for (unsigned int i = 0; i < records.size(); i++) {
+
+        const FitRecorder::Record &record = records[i];
+
+        FitRecorder::Record replay = kinZfitter.ReplayFit(record, fitEngine, precision, useBudget);
+        for (int n = 1; n < repeat; n++) {
+            FitRecorder::Record again = kinZfitter.ReplayFit(record, fitEngine, precision, useBudget);
+            if (again.seconds < replay.seconds) replay = again;
+            }
+
+        // pT1, pT2 of the leptons and, with photons, of the photons (RefitDiskCache order)
+        double diff = 0;
+        int index[4] = {0, 1, 4, 5};
+        for (int j = 0; j < (record.nFsr > 0 ? 4 : 2); j++) {
+            if (record.pTErr[j] <= 0) continue;
+            diff = std::max(diff, fabs(replay.pT[index[j]] - record.pT[index[j]])/record.pTErr[j]);
+            }
+
+        std::cout << i << " " << std::string(record.fs, strnlen(record.fs, sizeof(record.fs))) << " " << record.nFsr
+                  << " " << (replay.engine == KinZfitter::kRooFitEngine ? "roofit" : (replay.precision == KinZfitter::kFloatPrecision ? "float" : "tabulated"))
+                  << " " << record.status << " " << 1e6*record.seconds
+                  << " -> " << replay.status << " " << 1e6*replay.seconds << " " << diff << std::endl;
+
+        recordedSeconds += record.seconds;
+        replayedSeconds += replay.seconds;
+        maxDiff = std::max(maxDiff, diff);
+        if (record.status != KinZfitter::kFitOK) nRecordedBad++;
+        if (replay.status != KinZfitter::kFitOK) nReplayedBad++;
+
+        }
+
+    if (records.empty()) { std::cout << "replayFits: no records" << std::endl; return 0; }
+
+    std::cout << "replayFits: " << records.size() << " fits, mean time " << 1e6*recordedSeconds/records.size()
+              << " us recorded, " << 1e6*replayedSeconds/records.size() << " us replayed; not OK "
+              << nRecordedBad << " recorded, " << nReplayedBad << " replayed; max |dpT|/pTErr " << maxDiff << std::endl;
+
+    return 0;
+
+}
@@ -0,0 +1,122 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+// soak test of the refit memory: runs many refits of synthetic ZZ candidates
+// on one KinZfitter and checks that the resident memory stays flat
+//   soakKinZfitter [nFits=10000000] [engine=roofit|tabulated|float] [toleranceMB=16] [cold|warmup]
+// The RSS after a warm-up (1% of the fits, models and lineshape tables built) is
+// the baseline; the job fails if it grows by more than toleranceMB afterwards.
+// The fitter is driven without ClearCache, so the growth includes the per-event caches.
+// The candidates cycle through all final states, 0-2 fsr photons per Z and m4l
+// below and above 140 GeV and the cutoff, so every model is exercised.
+// Reports the time to the first fit (wall time from the construction of the fitter to the
+// first result, in a fresh process), with KinZfitter::Warmup after the construction if warmup.
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+#include "KinZfitter/KinZfitter/interface/FitBudget.h"
+#include "KinZfitter/KinZfitter/bin/SyntheticCandidates.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "TRandom3.h"
+
+namespace {
+
+  // resident set size in MB
+  double ResidentMB() {
+
+       long pages = 0, resident = 0;
+       FILE *statm = fopen("/proc/self/statm", "r");
+       if (!statm) return 0;
+       if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+       fclose(statm);
+
+       return resident*double(sysconf(_SC_PAGESIZE))/(1024*1024);
+
+  }
+
+}
+
+int main(int argc, char **argv) {
+
+    long nFits = argc > 1 ? atol(argv[1]) : 10000000;
+    std::string engine = argc > 2 ? argv[2] : "roofit";
+    double toleranceMB = argc > 3 ? atof(argv[3]) : 16;
+    std::string startMode = argc > 4 ? argv[4] : "cold";
+
+    if (nFits <= 0 || (engine != "roofit" && engine != "tabulated" && engine != "float") || (startMode != "cold" && startMode != "warmup")) {
+       std::cout << "usage: " << argv[0] << " [nFits] [roofit|tabulated|float] [toleranceMB] [cold|warmup]" << std::endl;
+       return 1;
+       }
+
+    FitBudget firstFit(0, 0, 0);
+
+    KinZfitter kinZfitter(false);
+    if (engine != "roofit") kinZfitter.SetFitEngine(KinZfitter::kTabulatedEngine);
+    if (engine == "float") kinZfitter.SetFitPrecision(KinZfitter::kFloatPrecision);
+    kinZfitter.SetLatencyTracking(true, 5);
+
+    double constructionSeconds = firstFit.Seconds(), warmupSeconds = 0;
+    if (startMode == "warmup") {
+       kinZfitter.Warmup();
+       warmupSeconds = firstFit.Seconds() - constructionSeconds;
+       }
+
+    // every final state, fsr and mass combination, new kinematics each cycle
+    TRandom3 rnd(4321);
+    const int nCandidates = SyntheticCandidates::kCycle;
+
+    long nWarmup = max(nFits/100, 1000L), nSample = max(nFits/100, 1L);
+    double baseline = -1, maxGrowth = 0;
+    clock_t start = clock();
+
+    for (long i = 0; i < nFits; i++) {
+
+        // no ClearCache, as in analyzers that never call it: the caches have to stay bounded
+        kinZfitter.Setup(SyntheticCandidates::MakeCandidate(rnd, i % nCandidates));
+        kinZfitter.KinRefitZ();
+        kinZfitter.GetRefitResult();
+
+        if (i == 0) {
+           double seconds = firstFit.Seconds();
+           std::cout << "time to first fit " << seconds << " s: construction " << constructionSeconds << " s, warmup "
+                     << warmupSeconds << " s, first fit " << seconds - constructionSeconds - warmupSeconds << " s" << std::endl;
+           }
+
+        if (i+1 == nWarmup) baseline = ResidentMB();
+
+        if ((i+1) % nSample == 0 || i+1 == nFits) {
+
+           double rss = ResidentMB();
+           if (baseline >= 0) maxGrowth = max(maxGrowth, rss - baseline);
+
+           double seconds = double(clock() - start)/CLOCKS_PER_SEC;
+           std::cout << "fits " << i+1 << " RSS " << rss << " MB"
+                     << (baseline >= 0 ? TString::Format(" (+%.2f MB)", rss - baseline).Data() : " (warm-up)")
+                     << " fits/s " << (seconds > 0 ? (i+1)/seconds : 0) << std::endl;
+
+           }
+
+        }
+
+    if (baseline < 0) {
+       std::cout << "soakKinZfitter: " << nFits << " fits do not cover the warm-up of " << nWarmup << std::endl;
+       return 1;
+       }
+
+    kinZfitter.GetLatency().Print(std::cout);
+
+    bool ok = maxGrowth <= toleranceMB;
+    std::cout << "soakKinZfitter " << engine << ": RSS growth after warm-up " << maxGrowth << " MB, tolerance "
+              << toleranceMB << " MB: " << (ok ? "OK" : "FAILED") << std::endl;
+
+    return ok ? 0 : 1;
+
+}
@@ -0,0 +1,22 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+// write the image of the parameter store (ParamZ1 parameters and pT error maps):
+//   writeParameterStore kinzfitter_params.kzps
+// jobs then call ParameterStore::SetImage("kinzfitter_params.kzps") before creating
+// the first KinZfitter, and map the image instead of reading the text and ROOT files.
+
+#include "KinZfitter/KinZfitter/interface/ParameterStore.h"
+
+#include <iostream>
+
+int main(int argc, char **argv) {
+
+    if (argc != 2) {
+       std::cout << "usage: " << argv[0] << " image" << std::endl;
+       return 1;
+       }
+
+    return ParameterStore::Instance()->WriteImage(argv[1]) ? 0 : 1;
+
+}
@@ -0,0 +1,120 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef FitBudget_h
+#define FitBudget_h
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "Math/IFunction.h"
+
+/// Call and wall-time budget of one minimization (0: no limit), keeping the best
+/// point evaluated so far. Once a limit is passed Check throws Exceeded, which
+/// aborts the minimizer; the caller falls back to Best().
+class FitBudget {
+public:
+
+        struct Exceeded {};
+
+        FitBudget(int maxCalls, double maxSeconds, int dim)
+            : maxCalls_(maxCalls), maxSeconds_(maxSeconds), nCalls_(0),
+              callsHit_(false), timeHit_(false), bestF_(0), best_(dim), hasBest_(false),
+              start_(std::chrono::steady_clock::now()) {}
+
+        /// one evaluation, f at x
+        void Check(const double *x, double f) {
+
+             nCalls_++;
+
+             if (std::isfinite(f) && (!hasBest_ || f < bestF_)) {
+                bestF_ = f; hasBest_ = true;
+                for (unsigned int i = 0; i < best_.size(); i++) best_[i] = x[i];
+                }
+
+             if (maxCalls_ > 0 && nCalls_ >= maxCalls_) { callsHit_ = true; throw Exceeded(); }
+             if (maxSeconds_ > 0 && Seconds() > maxSeconds_) { timeHit_ = true; throw Exceeded(); }
+
+        }
+
+        int NCalls() const { return nCalls_; }
+        double Seconds() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count(); }
+
+        bool CallsHit() const { return callsHit_; }
+        bool TimeHit() const { return timeHit_; }
+
+        /// lowest finite value seen, false if none
+        bool HasBest() const { return hasBest_; }
+        const double * Best() const { return &best_[0]; }
+
+        /// largest fraction of the call or time budget used
+        double UsedFraction() const {
+
+             double used = 0;
+             if (maxCalls_ > 0) used = double(nCalls_)/maxCalls_;
+             if (maxSeconds_ > 0) used = std::max(used, Seconds()/maxSeconds_);
+             return used;
+
+        }
+
+private:
+
+        int maxCalls_;
+        double maxSeconds_;
+        int nCalls_;
+        bool callsHit_, timeHit_;
+
+        double bestF_;
+        std::vector<double> best_;
+        bool hasBest_;
+
+        std::chrono::steady_clock::time_point start_;
+
+};
+
+/// F (a ROOT::Math::IMultiGradFunction) with every evaluation counted by a FitBudget
+template <typename F>
+class BudgetedFunction : public ROOT::Math::IMultiGradFunction {
+public:
+
+        BudgetedFunction(const F &function, FitBudget &budget) : function_(&function), budget_(&budget) {}
+
+        unsigned int NDim() const { return function_->NDim(); }
+        ROOT::Math::IMultiGradFunction * Clone() const { return new BudgetedFunction(*this); }
+
+        void Gradient(const double *x, double *grad) const { double f; FdF(x, f, grad); }
+
+        void FdF(const double *x, double &f, double *grad) const {
+
+             function_->FdF(x, f, grad);
+             budget_->Check(x, f);
+
+        }
+
+private:
+
+        double DoEval(const double *x) const {
+
+             double f = (*function_)(x);
+             budget_->Check(x, f);
+             return f;
+
+        }
+
+        double DoDerivative(const double *x, unsigned int icoord) const {
+
+             std::vector<double> grad(NDim());
+             double f;
+             FdF(x, f, &grad[0]);
+             return grad[icoord];
+
+        }
+
+        const F *function_;
+        FitBudget *budget_;
+
+};
+
+#endif
@@ -0,0 +1,79 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef FitLatency_h
+#define FitLatency_h
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+
+/// Latency histograms of the Z fits by category (final state, number of fsr
+/// photons, lineshape model, one or two Zs fitted), HDR style: log-linear buckets
+/// with 32 sub-buckets per power of two of the time in ns, so every quantile is
+/// within 3% over the full range, and the N slowest fits with their inputs.
+/// One instance per KinZfitter, i.e. per thread, filled without locks; the
+/// instances of several threads are combined with Merge at the end of the job.
+class FitLatency {
+public:
+
+        /// one of the slowest fits: time, category and the Z fit input (ZFitKey values)
+        struct SlowFit {
+
+               double seconds;
+               std::string category;
+               std::vector<double> input;
+
+               };
+
+        explicit FitLatency(int nSlowest = 10);
+
+        void Add(const std::string &category, double seconds, const std::vector<double> &input);
+        void Merge(const FitLatency &other);
+        void Clear();
+
+        /// categories with at least one fit
+        std::vector<std::string> Categories() const;
+        /// number of fits of a category, all categories for ""
+        long Count(const std::string &category = "") const;
+        /// quantile q (0-1) of the fit time in seconds, all categories for ""
+        double Quantile(double q, const std::string &category = "") const;
+        double Max(const std::string &category = "") const;
+
+        /// slowest first
+        std::vector<SlowFit> Slowest() const;
+
+        /// count, p50, p99, p99.9 and max per category, then the slowest fits
+        void Print(std::ostream &out) const;
+
+private:
+
+        enum { kSubBits = 5, kExponents = 48 };
+
+        struct Histogram {
+
+               std::vector<long> counts;
+               long total;
+               double max;
+
+               Histogram() : counts(kExponents << kSubBits, 0), total(0), max(0) {}
+
+               };
+
+        static int Bucket(double seconds);
+        /// upper edge of a bucket in seconds
+        static double BucketValue(int bucket);
+
+        Histogram Total() const;
+        static double Quantile(const Histogram &histogram, double q);
+
+        std::map<std::string, Histogram> histograms_;
+
+        int nSlowest_;
+        /// min-heap on seconds of at most nSlowest_ fits
+        std::vector<SlowFit> slowest_;
+
+};
+
+#endif
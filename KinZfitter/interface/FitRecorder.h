@@ -0,0 +1,84 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef FitRecorder_h
+#define FitRecorder_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/// Binary log of Z fits worth a second look (slow or not kFitOK), complete enough
+/// to rerun them without the event: KinZfitter::ReplayFit, replayFits.
+/// File: header + fixed-size records appended by one writer (one file per fitter,
+/// i.e. per thread and job), written unbuffered so a crashing job keeps them.
+class FitRecorder {
+public:
+
+        static const uint32_t kVersion = 2;
+
+        /// one Z fit: the FitInput, lineshape parameters, fitter configuration and outcome
+        struct Record {
+
+               // FitInput of lepton 1, 2, photon 1, 2
+               double pTRECO[4], pTErr[4], theta[4], phi[4];
+               double m[2];
+
+               // lineshape (RelBW above 140 GeV) and Z1/Z2 fits (above the cutoff)
+               double mass4lRECO;
+               double bwMean, bwGamma;
+               double sg, a, n, f, mean, sigma, f1;
+
+               // KinZfitter::SetFitBudget
+               double maxSeconds;
+
+               // outcome: wall time, status and fitted pTs / errors as in the RefitDiskCache record
+               double seconds;
+               double pT[8];
+
+               int32_t nFsr;
+               // KinZfitter::FitEngine and FitPrecision
+               int32_t engine, precision;
+               int32_t maxCalls;
+               // KinZfitter::FitStatus
+               int32_t status;
+               // KinZfitter::SetAnalyticCovariance
+               int32_t analyticCovariance;
+
+               char fs[8];
+
+               };
+
+        explicit FitRecorder(const std::string &fileName);
+        ~FitRecorder();
+
+        bool IsOpen() const { return fd_ >= 0; }
+
+        void Write(const Record &record);
+
+        /// records of a file, false if it is not a recorder file of this version
+        static bool Read(const std::string &fileName, std::vector<Record> &records);
+
+private:
+
+        FitRecorder(const FitRecorder &);
+        FitRecorder & operator=(const FitRecorder &);
+
+        /// check the header of the opened fd_ and append after its last complete record;
+        /// a file of another version is started again, false if it is not a recorder file
+        bool OpenFile(const std::string &fileName);
+
+        struct Header {
+
+               char magic[4];
+               uint32_t version;
+               uint32_t recordSize;
+               uint32_t reserved;
+
+               };
+
+        int fd_;
+
+};
+
+#endif
@@ -21,6 +21,19 @@
 #include "KinZfitter/HelperFunction/interface/HelperFunction.h"
 #include "DataFormats/Candidate/interface/Candidate.h"
 
+// tabulated true mZ lineshape and the likelihood using it
+#include "KinZfitter/KinZfitter/interface/ZLineshape.h"
+#include "KinZfitter/KinZfitter/interface/ZLikelihood.h"
+// process-wide parameter store
+#include "KinZfitter/KinZfitter/interface/ParameterStore.h"
+// persistent Z fit result store
+#include "KinZfitter/KinZfitter/interface/RefitDiskCache.h"
+// Z fit latency histograms
+#include "KinZfitter/KinZfitter/interface/FitLatency.h"
+// slow/bad Z fit log
+#include "KinZfitter/KinZfitter/interface/FitRecorder.h"
+#include <boost/shared_ptr.hpp>
+
 // ROOFIT
 
 #include "RooRealVar.h"
@@ -41,7 +54,8 @@
 #include "RooWorkspace.h"
 #include "RooFitResult.h"
 
-// fit result covariance matrix
+// fit result covariance matrix: fixed-size internally, TMatrixDSym in the interface
+#include "Math/SMatrix.h"
 #include <TMatrixDSym.h>
 
 #include <iostream>
@@ -57,14 +71,225 @@ class KinZfitter {
 public:
 	
         KinZfitter(bool isData);
+        ~KinZfitter();
 
 	/// Kinematic fit of lepton momenta
         /// HelperFunction class to calcluate per lepton(+photon) pT error
         void Setup(std::vector< reco::Candidate* > selectedLeptons, std::map<unsigned int, TLorentzVector> selectedFsrPhotons);
 
+        /// plain-data candidate, for refits away from the reco objects (batches, ntuples):
+        /// leptons ordered by Z1_1,Z1_2,Z2_1,Z2_2 with pdg ids and pT errors, the fsr photon
+        /// of lepton i in fsrPhotons[i] (zero vector if none) with its pT error
+        struct RefitCandidate {
+
+               TLorentzVector leptons[4];
+               int ids[4];
+               double pTErrs[4];
+               TLorentzVector fsrPhotons[4];
+               double fsrPTErrs[4];
+
+               };
+
+        /// the RefitCandidate Setup would fit, pT errors from HelperFunction
+        RefitCandidate MakeRefitCandidate(std::vector< reco::Candidate* > selectedLeptons, std::map<unsigned int, TLorentzVector> selectedFsrPhotons);
+        /// throws std::invalid_argument if the leptons are not electrons or muons
+        void Setup(const RefitCandidate &candidate);
+
+        /// relative cost of KinRefitZ for this candidate, for scheduling
+        double EstimateFitCost(const RefitCandidate &candidate) const;
+
         ///
         void KinRefitZ();
 
+        /// lazy refit: KinRefitZ only does the Z1/Z2 pairing and the Z fits run on the first
+        /// GetRefit*, KinRefitZVariations or GetRefitSensitivity call for the candidate, so
+        /// candidates whose refit results are never read are never fitted. GetM4l, GetMZ1,
+        /// GetMZ2, GetM4lErr and GetP4s do not fit. Settings changed before that first call
+        /// (engine, Z pole, caches) apply to the deferred fit.
+        void SetLazyRefit(bool lazy);
+
+        /// Z1/Z2 pairing of 4e/4mu candidates above the cutoff, where both Zs are fitted
+        ///  kMassPairing:       smaller |mZ1-91.2|+|mZ2-91.2| of the reco masses (default)
+        ///  kLikelihoodPairing: smaller sum of the Z1 and Z2 fit NLL minima; the pairing with the
+        ///                      lower analytic NLL bound is fitted first and the other one only
+        ///                      if its bound is below that fitted NLL
+        /// With SetLazyRefit, GetMZ1/GetMZ2 give the mass pairing until the fits ran.
+        /// Also resets the PairingReport.
+        enum PairingMode { kMassPairing = 0, kLikelihoodPairing = 1 };
+        void SetPairingMode(PairingMode mode);
+
+        /// kLikelihoodPairing candidates since the last SetPairingMode
+        struct PairingReport {
+
+               int nCandidates;
+               /// second pairing not fitted, its bound being above the first one's NLL
+               int nPruned;
+               /// pairing changed w.r.t. the mass pairing
+               int nChanged;
+
+               };
+        PairingReport GetPairingReport() const { return pairingReport_; }
+
+        /// outcome of the Z fits of a candidate
+        ///  kFitOK:        minimized
+        ///  kFitBudgetHit: a fit ran out of its SetFitBudget budget and fell back
+        enum FitStatus { kFitOK = 0, kFitBudgetHit = 1 };
+
+        /// refit results of one candidate
+        struct RefitResult {
+
+               double m4l, mZ1, mZ2;
+               // GetRefitM4lErrFullCov
+               double m4lErr;
+               // refitted 4-vectors (with fsr) ordered by Z1_1,Z1_2,Z2_1,Z2_2
+               std::vector<TLorentzVector> p4s;
+               FitStatus status;
+
+               };
+
+        RefitResult GetRefitResult();
+
+        /// systematic variation of the refit
+        struct Variation {
+
+               TString name;
+               /// scale factors of the lepton and fsr photon pT errors
+               double pTErrScale, pTErrScalePhoton;
+               /// lineshape parameter set (ParamZ1/<PDFName>_<fs>.txt), empty for the nominal one
+               TString PDFName;
+               /// Z pole and width of the lineshape, <= 0 for the nominal ones (SetZPole)
+               double bwMean, bwGamma;
+
+               Variation() : pTErrScale(1.0), pTErrScalePhoton(1.0), PDFName(""), bwMean(0), bwGamma(0) {}
+
+               };
+
+        /// refit the candidate of the last Setup + KinRefitZ for each variation.
+        /// Inputs and Z1/Z2 pairing are reused and each fit starts from the nominal solution;
+        /// the nominal results are restored afterwards. Throws std::invalid_argument, before
+        /// any refit, if the parameter set of a variation does not exist for the final state.
+        std::vector<RefitResult> KinRefitZVariations(const std::vector<Variation> &variations);
+
+        /// derivatives of the refit m4l, mZ1 and mZ2 w.r.t. the input lepton pTs and pT errors,
+        /// leptons ordered by Z1_1,Z1_2,Z2_1,Z2_2 (after KinRefitZ, at the fit minimum)
+        struct Sensitivity {
+
+               double dM4l_dPt[4], dM4l_dPtErr[4];
+               double dMZ1_dPt[4], dMZ1_dPtErr[4];
+               double dMZ2_dPt[4], dMZ2_dPtErr[4];
+
+               };
+
+        /// computed on request from the implicit function theorem, for either fit engine
+        Sensitivity GetRefitSensitivity();
+
+        /// Z pole and width of the lineshape (default 91.187, 2.5)
+        void SetZPole(double bwMean, double bwGamma);
+
+        /// minimization backend of the Z fits
+        ///  kRooFitEngine:    RooFit model built in MakeModel (default)
+        ///  kTabulatedEngine: same likelihood with the lineshape from a spline table, minimized by Minuit2
+        enum FitEngine { kRooFitEngine = 0, kTabulatedEngine = 1 };
+        void SetFitEngine(FitEngine engine);
+        FitEngine GetFitEngine() const;
+
+        /// covariance of the Z fits (GetRefitM4lErrFullCov, refit pT errors), both engines:
+        ///  true:  inverse of the analytic hessian of the NLL at the minimum, no HESSE (default);
+        ///         HESSE only where the hessian is not positive definite
+        ///  false: Minuit HESSE
+        void SetAnalyticCovariance(bool analytic);
+
+        /// arithmetic of the kTabulatedEngine kernels
+        ///  kDoublePrecision:   double (default)
+        ///  kFloatPrecision:    float internally, results reported in double
+        ///  kValidatePrecision: double results; each candidate is also refitted in float
+        ///                      and the deviations are collected in the PrecisionReport;
+        ///                      the float refit is not in the latency, budget report,
+        ///                      fit recorder or disk cache
+        /// kTabulatedEngine only: with kRooFitEngine the fits stay double, nothing is validated
+        /// and the PrecisionReport stays empty (SetFitPrecision and SetFitEngine warn).
+        enum FitPrecision { kDoublePrecision = 0, kFloatPrecision = 1, kValidatePrecision = 2 };
+        /// also resets the PrecisionReport
+        void SetFitPrecision(FitPrecision precision);
+
+        /// float - double deviations over the candidates refitted in kValidatePrecision mode
+        struct PrecisionReport {
+
+               int nCandidates;
+               double maxDeltaM4l, maxDeltaMZ1, maxDeltaMZ2, maxDeltaM4lErr;
+               /// sum of (float - double) m4l, divided by nCandidates gives the bias
+               double sumDeltaM4l;
+               /// max |pT(float)/pT(double) - 1| of the refitted leptons
+               double maxRelDeltaPt;
+
+               };
+        PrecisionReport GetPrecisionReport();
+
+        /// latency bound of each Z fit, 0 for no limit (default)
+        ///  maxCalls:   likelihood evaluations of the minimization and error calculation
+        ///  maxSeconds: wall time of the fit; kTabulatedEngine stops the minimization, RooFit
+        ///              cannot be interrupted and only flags fits that took longer (kFitBudgetHit,
+        ///              the fitted result is kept)
+        /// A fit out of budget keeps the best point evaluated (the reco pTs if there is none)
+        /// with the input pT errors, and the candidate gets kFitBudgetHit; such results
+        /// are not cached. Also resets the BudgetReport.
+        void SetFitBudget(int maxCalls, double maxSeconds);
+
+        /// worst status of the Z fits of the current candidate
+        FitStatus GetFitStatus();
+
+        /// Z fits run with a budget since the last SetFitBudget (cached results not counted)
+        struct BudgetReport {
+
+               int nFits;
+               /// fits stopped by the call and by the time limit
+               int nCallsHit, nTimeHit;
+               /// budget hits without any point evaluated, using the reco pTs
+               int nRecoFallback;
+               /// fits by fraction of the budget used, bins of 0.1; the last bin are the hits
+               int usedFraction[11];
+
+               };
+        BudgetReport GetBudgetReport() const { return budgetReport_; }
+
+        /// time every Z minimization (cached results excluded) into latency histograms by
+        /// final state, number of fsr photons, lineshape model and one/two Zs fitted, keeping
+        /// the nSlowest slowest fits with their inputs; off by default. Also clears them.
+        void SetLatencyTracking(bool on, int nSlowest = 10);
+        /// this fitter's histograms, to be merged with FitLatency::Merge across threads
+        const FitLatency & GetLatency() const { return latency_; }
+
+        /// append the Z fits slower than minSeconds or not kFitOK to fileName (FitRecorder) with
+        /// their complete input, lineshape and configuration; one file per fitter, empty: off
+        void SetFitRecorder(const std::string &fileName, double minSeconds);
+
+        /// rerun a recorded Z fit with its lineshape and configuration (engine, precision, budget,
+        /// covariance method), without caches; engine and precision >= 0 replace the recorded
+        /// ones, useBudget false drops the recorded budget. Returns the record with the outcome (seconds, status, pT) of the rerun; the fitter's
+        /// own configuration and BudgetReport are unchanged.
+        FitRecorder::Record ReplayFit(const FitRecorder::Record &record, int engine = -1, int precision = -1, bool useBudget = true);
+
+        /// pay the first-fit costs up front, e.g. at module construction: the lineshape tables of
+        /// every final state of PDFName_ are tabulated in parallel on nThreads threads (0: all
+        /// cores, 1: on the calling thread) into the process-wide ParameterStore, so fitters built
+        /// later find them too;
+        /// with kRooFitEngine the three RooFit models are built and fitted once, which compiles
+        /// their formulas and sets up RooFit and the minimizer (serial, RooFit is not thread-safe).
+        /// The kTabulatedEngine needs no runtime formula compilation and no RooFit at all.
+        void Warmup(int nThreads = 0);
+
+        /// switch on/off the (pT, |eta|) pT error corrections of HelperFunction
+        void SetCorrPTerr(bool corr);
+
+        /// persistent store of Z fit results across jobs (see RefitDiskCache): fits found in storeFile
+        /// are not redone, new results are appended to journalFile (one per job, empty for read only)
+        /// and folded into the store with mergeRefitCache
+        void SetDiskCache(const std::string &storeFile, const std::string &journalFile = "");
+
+        /// clear the per-event caches (lepton/photon pT errors, Z fit results), call once
+        /// per event before the first Setup so that the caches are shared by all candidates
+        void ClearCache();
+
         int  PerZ1Likelihood(double & l1, double & l2, double & lph1, double & lph2);
         void SetZResult(double l1, double l2, double lph1, double lph2,
                         double l3, double l4, double lph3, double lph4);
@@ -82,6 +307,11 @@ public:
         double GetM4lErr();
         double GetRefitM4lErrFullCov();
 
+        /// covariance of the floating pTs of the Z1 (iZ = 1) or Z2 (iZ = 2) fit, the names of its
+        /// rows in names: pT1_lep, pT2_lep, then pT1_gamma, pT2_gamma if the photons float.
+        /// Empty if that Z was not fitted (Z2 below the cutoff)
+        TMatrixDSym GetRefitCovZ(int iZ, std::vector<TString> &names);
+
         // cov matrix change for spherical coordinate to Cartisean coordinates
 
         void SetZ1BigCov();
@@ -109,9 +339,33 @@ public:
 
 private:
 
+        // owns helperFunc_
+        KinZfitter(const KinZfitter &);
+        KinZfitter & operator=(const KinZfitter &);
+
         double cutoff_ = 182.3752;
         double mass4lRECO_ = -1;
 
+        /// Z pole and width
+        double bwMean_, bwGamma_;
+
+        /// covariance of the floating pTs of a Z fit, fixed size and on the stack: the first
+        /// size rows (pT1_lep, pT2_lep, then the floating pT1_gamma, pT2_gamma) are used
+        struct ZCovariance {
+
+               ROOT::Math::SMatrix<double, 4, 4, ROOT::Math::MatRepSym<double, 4> > matrix;
+               int size;
+
+               ZCovariance() : size(0) {}
+
+               double operator()(int i, int j) const { return matrix(i,j); }
+
+               /// from/to the matrices of RooFit and the public interface
+               void Set(const TMatrixDSym &from);
+               TMatrixDSym ToTMatrixDSym() const;
+
+               };
+
         struct FitInput {
 
                double pTRECO1_lep, pTRECO2_lep, pTErr1_lep, pTErr2_lep;
@@ -129,7 +383,10 @@ private:
                double pT1_lep, pT2_lep, pTErr1_lep, pTErr2_lep;
                double pT1_gamma, pT2_gamma, pTErr1_gamma, pTErr2_gamma;
           
-               TMatrixDSym covMatrixZ;       
+               // in the order pT1_lep, pT2_lep, pT1_gamma, pT2_gamma of the floating pTs
+               ZCovariance covMatrixZ;
+
+               FitStatus status;
 
                } fitOutput1, fitOutput2;
 
@@ -147,7 +404,10 @@ private:
         /// HelperFunction class to calcluate per lepton(+photon) pT error
         HelperFunction * helperFunc_;
 
-        void initZs(std::vector< reco::Candidate* > selectedLeptons, std::map<unsigned int, TLorentzVector> selectedFsrPhoton);
+        /// process-wide parameters, pT error maps and lineshape tables
+        boost::shared_ptr<const ParameterStore> store_;
+
+        void initZs(const RefitCandidate &candidate);
      
         void SetFitInput(FitInput &input,
                          vector<TLorentzVector> ZLep, vector<double> ZLepErr,
@@ -156,11 +416,126 @@ private:
         void SetFitOutput(FitInput &input, FitOutput &output,
                           double &l1, double &l2, double &lph1, double &lph2,
                           vector<double> &pTerrsREFIT_lep, vector<double> &pTerrsREFIT_gamma,
-                          TMatrixDSym &crovMatrixZ);
-
-        void Driver(FitInput &input, FitOutput &output);
-
-        void MakeModel(FitInput &input, FitOutput &output);
+                          ZCovariance &crovMatrixZ);
+
+        /// seed: optional previous result to start the minimization from
+        void Driver(FitInput &input, FitOutput &output, const FitOutput *seed = 0);
+
+        /// fit Z1 (and Z2 above cutoff_) with the current pairing
+        void RefitZs(const FitOutput *seed1, const FitOutput *seed2);
+
+        /// per Z fit budget, 0: none
+        int maxFitCalls_;
+        double maxFitSeconds_;
+        BudgetReport budgetReport_;
+        /// worst FitOutput status of the current candidate
+        FitStatus fitStatus_;
+        /// over-budget fit: pT (the reco pTs if 0) with the input pT errors
+        void SetBudgetFallback(FitInput &input, FitOutput &output, const double *pT, int size);
+        void CountBudget(double usedFraction, bool callsHit, bool timeHit, bool recoFallback);
+
+        bool trackLatency_;
+        FitLatency latency_;
+        /// category of a Z fit in the latency histograms
+        std::string LatencyCategory(const FitInput &input) const;
+
+        boost::shared_ptr<FitRecorder> recorder_;
+        double recordMinSeconds_;
+        void RecordFit(const FitInput &input, const FitOutput &output, double seconds);
+
+        PairingMode pairingMode_;
+        PairingReport pairingReport_;
+        /// kLikelihoodPairing: fit the pairings as needed and keep the one with the smaller NLL
+        void LikelihoodPairing();
+        /// the other same-flavour pairing: lepton 1 of Z1 with the opposite-charge lepton of Z2,
+        /// as in RepairZ1Z2 (fsr photons stay with their Z)
+        void SwapPairing(vector<TLorentzVector> &Z1Lep, vector<double> &Z1LepErr,
+                         vector<TLorentzVector> &Z2Lep, vector<double> &Z2LepErr,
+                         vector<int> &Z1id, vector<int> &Z2id);
+        /// NLL of a Z fit at its result, or without output the lower bound of the NLL over the fit ranges
+        double ZFitNLL(FitInput &input, const FitOutput *output);
+        template <int NGAMMA> double ZFitNLLN(FitInput &input, const FitOutput *output);
+
+        bool lazyRefit_;
+        /// KinRefitZ was called and the fits of the candidate are not done yet
+        bool refitPending_;
+        /// run the pending fits of the candidate, if any
+        void EnsureRefit();
+
+        /// read the true mZ1 shape parameters of PDFName_ and fs_
+        void ReadParamZ1();
+
+        /// per-event cache of Z fit results, Z's shared by several candidates are fitted once
+        struct ZFitKey {
+
+               // FitInput kinematics, pT errors and number of fsr photons
+               std::vector<double> values;
+               // lineshape model choice: parameter set, final state and BW/BWxCBxgauss
+               TString model;
+
+               bool operator<(const ZFitKey &other) const;
+
+               };
+
+        ZFitKey MakeZFitKey(FitInput &input);
+        void CopyFitOutput(const FitOutput &from, FitOutput &to);
+
+        std::map<ZFitKey, FitOutput> zFitCache_;
+        /// failsafe in case ClearCache() is never called between events
+        static const unsigned int maxZFitCacheSize_ = 1000;
+
+        /// persistent cache, the key adds the lineshape parameter values to the ZFitKey
+        boost::shared_ptr<RefitDiskCache> diskCache_;
+        RefitDiskCache::Key MakeDiskKey(const ZFitKey &key);
+        bool ReadDiskCache(const RefitDiskCache::Key &key, FitOutput &output);
+        void WriteDiskCache(const RefitDiskCache::Key &key, const FitOutput &output);
+
+        void MakeModel(FitInput &input, FitOutput &output, const FitOutput *seed = 0);
+
+        /// RooFit models of MakeModel by number of fsr photons, owned and reused across events
+        class RooFitZModel;
+        boost::shared_ptr<RooFitZModel> rooFitModels_[3];
+
+        /// kTabulatedEngine version of MakeModel, dispatches to the kernel for the number of fitted photons
+        void MakeModelTabulated(FitInput &input, FitOutput &output, const FitOutput *seed = 0);
+        template <int NGAMMA, typename T> void MakeModelTabulatedN(FitInput &input, FitOutput &output, const FitOutput *seed);
+
+        FitEngine fitEngine_;
+
+        FitPrecision fitPrecision_;
+        /// whether the tabulated engine runs the float kernels
+        bool floatKernel_;
+        PrecisionReport precisionReport_;
+        /// float refit of the current candidate, compared to the double one
+        void ValidatePrecision();
+        /// warn if a precision other than double is set with an engine that ignores it
+        void CheckFitPrecision();
+
+        /// KinRefitZVariations, warmStart: start from the nominal fit results
+        std::vector<RefitResult> RefitVariations(const std::vector<Variation> &variations, bool warmStart);
+
+        /// lineshape of the current candidate and the ZLikelihood matching MakeModel
+        const ZLineshape & FitLineshape();
+        /// number of fsr photons floating in the fit (none with the RelBW lineshape)
+        int FitNGamma(const FitInput &input) const;
+        template <int NGAMMA, typename T> void AddLikelihoodParticles(FitInput &input, ZLikelihood<NGAMMA, T> &nll);
+
+        bool analyticCovariance_;
+        /// analytic hessian of the Z fit NLL at pT (floating pTs in FitOutput order)
+        void ZFitHessian(FitInput &input, const double *pT, double H[4][4]);
+        template <int NGAMMA> void ZFitHessianN(FitInput &input, const double *pT, double H[4][4]);
+        /// covariance from the inverse hessian, false if it is not positive definite
+        bool AnalyticCovariance(FitInput &input, const double *pT, ZCovariance &cov);
+
+        /// d(fitted lepton pT)/d(pTRECO1, pTRECO2, pTErr1, pTErr2) of one Z fit
+        void ZFitSensitivity(FitInput &input, FitOutput &output, double dpT[4][2]);
+        template <int NGAMMA> void ZFitSensitivityN(FitInput &input, FitOutput &output, double dpT[4][2]);
+        /// refit masses for given lepton pTs
+        void RefitMasses(const double *pT, double &m4l, double &mZ1, double &mZ2);
+
+        /// lineshape tables by model and parameter values, taken from store_ on first use
+        std::map<std::vector<double>, boost::shared_ptr<const ZLineshape> > lineshapes_;
+        const ZLineshape & GetLineshape(ZLineshape::Model model);
 
 //        void UseModel(RooWorkspace &w, FitOutput &output, int nFsr);
 
@@ -185,9 +560,7 @@ private:
 
         // covariance matrix 
         // what directly coming from Refit
-        TMatrixDSym covMatrixZ1_, covMatrixZ2_, covMatrixZZ_;
-        // covariance matrix in the Cartesian coordinates
-        TMatrixDSym bigCovMatrix_;
+        ZCovariance covMatrixZ1_, covMatrixZ2_;
 
         // refit energy scale with respect to reco pT
         double lZ1_l1_, lZ1_l2_, lZ2_l1_, lZ2_l2_;
@@ -0,0 +1,72 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef KinZfitterAsync_h
+#define KinZfitterAsync_h
+
+#include <deque>
+#include <vector>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include <boost/shared_ptr.hpp>
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+
+/// Asynchronous refits: Submit returns at once with a future of the result,
+/// the fit runs on a pool of worker threads, each with its own KinZfitter
+/// (configured once by the configure callback), so the caller's own fitter
+/// state is never touched.
+/// At most maxInFlight candidates are queued or running; Submit blocks until
+/// one finishes when the limit is reached (TrySubmit returns false instead).
+/// RooFit is not thread-safe, even one worker would run it beside the caller:
+/// a configure callback choosing kRooFitEngine throws std::invalid_argument.
+class KinZfitterAsync {
+public:
+
+        KinZfitterAsync(bool isData, int nThreads, int maxInFlight,
+                        const std::function<void (KinZfitter &)> &configure = std::function<void (KinZfitter &)>());
+        /// finishes the submitted refits
+        ~KinZfitterAsync();
+
+        std::future<KinZfitter::RefitResult> Submit(const KinZfitter::RefitCandidate &candidate);
+        bool TrySubmit(const KinZfitter::RefitCandidate &candidate, std::future<KinZfitter::RefitResult> &result);
+
+        /// queued + running
+        int InFlight();
+        /// wait until nothing is in flight
+        void Wait();
+
+        /// latency histograms of all threads merged (SetLatencyTracking in configure), call after Wait()
+        FitLatency Latency() const;
+
+private:
+
+        KinZfitterAsync(const KinZfitterAsync &);
+        KinZfitterAsync & operator=(const KinZfitterAsync &);
+
+        struct Task {
+
+               KinZfitter::RefitCandidate candidate;
+               std::promise<KinZfitter::RefitResult> result;
+
+               };
+
+        std::future<KinZfitter::RefitResult> Enqueue(const KinZfitter::RefitCandidate &candidate);
+        void Work(int thread);
+
+        std::vector<boost::shared_ptr<KinZfitter> > fitters_;
+        std::vector<std::thread> threads_;
+
+        std::mutex mutex_;
+        std::condition_variable notEmpty_, notFull_;
+        std::deque<boost::shared_ptr<Task> > tasks_;
+        int inFlight_, maxInFlight_;
+        bool stop_;
+
+};
+
+#endif
@@ -0,0 +1,60 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef KinZfitterBatch_h
+#define KinZfitterBatch_h
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <functional>
+
+#include <boost/shared_ptr.hpp>
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+
+/// Refit of many candidates on several threads.
+/// Each thread owns a KinZfitter (configured once by the configure callback).
+/// Candidates are dealt to per-thread queues by decreasing EstimateFitCost, each
+/// thread takes the most expensive candidate of its own queue first and, when
+/// empty, steals the cheapest one of another queue. Results are in input order.
+/// If a refit throws, the threads stop and Refit rethrows the first exception.
+/// RooFit is not thread-safe: with kRooFitEngine the batch runs on one thread.
+class KinZfitterBatch {
+public:
+
+        KinZfitterBatch(bool isData, int nThreads,
+                        const std::function<void (KinZfitter &)> &configure = std::function<void (KinZfitter &)>());
+
+        /// Setup + KinRefitZ + GetRefitResult of each candidate
+        std::vector<KinZfitter::RefitResult> Refit(const std::vector<KinZfitter::RefitCandidate> &candidates);
+
+        int NThreads() const { return fitters_.size(); }
+
+        /// candidates done by each thread in the last Refit, and how many of them were stolen
+        const std::vector<int> & NDone() const { return nDone_; }
+        const std::vector<int> & NStolen() const { return nStolen_; }
+
+        /// latency histograms of all threads merged (SetLatencyTracking in configure)
+        FitLatency Latency() const;
+
+private:
+
+        struct Queue;
+
+        void Work(int thread, std::vector<Queue> &queues,
+                  const std::vector<KinZfitter::RefitCandidate> &candidates,
+                  std::vector<KinZfitter::RefitResult> &results);
+
+        std::vector<boost::shared_ptr<KinZfitter> > fitters_;
+        std::vector<int> nDone_, nStolen_;
+
+        /// first exception of a thread in the current Refit
+        std::mutex errorMutex_;
+        std::exception_ptr error_;
+        std::atomic<bool> failed_;
+
+};
+
+#endif
@@ -0,0 +1,75 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef ParameterStore_h
+#define ParameterStore_h
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "KinZfitter/HelperFunction/interface/HelperFunction.h"
+#include "KinZfitter/KinZfitter/interface/ZLineshape.h"
+
+/// Process-wide read-only store of the true mZ1 shape parameters (ParamZ1/*.txt),
+/// the pT error correction maps and the lineshape tables built from them.
+/// Loaded once per process and shared by all KinZfitter instances; everything
+/// except the lineshape table cache is immutable after construction and read
+/// without locks.
+/// The parameters and correction maps can instead be read from an image file
+/// (WriteImage), which is memory-mapped: processes forked after loading, or
+/// started on the same image, share its pages.
+class ParameterStore {
+public:
+
+        struct LineshapeParameters {
+
+               double sg, a, n, f;
+               double mean, sigma, f1;
+
+               };
+
+        /// the store of this process, built on first call
+        static boost::shared_ptr<const ParameterStore> Instance();
+
+        /// read the store from an image instead of ParamZ1 and HelperFunction/hists,
+        /// to be called before the first Instance()
+        static void SetImage(const std::string &fileName);
+
+        bool WriteImage(const std::string &fileName) const;
+
+        /// parameters of ParamZ1/<pdfName>_<fs>.txt, 0 if there is no such file
+        const LineshapeParameters * Parameters(const std::string &pdfName, const std::string &fs) const;
+
+        const HelperFunction::PtErrCorrectionTables & PtErrCorrections() const { return corrections_; }
+
+        /// lineshape table for these parameters, tabulated once per process; thread-safe,
+        /// different tables are tabulated concurrently
+        boost::shared_ptr<const ZLineshape> Lineshape(ZLineshape::Model model, const ZLineshape::Parameters &pars) const;
+
+private:
+
+        ParameterStore();
+        explicit ParameterStore(const std::string &imageFile);
+
+        ParameterStore(const ParameterStore &);
+        ParameterStore & operator=(const ParameterStore &);
+
+        void ReadParamZ1();
+        bool ReadImage(const std::string &imageFile);
+
+        static std::string imageFile_;
+
+        std::map<std::string, LineshapeParameters> parameters_;
+        HelperFunction::PtErrCorrectionTables corrections_;
+
+        /// the only mutable part, built on demand
+        mutable std::mutex lineshapeMutex_;
+        mutable std::map<std::vector<double>, boost::shared_ptr<const ZLineshape> > lineshapes_;
+
+};
+
+#endif
@@ -0,0 +1,97 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef RefitDiskCache_h
+#define RefitDiskCache_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/// Persistent store of Z fit results, addressed by a 128 bit hash of the fit input,
+/// the lineshape parameters and kFitterVersion.
+///
+/// Store file: header + records sorted by key, memory-mapped read only and searched
+/// in place. A store is never modified once written, Merge writes a new file and
+/// renames it over the old one, so any number of processes can read concurrently.
+/// Journal file: header + unsorted records appended by one writer process (one
+/// journal per job), folded into the store by Merge. Reopening a journal drops a
+/// truncated last record, and a journal of another version is started again.
+class RefitDiskCache {
+public:
+
+        /// bump when the fit changes, results of older versions are then no longer found
+        static const uint32_t kFitterVersion = 1;
+
+        struct Key {
+
+               uint64_t h[2];
+
+               bool operator<(const Key &other) const {
+                    return h[0] != other.h[0] ? h[0] < other.h[0] : h[1] < other.h[1];
+                    }
+               bool operator==(const Key &other) const { return h[0] == other.h[0] && h[1] == other.h[1]; }
+
+               };
+
+        /// compact Z fit result
+        struct Record {
+
+               Key key;
+               // pT1_lep, pT2_lep, pTErr1_lep, pTErr2_lep, pT1_gamma, pT2_gamma, pTErr1_gamma, pTErr2_gamma
+               double pT[8];
+               // upper triangle of the nCov x nCov covariance, row by row
+               double cov[10];
+               int32_t nCov;
+               int32_t reserved;
+
+               };
+
+        /// storeFile: merged store to read (may not exist yet);
+        /// journalFile: where new results are appended, empty for read only use
+        RefitDiskCache(const std::string &storeFile, const std::string &journalFile = "");
+        ~RefitDiskCache();
+
+        static Key MakeKey(const std::vector<double> &values, const std::string &model);
+
+        bool Find(const Key &key, Record &record) const;
+        /// append to the journal (no-op without journal)
+        void Append(const Record &record);
+
+        /// number of records in the mapped store
+        uint64_t Size() const { return nRecords_; }
+
+        /// merge stores and journals into output (which may be one of the inputs),
+        /// on duplicated keys the record of the first input is kept
+        static bool Merge(const std::vector<std::string> &inputs, const std::string &output);
+
+private:
+
+        RefitDiskCache(const RefitDiskCache &);
+        RefitDiskCache & operator=(const RefitDiskCache &);
+
+        struct Header {
+
+               char magic[4];
+               uint32_t version;
+               uint32_t recordSize;
+               uint32_t reserved;
+
+               };
+
+        static bool ReadFile(const std::string &fileName, std::vector<Record> &records);
+
+        /// check the header of the opened journal_ and append after its last complete record;
+        /// a journal of another version is started again, false if the file is not a journal
+        bool OpenJournal(const std::string &journalFile);
+
+        void *map_;
+        size_t mapSize_;
+        const Record *records_;
+        uint64_t nRecords_;
+
+        int journal_;
+
+};
+
+#endif
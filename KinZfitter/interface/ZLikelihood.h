@@ -0,0 +1,298 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef ZLikelihood_h
+#define ZLikelihood_h
+
+#include <cmath>
+#include <algorithm>
+
+#include "Math/IFunction.h"
+#include "KinZfitter/KinZfitter/interface/ZLineshape.h"
+
+/// NLL of one Z as a function of the fitted pTs of its two leptons and NGAMMA fsr photons,
+/// the same likelihood as the RooFit model of KinZfitter::MakeModel:
+/// gaussian pT constraints (normalized over the 5-500 GeV RECO pT range) for the
+/// leptons, times the mZ lineshape. The photons (massless, without constraint)
+/// only enter through mZ.
+/// The number of photons is a template parameter, so all arrays have their exact
+/// size and the loops have fixed trip counts; KinZfitter picks the instantiation
+/// once per Z. The lepton flavour only enters through the masses and the lineshape
+/// table and needs no specialization.
+/// T is the internal precision of the kinematics and constraints (the interface to
+/// Minuit2 and the lineshape table stay double): float for the fast mode.
+template <int NGAMMA, typename T = double>
+class ZLikelihood : public ROOT::Math::IMultiGradFunction {
+public:
+
+        enum { NLEP = 2, N = NLEP + NGAMMA };
+
+        explicit ZLikelihood(const ZLineshape &lineshape) : lineshape_(&lineshape) {}
+
+        /// lepton i (0, 1): pT constrained to pTRECO within pTErr
+        void SetLepton(int i, double pTRECO, double pTErr, double theta, double phi, double m) {
+
+             pTRECO_[i] = pTRECO; pTErr_[i] = pTErr;
+             mass2_[i] = T(m)*T(m);
+             SetDirection(i, theta, phi);
+
+        }
+
+        /// fsr photon i (0 .. NGAMMA-1), free pT
+        void SetPhoton(int i, double theta, double phi) { SetDirection(NLEP + i, theta, phi); }
+
+        /// opening angle terms, call once all particles are set
+        void Init() {
+
+             for (int i = 0; i < N; i++) {
+                 for (int j = 0; j < N; j++) c_[i][j] = T(cot_[i]*cot_[j] + cos(phi_[i]-phi_[j]));
+                 }
+
+        }
+
+        unsigned int NDim() const { return N; }
+        ROOT::Math::IMultiGradFunction * Clone() const { return new ZLikelihood(*this); }
+
+        /// mZ for the fitted pTs
+        double MassZ(const double *pT) const { T E[N]; return std::sqrt(MassZ2(pT, E)); }
+
+        void Gradient(const double *pT, double *grad) const { double f; FdF(pT, f, grad); }
+
+        void FdF(const double *pT, double &f, double *grad) const {
+
+             T E[N];
+             T mZ = std::sqrt(MassZ2(pT, E));
+
+             double dL, d2L;
+             f = lineshape_->NLL(mZ, dL, d2L);
+             T scale = mZ > 0 ? T(dL)/mZ : T(0);
+
+             for (int k = 0; k < N; k++) {
+
+                 // d(mZ^2)/dpT_k / 2
+                 T dEk = T(pT[k])*invSin2_[k]/E[k];
+                 T dM2 = 0;
+                 for (int j = 0; j < N; j++) {
+                     if (j != k) dM2 += dEk*E[j] - T(pT[j])*c_[k][j];
+                     }
+
+                 grad[k] = scale*dM2;
+
+                 }
+
+             for (int k = 0; k < NLEP; k++) {
+                 T dC;
+                 f += Constraint(k, pT[k], dC);
+                 grad[k] += dC;
+                 }
+
+        }
+
+        /// lower bound of the NLL over the box low <= pT <= high, without minimizing: the
+        /// smallest lineshape term over the mZ range of the box plus the smallest constraints.
+        /// Each pair term E_i E_j - pT_i pT_j c_ij of mZ^2 is bounded by E_i E_j at the box
+        /// corners (increasing in both pTs) and pT_i pT_j c_ij (bilinear) at its extreme corners
+        double LowerBound(const double *low, const double *high) const {
+
+             double m2Low = 0, m2High = 0;
+             for (int i = 0; i < NLEP; i++) { m2Low += mass2_[i]; m2High += mass2_[i]; }
+
+             double ELow[N], EHigh[N];
+             for (int i = 0; i < N; i++) {
+                 double m2 = i < NLEP ? double(mass2_[i]) : 0;
+                 ELow[i] = std::sqrt(low[i]*low[i]*invSin2_[i] + m2);
+                 EHigh[i] = std::sqrt(high[i]*high[i]*invSin2_[i] + m2);
+                 }
+
+             for (int i = 0; i < N; i++) {
+                 for (int j = i+1; j < N; j++) {
+                     double corners[4] = {low[i]*low[j], low[i]*high[j], high[i]*low[j], high[i]*high[j]};
+                     double pcMin = corners[0]*c_[i][j], pcMax = pcMin;
+                     for (int c = 1; c < 4; c++) {
+                         pcMin = std::min(pcMin, corners[c]*c_[i][j]);
+                         pcMax = std::max(pcMax, corners[c]*c_[i][j]);
+                         }
+                     m2Low += 2*(ELow[i]*ELow[j] - pcMax);
+                     m2High += 2*(EHigh[i]*EHigh[j] - pcMin);
+                     }
+                 }
+
+             double bound = lineshape_->MinNLL(std::sqrt(std::max(m2Low, 0.0)), std::sqrt(std::max(m2High, 0.0)));
+
+             // constraint: pull as small as the range allows, the normalization is unimodal in
+             // pT (largest half way between 5 and 500), smallest at an end of the range
+             const double sqrtHalfPi = sqrt(M_PI/2), invSqrt2 = 1/sqrt(2.0);
+             for (int k = 0; k < NLEP; k++) {
+
+                 double sigma = pTErr_[k];
+                 double pTRECO = pTRECO_[k];
+                 double pull = (pTRECO < low[k] ? low[k] - pTRECO : (pTRECO > high[k] ? pTRECO - high[k] : 0))/sigma;
+
+                 double norm[2];
+                 double ends[2] = {low[k], high[k]};
+                 for (int e = 0; e < 2; e++) {
+                     double zLow = (5 - ends[e])/sigma, zHigh = (500 - ends[e])/sigma;
+                     norm[e] = sigma*sqrtHalfPi*(erf(zHigh*invSqrt2) - erf(zLow*invSqrt2));
+                     }
+
+                 bound += 0.5*pull*pull + log(std::min(norm[0], norm[1]));
+
+                 }
+
+             return bound;
+
+        }
+
+        /// analytic second derivatives at pT, hess[k*N+l], in double whatever T; the lineshape
+        /// curvature is taken from its exact form, not the table
+        void Hessian(const double *pT, double *hess) const {
+
+             double p[N], E[N], dE[N], d2E[N];
+             for (int i = 0; i < N; i++) {
+                 p[i] = pT[i];
+                 double invSin2 = invSin2_[i];
+                 if (i < NLEP) {
+                    double m2 = mass2_[i];
+                    E[i] = std::sqrt(p[i]*p[i]*invSin2 + m2);
+                    dE[i] = p[i]*invSin2/E[i];
+                    d2E[i] = invSin2*m2/(E[i]*E[i]*E[i]);
+                    } else {
+                           dE[i] = std::sqrt(invSin2);
+                           E[i] = p[i]*dE[i];
+                           d2E[i] = 0;
+                           }
+                 }
+
+             double m2 = 0;
+             for (int i = 0; i < NLEP; i++) m2 += mass2_[i];
+             for (int i = 0; i < N; i++) {
+                 for (int j = i+1; j < N; j++) m2 += 2*(E[i]*E[j] - p[i]*p[j]*c_[i][j]);
+                 }
+             double mZ = std::sqrt(m2 > 0 ? m2 : 0);
+
+             double dL, d2L;
+             lineshape_->NLLExact(mZ, dL, d2L);
+
+             // h_k = d(mZ^2)/dpT_k / 2, dmZ/dpT_k = h_k/mZ
+             double h[N];
+             for (int k = 0; k < N; k++) {
+                 h[k] = 0;
+                 for (int j = 0; j < N; j++) if (j != k) h[k] += dE[k]*E[j] - p[j]*c_[k][j];
+                 }
+
+             for (int k = 0; k < N; k++) {
+                 for (int l = k; l < N; l++) {
+
+                     double hkl = 0;
+                     if (k == l) { for (int j = 0; j < N; j++) if (j != k) hkl += d2E[k]*E[j]; }
+                     else hkl = dE[k]*dE[l] - c_[k][l];
+
+                     // d2 NLL = L'' dmZ_k dmZ_l + L' d2mZ_kl
+                     double H = 0;
+                     if (mZ > 0) H = d2L*h[k]*h[l]/(mZ*mZ) + dL*(hkl/mZ - h[k]*h[l]/(mZ*mZ*mZ));
+                     if (k == l && k < NLEP) H += ConstraintD2(k, pT[k]);
+
+                     hess[k*N+l] = H;
+                     hess[l*N+k] = H;
+
+                     }
+                 }
+
+        }
+
+private:
+
+        void SetDirection(int i, double theta, double phi) {
+
+             invSin2_[i] = T(1/(sin(theta)*sin(theta)));
+             cot_[i] = cos(theta)/sin(theta); phi_[i] = phi;
+
+        }
+
+        double DoEval(const double *pT) const {
+
+             T E[N];
+             double f = lineshape_->NLL(std::sqrt(MassZ2(pT, E)));
+
+             for (int k = 0; k < NLEP; k++) {
+                 T dC;
+                 f += Constraint(k, pT[k], dC);
+                 }
+
+             return f;
+
+        }
+
+        double DoDerivative(const double *pT, unsigned int icoord) const {
+
+             double f, grad[N];
+             FdF(pT, f, grad);
+             return grad[icoord];
+
+        }
+
+        /// mZ^2 = sum m_i^2 + 2 sum_{i<j} (E_i E_j - pT_i pT_j (cot_i cot_j + cos(phi_i-phi_j)))
+        T MassZ2(const double *pT, T *E) const {
+
+             T p[N];
+             for (int i = 0; i < N; i++) p[i] = T(pT[i]);
+
+             T m2 = 0;
+             for (int i = 0; i < NLEP; i++) {
+                 E[i] = std::sqrt(p[i]*p[i]*invSin2_[i] + mass2_[i]);
+                 m2 += mass2_[i];
+                 }
+             for (int i = NLEP; i < N; i++) E[i] = p[i]*std::sqrt(invSin2_[i]);
+
+             for (int i = 0; i < N; i++) {
+                 for (int j = i+1; j < N; j++) m2 += 2*(E[i]*E[j] - p[i]*p[j]*c_[i][j]);
+                 }
+
+             return m2 > 0 ? m2 : T(0);
+
+        }
+
+        /// -log of the RooGaussian of pTRECO around pT, normalized over [5, 500]
+        T Constraint(int k, double pTd, T &d1) const {
+
+             const T sqrtHalfPi = T(sqrt(M_PI/2)), invSqrt2 = T(1/sqrt(2.0));
+             T pT = T(pTd);
+             T sigma = pTErr_[k];
+             T pull = (pTRECO_[k] - pT)/sigma;
+             T zLow = (T(5) - pT)/sigma, zHigh = (T(500) - pT)/sigma;
+
+             T eLow = std::exp(T(-0.5)*zLow*zLow);
+             T eHigh = std::exp(T(-0.5)*zHigh*zHigh);
+             T norm = sigma*sqrtHalfPi*(std::erf(zHigh*invSqrt2) - std::erf(zLow*invSqrt2));
+
+             d1 = -pull/sigma + (eLow - eHigh)/norm;
+             return T(0.5)*pull*pull + std::log(norm);
+
+        }
+
+        /// second derivative of Constraint, with the normalization term
+        double ConstraintD2(int k, double pT) const {
+
+             const double sqrtHalfPi = sqrt(M_PI/2), invSqrt2 = 1/sqrt(2.0);
+             double sigma = pTErr_[k];
+             double zLow = (5 - pT)/sigma, zHigh = (500 - pT)/sigma;
+
+             double eLow = exp(-0.5*zLow*zLow);
+             double eHigh = exp(-0.5*zHigh*zHigh);
+             double norm = sigma*sqrtHalfPi*(erf(zHigh*invSqrt2) - erf(zLow*invSqrt2));
+             double dLogNorm = (eLow - eHigh)/norm;
+
+             return 1/(sigma*sigma) + (zLow*eLow - zHigh*eHigh)/(sigma*norm) - dLogNorm*dLogNorm;
+
+        }
+
+        const ZLineshape *lineshape_;
+
+        T pTRECO_[NLEP], pTErr_[NLEP], mass2_[NLEP];
+        T invSin2_[N];
+        double cot_[N], phi_[N];
+        T c_[N][N];
+
+};
+
+#endif
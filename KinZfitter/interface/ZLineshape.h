@@ -0,0 +1,72 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef ZLineshape_h
+#define ZLineshape_h
+
+#include <vector>
+
+/// True mZ lineshape of MakeModel, as minus log of the value RooFit evaluates:
+/// the lineshape terms do not depend on the fitted observables (the RECO pTs),
+/// so RooFit uses them with unit normalization.
+///  RelBW:           1/( (mZ^2-bwMean^2)^2 + mZ^4 (bwGamma/bwMean)^2 )
+///  RelBWxCBxgauss:  f1*( f*RelBW + (1-f)*CB(mZ; bwMean, sg, a, n) ) + (1-f1)*gauss(mZ; mean, sigma)
+/// The minus log lineshape is tabulated at construction as a cubic Hermite spline
+/// with adaptive knots, checked against the exact form.
+class ZLineshape {
+public:
+
+        enum Model { kRelBW = 0, kRelBWxCBxgauss = 1 };
+
+        struct Parameters {
+
+               double bwMean, bwGamma;
+               double sg, a, n, f;
+               double mean, sigma, f1;
+
+               };
+
+        ZLineshape(Model model, const Parameters &pars);
+
+        /// -log(lineshape) at mZ and its first and second derivatives, from the table
+        double NLL(double mZ, double &d1, double &d2) const;
+        double NLL(double mZ) const { double d1, d2; return NLL(mZ, d1, d2); }
+
+        /// exact -log(lineshape) and first (and second) derivative
+        double NLLExact(double mZ, double &d1, double &d2) const;
+        double NLLExact(double mZ, double &d1) const { double d2; return NLLExact(mZ, d1, d2); }
+
+        /// lower bound of NLL (table or exact form) for mZ in [mLow, mHigh]: for RelBW, whose
+        /// -log is convex in mZ^2, the exact minimum less a margin for the table's interpolation
+        /// error; no bound (-DBL_MAX) for RelBWxCBxgauss
+        double MinNLL(double mLow, double mHigh) const;
+
+        /// maximum |table - exact| found by the check at construction
+        double MaxDeviation() const { return maxDeviation_; }
+        /// false if the check failed, NLL then uses the exact form
+        bool Tabulated() const { return tabulated_; }
+        int NKnots() const { return knots_.size(); }
+
+        Model GetModel() const { return model_; }
+        const Parameters & GetParameters() const { return pars_; }
+
+private:
+
+        void Tabulate();
+        void Refine(double xa, double ga, double da, double xb, double gb, double db);
+        static double Hermite(double s, double h, double g0, double d0, double g1, double d1);
+
+        Model model_;
+        Parameters pars_;
+
+        /// table range, tolerance on -log(lineshape) and smallest knot spacing
+        double mLow_, mHigh_, tolerance_, minStep_;
+
+        std::vector<double> knots_, values_, derivatives_;
+
+        bool tabulated_;
+        double maxDeviation_;
+
+};
+
+#endif
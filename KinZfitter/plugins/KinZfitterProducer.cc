@@ -0,0 +1,257 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+// Refit of ZZ candidates as an event product.
+//
+// Input: a collection of ZZ candidates, each with the two Zs as daughters (Z1 first)
+// and the leptons (|pdgId| 11, 13) and fsr photons (pdgId 22) as daughters of the Zs;
+// each photon belongs to the closest lepton of its Z.
+// fsrPhotons (optional): a ValueMap<reco::CandidatePtr> from the leptons to their fsr photon
+// (a null Ptr for none), as made by the analysis' fsr recovery; when given, the photons
+// among the Z daughters are ignored and each lepton takes the photon of the map, so the
+// lepton-photon assignment is the analysis' and not the closest-lepton guess. The leptons
+// are looked up through the master clone of the Z daughter, a lepton of another
+// collection than the map's has no photon.
+// Output: one entry per input candidate (-1 if the candidate does not have this structure)
+//   m4lREFIT, m4lREFITErr, mZ1REFIT, mZ2REFIT   vector<float>
+//   lepPtREFIT                                  vector<float>, 4 per candidate (Z1_1,Z1_2,Z2_1,Z2_2),
+//                                               refit lepton pTs with their fsr photons added (GetRefitP4s)
+//   refitStatus                                 vector<int>, KinZfitter::FitStatus (-1 if not refitted)
+// maxFitCalls/maxFitSeconds bound each Z fit (KinZfitter::SetFitBudget), 0 for no limit.
+// likelihoodPairing: Z1/Z2 pairing of 4e/4mu by the fit likelihood (KinZfitter::SetPairingMode).
+// warmupThreads: the lineshape tables are tabulated at construction (KinZfitter::Warmup),
+// 1: serially on the constructing thread (default); more threads are started outside the
+// framework's thread allotment, 0 for all cores; negative: on the first events instead.
+//
+// The module is global: every call builds its own KinZfitter with the tabulated fit
+// engine, which only shares the read-only ParameterStore, so events are refitted
+// concurrently without per-stream copies. The RooFit engine is not reentrant and
+// is not offered here.
+
+#include <memory>
+#include <vector>
+#include <map>
+
+#include "FWCore/Framework/interface/global/EDProducer.h"
+#include "FWCore/Framework/interface/Event.h"
+#include "FWCore/Framework/interface/MakerMacros.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/ParameterSet/interface/ConfigurationDescriptions.h"
+#include "FWCore/ParameterSet/interface/ParameterSetDescription.h"
+#include "FWCore/Utilities/interface/InputTag.h"
+
+#include "DataFormats/Candidate/interface/Candidate.h"
+#include "DataFormats/Candidate/interface/CandidateFwd.h"
+#include "DataFormats/Common/interface/View.h"
+#include "DataFormats/Common/interface/ValueMap.h"
+#include "DataFormats/Math/interface/deltaR.h"
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+
+class KinZfitterProducer : public edm::global::EDProducer<> {
+
+public:
+
+      explicit KinZfitterProducer(const edm::ParameterSet &iConfig);
+
+      static void fillDescriptions(edm::ConfigurationDescriptions &descriptions);
+
+private:
+
+      void produce(edm::StreamID, edm::Event &iEvent, const edm::EventSetup &iSetup) const override;
+
+      /// leptons and fsr photons of a ZZ candidate in the Setup format, false if not a ZZ candidate;
+      /// the photons from fsrMap if not null, else from the Z daughters
+      bool fillInputs(const reco::Candidate &zz, const edm::ValueMap<reco::CandidatePtr> *fsrMap,
+                      std::vector<reco::Candidate*> &leptons, std::map<unsigned int, TLorentzVector> &fsrPhotons) const;
+
+      const edm::EDGetTokenT<edm::View<reco::Candidate> > candidatesToken_;
+      const bool useFsrMap_;
+      edm::EDGetTokenT<edm::ValueMap<reco::CandidatePtr> > fsrToken_;
+      const bool isData_;
+      const bool corrPTerr_;
+      const int maxFitCalls_;
+      const double maxFitSeconds_;
+      const bool likelihoodPairing_;
+      const int warmupThreads_;
+
+};
+
+KinZfitterProducer::KinZfitterProducer(const edm::ParameterSet &iConfig)
+    : candidatesToken_(consumes<edm::View<reco::Candidate> >(iConfig.getParameter<edm::InputTag>("candidates"))),
+      useFsrMap_(!iConfig.getParameter<edm::InputTag>("fsrPhotons").label().empty()),
+      isData_(iConfig.getParameter<bool>("isData")),
+      corrPTerr_(iConfig.getParameter<bool>("corrPTerr")),
+      maxFitCalls_(iConfig.getParameter<int>("maxFitCalls")),
+      maxFitSeconds_(iConfig.getParameter<double>("maxFitSeconds")),
+      likelihoodPairing_(iConfig.getParameter<bool>("likelihoodPairing")),
+      warmupThreads_(iConfig.getParameter<int>("warmupThreads"))
+{
+
+      if (useFsrMap_) fsrToken_ = consumes<edm::ValueMap<reco::CandidatePtr> >(iConfig.getParameter<edm::InputTag>("fsrPhotons"));
+
+      // the tables go to the process-wide store shared by the per-event fitters
+      if (warmupThreads_ >= 0) {
+         KinZfitter kinZfitter(isData_);
+         kinZfitter.SetFitEngine(KinZfitter::kTabulatedEngine);
+         kinZfitter.Warmup(warmupThreads_);
+         }
+
+      produces<std::vector<float> >("m4lREFIT");
+      produces<std::vector<float> >("m4lREFITErr");
+      produces<std::vector<float> >("mZ1REFIT");
+      produces<std::vector<float> >("mZ2REFIT");
+      produces<std::vector<float> >("lepPtREFIT");
+      produces<std::vector<int> >("refitStatus");
+
+}
+
+void KinZfitterProducer::fillDescriptions(edm::ConfigurationDescriptions &descriptions)
+{
+
+      edm::ParameterSetDescription desc;
+      desc.add<edm::InputTag>("candidates", edm::InputTag("ZZCandidates"));
+      desc.add<edm::InputTag>("fsrPhotons", edm::InputTag());
+      desc.add<bool>("isData", false);
+      desc.add<bool>("corrPTerr", false);
+      desc.add<int>("maxFitCalls", 0);
+      desc.add<double>("maxFitSeconds", 0);
+      desc.add<bool>("likelihoodPairing", false);
+      desc.add<int>("warmupThreads", 1);
+      descriptions.add("kinZfitterProducer", desc);
+
+}
+
+bool KinZfitterProducer::fillInputs(const reco::Candidate &zz, const edm::ValueMap<reco::CandidatePtr> *fsrMap,
+                                    std::vector<reco::Candidate*> &leptons, std::map<unsigned int, TLorentzVector> &fsrPhotons) const
+{
+
+      if (zz.numberOfDaughters() != 2) return false;
+
+      for (unsigned int iz = 0; iz < 2; iz++) {
+
+          const reco::Candidate *z = zz.daughter(iz);
+
+          std::vector<const reco::Candidate*> zLeptons, zPhotons;
+          std::vector<reco::CandidateBaseRef> zLeptonRefs;
+          for (unsigned int i = 0; i < z->numberOfDaughters(); i++) {
+
+              // HelperFunction needs the concrete lepton types behind shallow clones
+              const reco::Candidate *d = z->daughter(i);
+              reco::CandidateBaseRef ref;
+              if (d->hasMasterClone()) { ref = d->masterClone(); d = ref.get(); }
+
+              int id = abs(d->pdgId());
+              if (id == 11 || id == 13) { zLeptons.push_back(d); zLeptonRefs.push_back(ref); }
+              if (id == 22) zPhotons.push_back(d);
+
+              }
+
+          if (zLeptons.size() != 2) return false;
+
+          for (unsigned int il = 0; il < 2; il++) leptons.push_back(const_cast<reco::Candidate*>(zLeptons[il]));
+
+          if (fsrMap) {
+
+             for (unsigned int il = 0; il < 2; il++) {
+
+                 const reco::CandidateBaseRef &ref = zLeptonRefs[il];
+                 if (ref.isNull() || !fsrMap->contains(ref.id())) continue;
+
+                 const reco::CandidatePtr &ph = fsrMap->get(ref.id(), ref.key());
+                 if (ph.isNull()) continue;
+
+                 TLorentzVector p4;
+                 p4.SetPxPyPzE(ph->px(), ph->py(), ph->pz(), ph->energy());
+                 fsrPhotons[2*iz + il] = p4;
+
+                 }
+
+             continue;
+
+             }
+
+          for (unsigned int ip = 0; ip < zPhotons.size(); ip++) {
+
+              const reco::Candidate *ph = zPhotons[ip];
+              double dR1 = reco::deltaR(ph->eta(), ph->phi(), zLeptons[0]->eta(), zLeptons[0]->phi());
+              double dR2 = reco::deltaR(ph->eta(), ph->phi(), zLeptons[1]->eta(), zLeptons[1]->phi());
+              unsigned int index = 2*iz + (dR1 <= dR2 ? 0 : 1);
+
+              TLorentzVector p4;
+              p4.SetPxPyPzE(ph->px(), ph->py(), ph->pz(), ph->energy());
+
+              // one photon per lepton, the hardest one
+              if (fsrPhotons[index].Pt() < p4.Pt()) fsrPhotons[index] = p4;
+
+              }
+
+          }
+
+      return true;
+
+}
+
+void KinZfitterProducer::produce(edm::StreamID, edm::Event &iEvent, const edm::EventSetup &iSetup) const
+{
+
+      edm::Handle<edm::View<reco::Candidate> > candidates;
+      iEvent.getByToken(candidatesToken_, candidates);
+
+      edm::Handle<edm::ValueMap<reco::CandidatePtr> > fsrMap;
+      if (useFsrMap_) iEvent.getByToken(fsrToken_, fsrMap);
+
+      std::unique_ptr<std::vector<float> > m4l(new std::vector<float>());
+      std::unique_ptr<std::vector<float> > m4lErr(new std::vector<float>());
+      std::unique_ptr<std::vector<float> > mZ1(new std::vector<float>());
+      std::unique_ptr<std::vector<float> > mZ2(new std::vector<float>());
+      std::unique_ptr<std::vector<float> > lepPt(new std::vector<float>());
+      std::unique_ptr<std::vector<int> > status(new std::vector<int>());
+
+      // per call, shares only the read-only parameter store with other events
+      KinZfitter kinZfitter(isData_);
+      kinZfitter.SetFitEngine(KinZfitter::kTabulatedEngine);
+      kinZfitter.SetCorrPTerr(corrPTerr_);
+      kinZfitter.SetFitBudget(maxFitCalls_, maxFitSeconds_);
+      if (likelihoodPairing_) kinZfitter.SetPairingMode(KinZfitter::kLikelihoodPairing);
+      // Zs shared by several candidates of the event are fitted once
+      kinZfitter.ClearCache();
+
+      for (unsigned int ic = 0; ic < candidates->size(); ic++) {
+
+          std::vector<reco::Candidate*> leptons;
+          std::map<unsigned int, TLorentzVector> fsrPhotons;
+
+          if (!fillInputs((*candidates)[ic], useFsrMap_ ? fsrMap.product() : 0, leptons, fsrPhotons)) {
+
+             m4l->push_back(-1); m4lErr->push_back(-1); mZ1->push_back(-1); mZ2->push_back(-1);
+             for (int i = 0; i < 4; i++) lepPt->push_back(-1);
+             status->push_back(-1);
+             continue;
+
+             }
+
+          kinZfitter.Setup(leptons, fsrPhotons);
+          kinZfitter.KinRefitZ();
+          KinZfitter::RefitResult result = kinZfitter.GetRefitResult();
+
+          m4l->push_back(result.m4l);
+          m4lErr->push_back(result.m4lErr);
+          mZ1->push_back(result.mZ1);
+          mZ2->push_back(result.mZ2);
+          status->push_back(result.status);
+
+          for (int i = 0; i < 4; i++) lepPt->push_back(i < int(result.p4s.size()) ? result.p4s[i].Pt() : -1);
+
+          }
+
+      iEvent.put(std::move(m4l), "m4lREFIT");
+      iEvent.put(std::move(m4lErr), "m4lREFITErr");
+      iEvent.put(std::move(mZ1), "mZ1REFIT");
+      iEvent.put(std::move(mZ2), "mZ2REFIT");
+      iEvent.put(std::move(lepPt), "lepPtREFIT");
+      iEvent.put(std::move(status), "refitStatus");
+
+}
+
+DEFINE_FWK_MODULE(KinZfitterProducer);
@@ -0,0 +1,205 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#include "KinZfitter/KinZfitter/interface/FitLatency.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+using namespace std;
+
+namespace {
+
+  bool Slower(const FitLatency::SlowFit &a, const FitLatency::SlowFit &b) { return a.seconds > b.seconds; }
+
+}
+
+FitLatency::FitLatency(int nSlowest) : nSlowest_(max(nSlowest, 0)) {}
+
+int FitLatency::Bucket(double seconds) {
+
+     // ns, at least 1
+     double ns = max(seconds*1e9, 1.0);
+     int exponent;
+     double mantissa = frexp(ns, &exponent); // ns = mantissa * 2^exponent, mantissa in [0.5, 1)
+
+     int sub = int((mantissa - 0.5)*2*(1 << kSubBits));
+     int bucket = ((exponent - 1) << kSubBits) + min(sub, (1 << kSubBits) - 1);
+
+     return min(bucket, (kExponents << kSubBits) - 1);
+
+}
+
+double FitLatency::BucketValue(int bucket) {
+
+     int exponent = (bucket >> kSubBits) + 1, sub = bucket & ((1 << kSubBits) - 1);
+     double mantissa = 0.5 + (sub + 1)/double(2*(1 << kSubBits));
+
+     return ldexp(mantissa, exponent)*1e-9;
+
+}
+
+void FitLatency::Add(const std::string &category, double seconds, const std::vector<double> &input) {
+
+     Histogram &histogram = histograms_[category];
+     histogram.counts[Bucket(seconds)]++;
+     histogram.total++;
+     histogram.max = max(histogram.max, seconds);
+
+     if (nSlowest_ == 0) return;
+     if (int(slowest_.size()) == nSlowest_ && seconds <= slowest_.front().seconds) return;
+
+     SlowFit fit;
+     fit.seconds = seconds;
+     fit.category = category;
+     fit.input = input;
+
+     // the fastest of the kept fits on top
+     slowest_.push_back(fit);
+     push_heap(slowest_.begin(), slowest_.end(), Slower);
+     if (int(slowest_.size()) > nSlowest_) {
+        pop_heap(slowest_.begin(), slowest_.end(), Slower);
+        slowest_.pop_back();
+        }
+
+}
+
+void FitLatency::Merge(const FitLatency &other) {
+
+     for (std::map<std::string, Histogram>::const_iterator it = other.histograms_.begin(); it != other.histograms_.end(); ++it) {
+
+         Histogram &histogram = histograms_[it->first];
+         for (unsigned int i = 0; i < histogram.counts.size(); i++) histogram.counts[i] += it->second.counts[i];
+         histogram.total += it->second.total;
+         histogram.max = max(histogram.max, it->second.max);
+
+         }
+
+     for (unsigned int i = 0; i < other.slowest_.size(); i++) {
+
+         const SlowFit &fit = other.slowest_[i];
+         if (nSlowest_ == 0) break;
+         if (int(slowest_.size()) == nSlowest_ && fit.seconds <= slowest_.front().seconds) continue;
+
+         slowest_.push_back(fit);
+         push_heap(slowest_.begin(), slowest_.end(), Slower);
+         if (int(slowest_.size()) > nSlowest_) {
+            pop_heap(slowest_.begin(), slowest_.end(), Slower);
+            slowest_.pop_back();
+            }
+
+         }
+
+}
+
+void FitLatency::Clear() {
+
+     histograms_.clear();
+     slowest_.clear();
+
+}
+
+std::vector<std::string> FitLatency::Categories() const {
+
+     std::vector<std::string> categories;
+     for (std::map<std::string, Histogram>::const_iterator it = histograms_.begin(); it != histograms_.end(); ++it) categories.push_back(it->first);
+     return categories;
+
+}
+
+FitLatency::Histogram FitLatency::Total() const {
+
+     Histogram total;
+     for (std::map<std::string, Histogram>::const_iterator it = histograms_.begin(); it != histograms_.end(); ++it) {
+         for (unsigned int i = 0; i < total.counts.size(); i++) total.counts[i] += it->second.counts[i];
+         total.total += it->second.total;
+         total.max = max(total.max, it->second.max);
+         }
+
+     return total;
+
+}
+
+long FitLatency::Count(const std::string &category) const {
+
+     if (category == "") return Total().total;
+
+     std::map<std::string, Histogram>::const_iterator it = histograms_.find(category);
+     return it == histograms_.end() ? 0 : it->second.total;
+
+}
+
+double FitLatency::Quantile(const Histogram &histogram, double q) {
+
+     if (histogram.total == 0) return 0;
+
+     // smallest bucket with at least q of the fits at or below it
+     long rank = max(long(ceil(q*histogram.total)), 1L), sum = 0;
+     for (unsigned int i = 0; i < histogram.counts.size(); i++) {
+         sum += histogram.counts[i];
+         if (sum >= rank) return min(BucketValue(i), histogram.max);
+         }
+
+     return histogram.max;
+
+}
+
+double FitLatency::Quantile(double q, const std::string &category) const {
+
+     if (category == "") return Quantile(Total(), q);
+
+     std::map<std::string, Histogram>::const_iterator it = histograms_.find(category);
+     return it == histograms_.end() ? 0 : Quantile(it->second, q);
+
+}
+
+double FitLatency::Max(const std::string &category) const {
+
+     if (category == "") return Total().max;
+
+     std::map<std::string, Histogram>::const_iterator it = histograms_.find(category);
+     return it == histograms_.end() ? 0 : it->second.max;
+
+}
+
+std::vector<FitLatency::SlowFit> FitLatency::Slowest() const {
+
+     std::vector<SlowFit> slowest = slowest_;
+     sort(slowest.begin(), slowest.end(), Slower);
+     return slowest;
+
+}
+
+void FitLatency::Print(std::ostream &out) const {
+
+     std::vector<std::string> categories = Categories();
+     categories.push_back("");
+
+     out << "Z fit latency (us)" << endl;
+     out << setw(36) << left << "category" << right << setw(10) << "fits" << setw(10) << "p50"
+         << setw(10) << "p99" << setw(10) << "p99.9" << setw(10) << "max" << endl;
+
+     for (unsigned int i = 0; i < categories.size(); i++) {
+
+         const std::string &c = categories[i];
+         out << setw(36) << left << (c == "" ? "all" : c) << right << setw(10) << Count(c) << fixed << setprecision(1)
+             << setw(10) << 1e6*Quantile(0.5, c) << setw(10) << 1e6*Quantile(0.99, c)
+             << setw(10) << 1e6*Quantile(0.999, c) << setw(10) << 1e6*Max(c) << endl;
+
+         }
+
+     std::vector<SlowFit> slowest = Slowest();
+     if (!slowest.empty()) out << "slowest fits (us, category, input)" << endl;
+
+     for (unsigned int i = 0; i < slowest.size(); i++) {
+
+         out << setprecision(1) << 1e6*slowest[i].seconds << " " << slowest[i].category << setprecision(6);
+         for (unsigned int j = 0; j < slowest[i].input.size(); j++) out << " " << slowest[i].input[j];
+         out << endl;
+
+         }
+
+     out.unsetf(ios::fixed);
+
+}
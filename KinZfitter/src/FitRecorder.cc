@@ -0,0 +1,115 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#include "KinZfitter/KinZfitter/interface/FitRecorder.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+  const char kRecorderMagic[4] = {'K', 'Z', 'F', 'R'};
+
+  bool WriteAll(int fd, const void *data, size_t size) {
+
+     const char *p = static_cast<const char*>(data);
+     while (size > 0) {
+           ssize_t n = write(fd, p, size);
+           if (n <= 0) return false;
+           p += n; size -= n;
+           }
+     return true;
+
+  }
+
+}
+
+FitRecorder::FitRecorder(const string &fileName) : fd_(-1)
+{
+
+     fd_ = open(fileName.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+     if (fd_ < 0) { cout << "FitRecorder: cannot open " << fileName << endl; return; }
+
+     if (!OpenFile(fileName)) {
+        close(fd_);
+        fd_ = -1;
+        }
+
+}
+
+bool FitRecorder::OpenFile(const string &fileName) {
+
+     struct stat st;
+     if (fstat(fd_, &st) != 0) { cout << "FitRecorder: cannot stat " << fileName << endl; return false; }
+
+     Header header;
+     bool hasHeader = size_t(st.st_size) >= sizeof(Header) && pread(fd_, &header, sizeof(header), 0) == ssize_t(sizeof(header));
+
+     if (hasHeader && memcmp(header.magic, kRecorderMagic, 4) != 0) {
+        cout << "FitRecorder: " << fileName << " is not a recorder file, not written" << endl;
+        return false;
+        }
+
+     if (hasHeader && header.version == kVersion && header.recordSize == sizeof(Record)) {
+
+        // a job killed while writing leaves a partial record, the next ones would be misaligned
+        off_t complete = sizeof(Header) + (st.st_size - sizeof(Header))/sizeof(Record)*sizeof(Record);
+        if (complete != st.st_size) {
+           cout << "FitRecorder: truncated record at the end of " << fileName << " dropped" << endl;
+           if (ftruncate(fd_, complete) != 0) { cout << "FitRecorder: cannot truncate " << fileName << endl; return false; }
+           }
+
+        return true;
+
+        }
+
+     // empty, a partial header or another version, whose records Read would refuse anyway
+     if (st.st_size > 0) cout << "FitRecorder: " << fileName << " is not a version " << kVersion << " recorder file, started again" << endl;
+     if (ftruncate(fd_, 0) != 0) { cout << "FitRecorder: cannot truncate " << fileName << endl; return false; }
+
+     memcpy(header.magic, kRecorderMagic, 4);
+     header.version = kVersion; header.recordSize = sizeof(Record); header.reserved = 0;
+     return WriteAll(fd_, &header, sizeof(header));
+
+}
+
+FitRecorder::~FitRecorder() {
+
+     if (fd_ >= 0) close(fd_);
+
+}
+
+void FitRecorder::Write(const Record &record) {
+
+     // one write per record, O_APPEND keeps records whole
+     if (fd_ >= 0 && !WriteAll(fd_, &record, sizeof(record)))
+        cout << "FitRecorder: write failed" << endl;
+
+}
+
+bool FitRecorder::Read(const string &fileName, vector<Record> &records) {
+
+     FILE *file = fopen(fileName.c_str(), "rb");
+     if (!file) return false;
+
+     Header header;
+     bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, kRecorderMagic, 4) == 0
+               && header.version == kVersion && header.recordSize == sizeof(Record);
+
+     if (ok) {
+        Record record;
+        // a truncated last record is dropped
+        while (fread(&record, sizeof(record), 1, file) == 1) records.push_back(record);
+        }
+
+     fclose(file);
+     return ok;
+
+}
@@ -7,12 +7,20 @@
 /// KinFitter header
 #include "KinZfitter/KinZfitter/interface/KinZfitter.h"
 #include "KinZfitter/HelperFunction/interface/HelperFunction.h"
+#include "KinZfitter/KinZfitter/interface/ZLikelihood.h"
+#include "KinZfitter/KinZfitter/src/RooFitZModel.h"
+#include "KinZfitter/KinZfitter/interface/FitBudget.h"
 #include "DataFormats/Math/interface/deltaR.h"
+#include "Minuit2/Minuit2Minimizer.h"
 #include "RooWorkspace.h"
 #include "RooProduct.h"
 #include "RooProdPdf.h"
 #include "FWCore/ParameterSet/interface/FileInPath.h"
 #include "time.h"
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
 ///----------------------------------------------------------------------------------------------
 /// KinZfitter::KinZfitter - constructor/
 ///----------------------------------------------------------------------------------------------
@@ -26,17 +34,86 @@ KinZfitter::KinZfitter(bool isData)
 
      if(debug_) std::cout << "KinZfitter. The debug flag is ON with "<<PDFName_<< std::endl;
 	
+     /// parameters and pT error maps shared by all instances
+     store_ = ParameterStore::Instance();
+
      /// Initialise HelperFunction
      helperFunc_ = new HelperFunction();
-     isCorrPTerr_ = true; 
+     helperFunc_->setPtErrCorrections(store_->PtErrCorrections());
      isData_ = isData; 
+     SetCorrPTerr(false);
+
+     fitEngine_ = kRooFitEngine;
+     SetFitPrecision(kDoublePrecision);
+     analyticCovariance_ = true;
+
+     lazyRefit_ = false;
+     refitPending_ = false;
+
+     SetPairingMode(kMassPairing);
+
+     SetFitBudget(0, 0);
+     fitStatus_ = kFitOK;
+
+     SetLatencyTracking(false);
+     recordMinSeconds_ = 0;
+
+     bwMean_ = 91.187; bwGamma_ = 2.5;
+
+}
+
+KinZfitter::~KinZfitter()
+{
+
+     delete helperFunc_;
 
 }
 
 
 void KinZfitter::Setup(std::vector< reco::Candidate* > selectedLeptons, std::map<unsigned int, TLorentzVector> selectedFsrPhotons){
 
+     Setup(MakeRefitCandidate(selectedLeptons, selectedFsrPhotons));
+
+}
+
+KinZfitter::RefitCandidate KinZfitter::MakeRefitCandidate(std::vector< reco::Candidate* > selectedLeptons, std::map<unsigned int, TLorentzVector> selectedFsrPhotons){
+
+     RefitCandidate candidate;
+
+     if(debug_) cout<<"init leptons"<<endl;
+
+     for(unsigned int il = 0; il<selectedLeptons.size() && il<4; il++)
+      {
+         reco::Candidate * c = selectedLeptons[il];
+         candidate.pTErrs[il] = helperFunc_->pterrCached(c ,  isData_);
+         candidate.leptons[il].SetPxPyPzE(c->px(),c->py(),c->pz(),c->energy());
+         candidate.ids[il] = c->pdgId();
+
+         if(debug_) cout<<"pdg id "<<candidate.ids[il]<<endl;
+      }
+
+     if(debug_) cout<<"init fsr photons"<<endl;
+
+     for(unsigned int ifsr = 0; ifsr<4; ifsr++)
+      {
+         candidate.fsrPhotons[ifsr] = selectedFsrPhotons[ifsr];
+         candidate.fsrPTErrs[ifsr] = 0;
+         if(candidate.fsrPhotons[ifsr].Pt()==0) continue;
+
+         candidate.fsrPTErrs[ifsr] = helperFunc_->pterrCached(candidate.fsrPhotons[ifsr]);
+
+         if(debug_) cout<<"ifsr "<<ifsr<<" pt err is "<<candidate.fsrPTErrs[ifsr]<<endl;
+      }
+
+     return candidate;
+
+}
+
+void KinZfitter::Setup(const KinZfitter::RefitCandidate &candidate){
+
      // reset everything for each event
+     refitPending_ = false;
+     fitStatus_ = kFitOK;
      idsZ1_.clear(); idsZ2_.clear();      
      idsFsrZ1_.clear(); idsFsrZ2_.clear();
 
@@ -46,7 +123,7 @@ void KinZfitter::Setup(std::vector< reco::Candidate* > selectedLeptons, std::map
      pTerrsZ1_.clear(); pTerrsZ2_.clear(); pTerrsZ1ph_.clear(); pTerrsZ2ph_.clear();
      pTerrsZ1REFIT_.clear(); pTerrsZ2REFIT_.clear(); pTerrsZ1phREFIT_.clear(); pTerrsZ2phREFIT_.clear();
 
-     initZs(selectedLeptons, selectedFsrPhotons);
+     initZs(candidate);
 
      if(debug_) cout<<"list ids"<<endl;
      if(debug_) cout<<"IDs[0] "<<idsZ1_[0]<<" IDs[1] "<<idsZ1_[1]<<" IDs[2] "<<idsZ2_[0]<<" IDs[3] "<<idsZ2_[1]<<endl;
@@ -59,95 +136,464 @@ void KinZfitter::Setup(std::vector< reco::Candidate* > selectedLeptons, std::map
 
      if(debug_) cout<<"fs is "<<fs_<<endl;
 
-     /////////////
-     edm::FileInPath pdfFileWithFullPath("KinZfitter/KinZfitter/ParamZ1/dummy.txt");     
-     string paramZ1_dummy = pdfFileWithFullPath.fullPath(); 
-    
-     TString paramZ1 = TString( paramZ1_dummy.substr(0,paramZ1_dummy.length() - 9));
+     // no lineshape for it, the fit would run with the parameters of the previous candidate
+     if(fs_=="") throw std::invalid_argument("KinZfitter::Setup: the candidate leptons are not electrons or muons");
+
+     ReadParamZ1();
 
-     paramZ1+=PDFName_;
-     paramZ1+="_";
-     paramZ1+=+fs_;
-     paramZ1+=".txt";
+}
 
-     if(debug_) cout<<"paramZ1 in "<<paramZ1<<endl;
+void KinZfitter::ReadParamZ1(){
 
-     std::ifstream input(paramZ1);
-     std::string line;
-     while (!input.eof() && std::getline(input,line))
-      {
-         std::istringstream iss(line);
-         string p; double val;
-         if(iss >> p >> val) {
-          if(p=="sg")  { sgVal_ = val; }//cout<<"sg is "<<sgVal_<<endl;}
-          if(p=="a" )  { aVal_ = val;  }//cout<<"a is  "<<aVal_<<endl;}
-          if(p=="n" )  { nVal_ = val;  }//cout<<"n is  "<<nVal_<<endl;}
-          if(p=="f")   { fVal_ = val;  }//cout<<"f is  "<<fVal_<<endl;}
-
-          if(p=="mean" )  { meanVal_ = val;  }//cout<<"mean is  "<<meanVal_<<endl;}
-          if(p=="sigma" )  { sigmaVal_ = val;  }//cout<<"sigma is  "<<sigmaVal_<<endl;}
-          if(p=="f1")   { f1Val_ = val;  }//cout<<"f1 is  "<<f1Val_<<endl;}
+     const ParameterStore::LineshapeParameters *pars = store_->Parameters(PDFName_.Data(), fs_.Data());
+
+     if(debug_) cout<<"paramZ1 of "<<PDFName_<<"_"<<fs_<<endl;
+
+     if(!pars) { cout<<"KinZfitter: no parameters ParamZ1/"<<PDFName_<<"_"<<fs_<<".txt"<<endl; return; }
+
+     sgVal_ = pars->sg; aVal_ = pars->a; nVal_ = pars->n; fVal_ = pars->f;
+     meanVal_ = pars->mean; sigmaVal_ = pars->sigma; f1Val_ = pars->f1;
+
+}
+
+
+
+void KinZfitter::SetZPole(double bwMean, double bwGamma){
+
+     bwMean_ = bwMean; bwGamma_ = bwGamma;
+
+}
+
+void KinZfitter::SetFitEngine(KinZfitter::FitEngine engine){
+
+     fitEngine_ = engine;
+     CheckFitPrecision();
+
+}
+
+KinZfitter::FitEngine KinZfitter::GetFitEngine() const {
+
+     return fitEngine_;
+
+}
+
+void KinZfitter::SetFitPrecision(KinZfitter::FitPrecision precision){
+
+     fitPrecision_ = precision;
+     floatKernel_ = precision == kFloatPrecision;
+     CheckFitPrecision();
+
+     precisionReport_.nCandidates = 0;
+     precisionReport_.maxDeltaM4l = 0; precisionReport_.sumDeltaM4l = 0;
+     precisionReport_.maxDeltaMZ1 = 0; precisionReport_.maxDeltaMZ2 = 0;
+     precisionReport_.maxDeltaM4lErr = 0; precisionReport_.maxRelDeltaPt = 0;
+
+}
+
+void KinZfitter::CheckFitPrecision(){
+
+     if (fitPrecision_ != kDoublePrecision && fitEngine_ != kTabulatedEngine)
+        cout << "KinZfitter: the fit precision only applies to kTabulatedEngine (set the engine first), "
+             << "the RooFit fits run in double and nothing is validated" << endl;
+
+}
+
+KinZfitter::PrecisionReport KinZfitter::GetPrecisionReport(){
+
+     return precisionReport_;
+
+}
+
+void KinZfitter::SetFitBudget(int maxCalls, double maxSeconds){
+
+     maxFitCalls_ = max(maxCalls, 0);
+     maxFitSeconds_ = max(maxSeconds, 0.0);
+
+     budgetReport_.nFits = 0;
+     budgetReport_.nCallsHit = 0; budgetReport_.nTimeHit = 0; budgetReport_.nRecoFallback = 0;
+     for (int i = 0; i < 11; i++) budgetReport_.usedFraction[i] = 0;
+
+}
+
+KinZfitter::FitStatus KinZfitter::GetFitStatus(){
+
+     EnsureRefit();
+     return fitStatus_;
+
+}
+
+void KinZfitter::SetAnalyticCovariance(bool analytic){
+
+     analyticCovariance_ = analytic;
+
+}
+
+void KinZfitter::SetLatencyTracking(bool on, int nSlowest){
+
+     trackLatency_ = on;
+     latency_ = FitLatency(nSlowest);
+
+}
+
+std::string KinZfitter::LatencyCategory(const KinZfitter::FitInput &input) const {
+
+     // same model choice as MakeModel
+     TString category = TString::Format("%s_nFsr%d_%s_%s", fs_.Data(), min(max(input.nFsr, 0), 2),
+                                        mass4lRECO_ > 140 ? "RelBW" : "RelBWxCBxgauss",
+                                        mass4lRECO_ > cutoff_ ? "2Z" : "1Z");
+     return std::string(category.Data());
+
+}
+
+void KinZfitter::SetFitRecorder(const std::string &fileName, double minSeconds){
+
+     recorder_.reset();
+     recordMinSeconds_ = minSeconds;
+     if (!fileName.empty()) recorder_.reset(new FitRecorder(fileName));
+
+}
+
+void KinZfitter::RecordFit(const KinZfitter::FitInput &input, const KinZfitter::FitOutput &output, double seconds){
+
+     FitRecorder::Record record;
+     memset(&record, 0, sizeof(record));
+
+     double pTRECO[4] = {input.pTRECO1_lep, input.pTRECO2_lep, input.pTRECO1_gamma, input.pTRECO2_gamma};
+     double pTErr[4] = {input.pTErr1_lep, input.pTErr2_lep, input.pTErr1_gamma, input.pTErr2_gamma};
+     double theta[4] = {input.theta1_lep, input.theta2_lep, input.theta1_gamma, input.theta2_gamma};
+     double phi[4] = {input.phi1_lep, input.phi2_lep, input.phi1_gamma, input.phi2_gamma};
+     for (int i = 0; i < 4; i++) {
+         record.pTRECO[i] = pTRECO[i]; record.pTErr[i] = pTErr[i];
+         record.theta[i] = theta[i]; record.phi[i] = phi[i];
          }
-      }
+     record.m[0] = input.m1; record.m[1] = input.m2;
+     record.nFsr = input.nFsr;
+
+     record.mass4lRECO = mass4lRECO_;
+     record.bwMean = bwMean_; record.bwGamma = bwGamma_;
+     record.sg = sgVal_; record.a = aVal_; record.n = nVal_; record.f = fVal_;
+     record.mean = meanVal_; record.sigma = sigmaVal_; record.f1 = f1Val_;
+
+     record.engine = fitEngine_;
+     // the kernel that ran: the validation refits of kValidatePrecision are float
+     record.precision = floatKernel_ ? kFloatPrecision : kDoublePrecision;
+     record.maxCalls = maxFitCalls_; record.maxSeconds = maxFitSeconds_;
+     record.analyticCovariance = analyticCovariance_;
+     strncpy(record.fs, fs_.Data(), sizeof(record.fs)-1);
+
+     record.seconds = seconds;
+     record.status = output.status;
+     double pT[8] = {output.pT1_lep, output.pT2_lep, output.pTErr1_lep, output.pTErr2_lep,
+                     output.pT1_gamma, output.pT2_gamma, output.pTErr1_gamma, output.pTErr2_gamma};
+     memcpy(record.pT, pT, sizeof(pT));
+
+     recorder_->Write(record);
 
 }
 
+FitRecorder::Record KinZfitter::ReplayFit(const FitRecorder::Record &record, int engine, int precision, bool useBudget){
+
+     // configuration of this fitter, restored at the end
+     FitEngine fitEngine = fitEngine_;
+     bool floatKernel = floatKernel_;
+     bool analyticCovariance = analyticCovariance_;
+     int maxFitCalls = maxFitCalls_;
+     double maxFitSeconds = maxFitSeconds_;
+     double mass4lRECO = mass4lRECO_;
+     TString fs = fs_;
+     double bwMean = bwMean_, bwGamma = bwGamma_;
+     double pars[7] = {sgVal_, aVal_, nVal_, fVal_, meanVal_, sigmaVal_, f1Val_};
+     // the replayed fit is not one of this fitter's fits
+     BudgetReport budgetReport = budgetReport_;
+
+     fitEngine_ = FitEngine(engine >= 0 ? engine : record.engine);
+     floatKernel_ = (precision >= 0 ? precision : record.precision) == kFloatPrecision;
+     maxFitCalls_ = useBudget ? record.maxCalls : 0;
+     maxFitSeconds_ = useBudget ? record.maxSeconds : 0;
+     analyticCovariance_ = record.analyticCovariance != 0;
+
+     mass4lRECO_ = record.mass4lRECO;
+     fs_ = TString(std::string(record.fs, strnlen(record.fs, sizeof(record.fs))).c_str());
+     bwMean_ = record.bwMean; bwGamma_ = record.bwGamma;
+     sgVal_ = record.sg; aVal_ = record.a; nVal_ = record.n; fVal_ = record.f;
+     meanVal_ = record.mean; sigmaVal_ = record.sigma; f1Val_ = record.f1;
+
+     FitInput input;
+     input.pTRECO1_lep = record.pTRECO[0]; input.pTRECO2_lep = record.pTRECO[1];
+     input.pTErr1_lep = record.pTErr[0]; input.pTErr2_lep = record.pTErr[1];
+     input.theta1_lep = record.theta[0]; input.theta2_lep = record.theta[1];
+     input.phi1_lep = record.phi[0]; input.phi2_lep = record.phi[1];
+     input.m1 = record.m[0]; input.m2 = record.m[1];
+     input.nFsr = record.nFsr;
+     input.pTRECO1_gamma = record.pTRECO[2]; input.pTRECO2_gamma = record.pTRECO[3];
+     input.pTErr1_gamma = record.pTErr[2]; input.pTErr2_gamma = record.pTErr[3];
+     input.theta1_gamma = record.theta[2]; input.theta2_gamma = record.theta[3];
+     input.phi1_gamma = record.phi[2]; input.phi2_gamma = record.phi[3];
+
+     FitOutput output;
+     FitBudget timer(0, 0, 0);
+
+     if (fitEngine_ == kTabulatedEngine) MakeModelTabulated(input, output, 0);
+     else MakeModel(input, output, 0);
+
+     FitRecorder::Record replay = record;
+     replay.engine = fitEngine_;
+     replay.precision = floatKernel_ ? kFloatPrecision : kDoublePrecision;
+     replay.maxCalls = maxFitCalls_; replay.maxSeconds = maxFitSeconds_;
+     replay.seconds = timer.Seconds();
+     replay.status = output.status;
+     double pT[8] = {output.pT1_lep, output.pT2_lep, output.pTErr1_lep, output.pTErr2_lep,
+                     output.pT1_gamma, output.pT2_gamma, output.pTErr1_gamma, output.pTErr2_gamma};
+     memcpy(replay.pT, pT, sizeof(pT));
+
+     fitEngine_ = fitEngine; floatKernel_ = floatKernel;
+     analyticCovariance_ = analyticCovariance;
+     maxFitCalls_ = maxFitCalls; maxFitSeconds_ = maxFitSeconds;
+     mass4lRECO_ = mass4lRECO;
+     fs_ = fs;
+     bwMean_ = bwMean; bwGamma_ = bwGamma;
+     sgVal_ = pars[0]; aVal_ = pars[1]; nVal_ = pars[2]; fVal_ = pars[3];
+     meanVal_ = pars[4]; sigmaVal_ = pars[5]; f1Val_ = pars[6];
+     budgetReport_ = budgetReport;
+
+     return replay;
 
+}
 
-///----------------------------------------------------------------------------------------------
-///----------------------------------------------------------------------------------------------
+namespace {
 
-void KinZfitter::initZs(std::vector< reco::Candidate* > selectedLeptons, std::map<unsigned int, TLorentzVector> selectedFsrPhotons){
+  // Warmup worker: tabulates the next table not taken by another thread
+  void BuildLineshapes(const ParameterStore *store, const vector<ZLineshape::Model> &models,
+                       const vector<ZLineshape::Parameters> &tables, std::atomic<int> &next) {
 
-        if(debug_) cout<<"init leptons"<<endl;
+       for (int i = next++; i < int(tables.size()); i = next++) store->Lineshape(models[i], tables[i]);
 
-        for(unsigned int il = 0; il<selectedLeptons.size(); il++)
-         {
-            double pTerr = 0; TLorentzVector p4;
+  }
 
-            reco::Candidate * c = selectedLeptons[il];              
-            pTerr = helperFunc_->pterr(c ,  isData_);
-            p4.SetPxPyPzE(c->px(),c->py(),c->pz(),c->energy());  
-            int pdgId = c->pdgId();
+}
 
-            if(debug_) cout<<"pdg id "<<pdgId<<endl;
+void KinZfitter::Warmup(int nThreads){
 
-            if(il<2){
-              idsZ1_.push_back(pdgId);
-              pTerrsZ1_.push_back(pTerr);
-              p4sZ1_.push_back(p4);            
+     FitBudget timer(0, 0, 0);
 
-            }
-            else{
+     const char *finalStates[] = {"4e", "4mu", "2e2mu", "2mu2e"};
+     vector<TString> states;
+     vector<ZLineshape::Model> models;
+     vector<ZLineshape::Parameters> tables;
+
+     for (int i = 0; i < 4; i++) {
+
+         const ParameterStore::LineshapeParameters *fsPars = store_->Parameters(PDFName_.Data(), finalStates[i]);
+         if (!fsPars) continue;
+         states.push_back(finalStates[i]);
+
+         // as GetLineshape: both models with the parameters of the final state
+         ZLineshape::Parameters pars;
+         pars.bwMean = bwMean_; pars.bwGamma = bwGamma_;
+         pars.sg = fsPars->sg; pars.a = fsPars->a; pars.n = fsPars->n; pars.f = fsPars->f;
+         pars.mean = fsPars->mean; pars.sigma = fsPars->sigma; pars.f1 = fsPars->f1;
+
+         models.push_back(ZLineshape::kRelBW); tables.push_back(pars);
+         models.push_back(ZLineshape::kRelBWxCBxgauss); tables.push_back(pars);
+
+         }
+
+     // the tables are independent, each thread takes the next one
+     if (nThreads <= 0) nThreads = max(int(std::thread::hardware_concurrency()), 1);
+     nThreads = min(nThreads, int(tables.size()));
+
+     // no thread is started for a single one, e.g. in a framework module
+     std::atomic<int> next(0);
+     if (nThreads <= 1) BuildLineshapes(store_.get(), models, tables, next);
+     else {
+        vector<std::thread> threads;
+        for (int t = 0; t < nThreads; t++)
+            threads.push_back(std::thread(BuildLineshapes, store_.get(), std::cref(models), std::cref(tables), std::ref(next)));
+        for (unsigned int t = 0; t < threads.size(); t++) threads[t].join();
+        }
+
+     if (debug_) cout << "Warmup: " << tables.size() << " lineshape tables on " << nThreads << " threads, " << timer.Seconds() << " s" << endl;
+
+     // this fitter's lookup of the tables, by final state as in Setup
+     TString fs = fs_;
+     double pars[7] = {sgVal_, aVal_, nVal_, fVal_, meanVal_, sigmaVal_, f1Val_};
+
+     for (unsigned int i = 0; i < states.size(); i++) {
+         fs_ = states[i];
+         ReadParamZ1();
+         GetLineshape(ZLineshape::kRelBW);
+         GetLineshape(ZLineshape::kRelBWxCBxgauss);
+         }
+
+     if (fitEngine_ == kRooFitEngine && !states.empty()) {
+
+        // one fit of a Z -> ll(gamma)(gamma) per model and lineshape with the parameters
+        // of the last final state: formulas compiled, minimizer loaded, RooFit messages set up
+        FitInput input;
+        input.pTRECO1_lep = 42; input.pTRECO2_lep = 38; input.pTErr1_lep = 1.0; input.pTErr2_lep = 0.9;
+        input.theta1_lep = 1.2; input.theta2_lep = 1.9; input.phi1_lep = 0.3; input.phi2_lep = 3.2;
+        input.m1 = 0.105658; input.m2 = 0.105658;
+        input.pTRECO1_gamma = 6; input.pTRECO2_gamma = 4; input.pTErr1_gamma = 0.6; input.pTErr2_gamma = 0.5;
+        input.theta1_gamma = 1.25; input.theta2_gamma = 1.85; input.phi1_gamma = 0.35; input.phi2_gamma = 3.1;
+
+        ZLineshape::Parameters lineshape;
+        lineshape.bwMean = bwMean_; lineshape.bwGamma = bwGamma_;
+        lineshape.sg = sgVal_; lineshape.a = aVal_; lineshape.n = nVal_; lineshape.f = fVal_;
+        lineshape.mean = meanVal_; lineshape.sigma = sigmaVal_; lineshape.f1 = f1Val_;
+
+        for (int nFsr = 0; nFsr < 3; nFsr++) {
+
+            if (!rooFitModels_[nFsr]) rooFitModels_[nFsr].reset(new RooFitZModel(nFsr));
+
+            input.nFsr = nFsr;
+            FitOutput output;
+            rooFitModels_[nFsr]->Fit(input, output, 0, true, lineshape, 0, true, false);
+            rooFitModels_[nFsr]->Fit(input, output, 0, false, lineshape, 0, true, false);
 
-              idsZ2_.push_back(pdgId);
-              pTerrsZ2_.push_back(pTerr);
-              p4sZ2_.push_back(p4);
             }
 
+        if (debug_) cout << "Warmup: RooFit models built and fitted, " << timer.Seconds() << " s" << endl;
+
+        }
+
+     fs_ = fs;
+     sgVal_ = pars[0]; aVal_ = pars[1]; nVal_ = pars[2]; fVal_ = pars[3];
+     meanVal_ = pars[4]; sigmaVal_ = pars[5]; f1Val_ = pars[6];
+
+}
+
+void KinZfitter::CountBudget(double usedFraction, bool callsHit, bool timeHit, bool recoFallback){
+
+     BudgetReport &r = budgetReport_;
+     r.nFits++;
+     if (callsHit) r.nCallsHit++;
+     if (timeHit) r.nTimeHit++;
+     if (recoFallback) r.nRecoFallback++;
+
+     r.usedFraction[(callsHit || timeHit) ? 10 : min(max(int(usedFraction*10), 0), 9)]++;
+
+}
+
+void KinZfitter::SetBudgetFallback(KinZfitter::FitInput &input, KinZfitter::FitOutput &output, const double *pT, int size){
+
+     double pTRECO[4] = {input.pTRECO1_lep, input.pTRECO2_lep, input.pTRECO1_gamma, input.pTRECO2_gamma};
+     double pTErr[4] = {input.pTErr1_lep, input.pTErr2_lep, input.pTErr1_gamma, input.pTErr2_gamma};
+     if (!pT) pT = pTRECO;
+
+     // no reliable curvature at an unconverged point: uncorrelated input errors
+     output.covMatrixZ = ZCovariance();
+     output.covMatrixZ.size = size;
+     for (int i = 0; i < size; i++) output.covMatrixZ.matrix(i,i) = pTErr[i]*pTErr[i];
+
+     output.pT1_lep = pT[0]; output.pT2_lep = pT[1];
+     output.pTErr1_lep = input.pTErr1_lep; output.pTErr2_lep = input.pTErr2_lep;
+     if (size >= 3) output.pT1_gamma = pT[2];
+     if (size == 4) output.pT2_gamma = pT[3];
+
+     output.status = kFitBudgetHit;
+
+     if (debug_) cout << "fit out of budget, " << (pT == pTRECO ? "reco" : "best") << " pTs " << pT[0] << " " << pT[1] << endl;
+
+}
+
+void KinZfitter::ValidatePrecision(){
+
+     // float refit of the same candidate from the default starting point, the double
+     // result stays the result of the candidate
+     RefitResult dbl = GetRefitResult();
+
+     Variation nominal;
+     nominal.name = "float";
+
+     // a check, not one of this fitter's fits: not in the latency, budget report and
+     // fit recorder, and the disk cache is neither read nor written
+     bool trackLatency = trackLatency_;
+     BudgetReport budgetReport = budgetReport_;
+     boost::shared_ptr<FitRecorder> recorder = recorder_;
+     boost::shared_ptr<RefitDiskCache> diskCache = diskCache_;
+     trackLatency_ = false;
+     recorder_.reset();
+     diskCache_.reset();
+
+     floatKernel_ = true;
+     RefitResult flt = RefitVariations(vector<Variation>(1, nominal), false)[0];
+     floatKernel_ = false;
+
+     trackLatency_ = trackLatency;
+     budgetReport_ = budgetReport;
+     recorder_ = recorder;
+     diskCache_ = diskCache;
+
+     PrecisionReport &r = precisionReport_;
+     r.nCandidates++;
+     r.sumDeltaM4l += flt.m4l - dbl.m4l;
+     r.maxDeltaM4l = max(r.maxDeltaM4l, fabs(flt.m4l - dbl.m4l));
+     r.maxDeltaMZ1 = max(r.maxDeltaMZ1, fabs(flt.mZ1 - dbl.mZ1));
+     r.maxDeltaMZ2 = max(r.maxDeltaMZ2, fabs(flt.mZ2 - dbl.mZ2));
+     r.maxDeltaM4lErr = max(r.maxDeltaM4lErr, fabs(flt.m4lErr - dbl.m4lErr));
+     for (unsigned int i = 0; i < dbl.p4s.size() && i < flt.p4s.size(); i++) {
+         r.maxRelDeltaPt = max(r.maxRelDeltaPt, fabs(flt.p4s[i].Pt()/dbl.p4s[i].Pt() - 1));
          }
 
-        if(debug_) cout<<"init fsr photons"<<endl;
+     if (debug_) cout << "float refit m4l " << flt.m4l << " double " << dbl.m4l << endl;
 
-        for(unsigned int ifsr = 0; ifsr<4; ifsr++)
+}
+
+void KinZfitter::SetCorrPTerr(bool corr){
+
+     isCorrPTerr_ = corr;
+     helperFunc_->setCorrPTerr(isCorrPTerr_);
+     zFitCache_.clear();
+
+}
+
+void KinZfitter::SetDiskCache(const std::string &storeFile, const std::string &journalFile){
+
+     diskCache_.reset(new RefitDiskCache(storeFile, journalFile));
+     if (debug_) cout << "refit disk cache " << storeFile << " with " << diskCache_->Size() << " records" << endl;
+
+}
+
+void KinZfitter::ClearCache(){
+
+     helperFunc_->clearCache();
+     zFitCache_.clear();
+
+}
+
+///----------------------------------------------------------------------------------------------
+///----------------------------------------------------------------------------------------------
+
+void KinZfitter::initZs(const KinZfitter::RefitCandidate &candidate){
+
+        for(unsigned int il = 0; il<4; il++)
          {
+            if(il<2){
+              idsZ1_.push_back(candidate.ids[il]);
+              pTerrsZ1_.push_back(candidate.pTErrs[il]);
+              p4sZ1_.push_back(candidate.leptons[il]);
 
-            TLorentzVector p4 = selectedFsrPhotons[ifsr];
-            if(selectedFsrPhotons[ifsr].Pt()==0) continue;
+            }
+            else{
 
-            if(debug_) cout<<"ifsr "<<ifsr<<endl;
+              idsZ2_.push_back(candidate.ids[il]);
+              pTerrsZ2_.push_back(candidate.pTErrs[il]);
+              p4sZ2_.push_back(candidate.leptons[il]);
+            }
 
-            double pTerr = 0;
+         }
 
-            pTerr = helperFunc_->pterr(p4); //,isData_);
+        for(unsigned int ifsr = 0; ifsr<4; ifsr++)
+         {
 
-            if(debug_) cout<<" pt err is "<<pTerr<<endl;
+            TLorentzVector p4 = candidate.fsrPhotons[ifsr];
+            if(p4.Pt()==0) continue;
 
             if(ifsr<2){
 
                 if(debug_) cout<<"for fsr Z1 photon"<<endl;
 
-                pTerrsZ1ph_.push_back(pTerr);
+                pTerrsZ1ph_.push_back(candidate.fsrPTErrs[ifsr]);
                 p4sZ1ph_.push_back(p4);
                 idsFsrZ1_.push_back(idsZ1_[ifsr]);
               }
@@ -155,7 +601,7 @@ void KinZfitter::initZs(std::vector< reco::Candidate* > selectedLeptons, std::ma
 
                 if(debug_) cout<<"for fsr Z2 photon"<<endl;
 
-                pTerrsZ2ph_.push_back(pTerr);
+                pTerrsZ2ph_.push_back(candidate.fsrPTErrs[ifsr]);
                 p4sZ2ph_.push_back(p4);
                 idsFsrZ2_.push_back(idsZ2_[ifsr-2]);
 
@@ -167,6 +613,28 @@ void KinZfitter::initZs(std::vector< reco::Candidate* > selectedLeptons, std::ma
   
 }
 
+double KinZfitter::EstimateFitCost(const KinZfitter::RefitCandidate &candidate) const {
+
+        // rough relative cost: one unit per fitted pT in the RelBW fit, the RelBWxCBxgauss
+        // lineshape (m4l < 140) costs about twice as much per evaluation
+        TLorentzVector pH(0,0,0,0);
+        for(unsigned int i = 0; i<4; i++) pH += candidate.leptons[i] + candidate.fsrPhotons[i];
+        double m4l = pH.M();
+
+        // photons only float below 140 GeV, and only in the Z1 fit
+        int nFsr1 = (candidate.fsrPhotons[0].Pt()>0) + (candidate.fsrPhotons[1].Pt()>0);
+        double cost = m4l > 140 ? 2 : 2*(2 + nFsr1);
+
+        if(m4l > cutoff_) {
+           cost += 2;
+           // 4e/4mu: the Z1/Z2 pairing is redone
+           if(abs(candidate.ids[0]) == abs(candidate.ids[2])) cost += 1;
+           }
+
+        return cost;
+
+}
+
 void KinZfitter::SetZResult(double l1, double l2, double lph1, double lph2, 
                             double l3, double l4, double lph3, double lph4)
 {
@@ -253,6 +721,8 @@ double KinZfitter::GetM4l()
 double KinZfitter::GetRefitM4l()
 {
 
+  EnsureRefit();
+
   vector<TLorentzVector> p4s = GetRefitP4s();
 
   TLorentzVector pH(0,0,0,0); 
@@ -267,6 +737,8 @@ double KinZfitter::GetRefitM4l()
 double KinZfitter::GetRefitMZ1()
 {
 
+  EnsureRefit();
+
   vector<TLorentzVector> p4s = GetRefitP4s();
 
   TLorentzVector pZ1(0,0,0,0);
@@ -279,6 +751,8 @@ double KinZfitter::GetRefitMZ1()
 double KinZfitter::GetRefitMZ2()
 {
 
+  EnsureRefit();
+
   vector<TLorentzVector> p4s = GetRefitP4s();
 
   TLorentzVector pZ2(0,0,0,0);
@@ -318,6 +792,8 @@ double KinZfitter::GetMZ2()
 double KinZfitter::GetRefitM4lErr()
 {
 
+  EnsureRefit();
+
   vector<TLorentzVector> p4s;
   vector<double> pTErrs;
 
@@ -349,9 +825,27 @@ double KinZfitter::GetRefitM4lErr()
 
 }
 
+TMatrixDSym KinZfitter::GetRefitCovZ(int iZ, vector<TString> &names)
+{
+
+  EnsureRefit();
+
+  names.clear();
+  if (iZ != 1 && (iZ != 2 || mass4lRECO_ <= cutoff_)) return TMatrixDSym();
+
+  const ZCovariance &cov = iZ == 1 ? covMatrixZ1_ : covMatrixZ2_;
+  const char* covNames[] = {"pT1_lep", "pT2_lep", "pT1_gamma", "pT2_gamma"};
+  for (int i = 0; i < cov.size; i++) names.push_back(covNames[i]);
+
+  return cov.ToTMatrixDSym();
+
+}
+
 double KinZfitter::GetRefitM4lErrFullCov()
 {
 
+  EnsureRefit();
+
 
   vector<TLorentzVector> Lp4s = GetRefitP4s();
   vector<TLorentzVector> p4s;
@@ -514,6 +1008,8 @@ double KinZfitter::GetMZ1Err()
 vector<TLorentzVector> KinZfitter::GetRefitP4s()
 {
 
+  EnsureRefit();
+
   TLorentzVector Z1_1 = p4sZ1REFIT_[0]; TLorentzVector Z1_2 = p4sZ1REFIT_[1];
   TLorentzVector Z2_1 = p4sZ2REFIT_[0]; TLorentzVector Z2_2 = p4sZ2REFIT_[1];
 
@@ -587,11 +1083,6 @@ vector<TLorentzVector> KinZfitter::GetP4s()
 
 void KinZfitter::KinRefitZ()
 {
-  double l1,l2,lph1,lph2;
-  double l3,l4,lph3,lph4;
-
-  l1 = 1.0; l2 = 1.0; lph1 = 1.0; lph2 = 1.0;
-  l3 = 1.0; l4 = 1.0; lph3 = 1.0; lph4 = 1.0;
 
   bool fourEfourMu = IsFourEFourMu(idsZ1_, idsZ2_);
 
@@ -599,30 +1090,71 @@ void KinZfitter::KinRefitZ()
 
 //cout << mass4lRECO << endl;
 
+  if (mass4lRECO_ > cutoff_ && fourEfourMu) {//4e,4mu, do reshuffle
+
+     RepairZ1Z2(p4sZ1_, pTerrsZ1_, p4sZ1ph_, pTerrsZ1ph_, p4sZ2_, pTerrsZ2_, p4sZ2ph_, pTerrsZ2ph_, idsZ1_, idsZ2_);
+
+     }
+
+  refitPending_ = true;
+  if (!lazyRefit_) EnsureRefit();
+
+}
+
+void KinZfitter::SetLazyRefit(bool lazy)
+{
+
+  lazyRefit_ = lazy;
+
+}
+
+void KinZfitter::EnsureRefit()
+{
+
+  if (!refitPending_) return;
+  // the getters used by the fit below must not come back here
+  refitPending_ = false;
+
+  if(debug_) cout<<"run the refit of the candidate"<<endl;
+
+  if (pairingMode_ == kLikelihoodPairing && mass4lRECO_ > cutoff_ && IsFourEFourMu(idsZ1_, idsZ2_)) LikelihoodPairing();
+
+  RefitZs(0, 0);
+
+  if (fitPrecision_ == kValidatePrecision && fitEngine_ == kTabulatedEngine) ValidatePrecision();
+
+}
+
+void KinZfitter::RefitZs(const KinZfitter::FitOutput *seed1, const KinZfitter::FitOutput *seed2)
+{
+  double l1,l2,lph1,lph2;
+  double l3,l4,lph3,lph4;
+
+  l1 = 1.0; l2 = 1.0; lph1 = 1.0; lph2 = 1.0;
+  l3 = 1.0; l4 = 1.0; lph3 = 1.0; lph4 = 1.0;
+
   if (mass4lRECO_ <= cutoff_) {//fit Z1
 
      SetFitInput(fitInput1, p4sZ1_, pTerrsZ1_, p4sZ1ph_, pTerrsZ1ph_);
-     Driver(fitInput1, fitOutput1);
+     Driver(fitInput1, fitOutput1, seed1);
      SetFitOutput(fitInput1, fitOutput1, l1, l2, lph1, lph2, pTerrsZ1REFIT_, pTerrsZ1phREFIT_, covMatrixZ1_);
 
      pTerrsZ2REFIT_.push_back(pTerrsZ2_[0]); pTerrsZ2REFIT_.push_back(pTerrsZ2_[1]);
 
-     } else {//fit two Zs
-
-            if (fourEfourMu) {//4e,4mu, do reshuffle
+     fitStatus_ = fitOutput1.status;
 
-               RepairZ1Z2(p4sZ1_, pTerrsZ1_, p4sZ1ph_, pTerrsZ1ph_, p4sZ2_, pTerrsZ2_, p4sZ2ph_, pTerrsZ2ph_, idsZ1_, idsZ2_);
+     } else {//fit two Zs
 
-               }
-       
             SetFitInput(fitInput1, p4sZ1_, pTerrsZ1_, p4sZ1ph_, pTerrsZ1ph_);
-            Driver(fitInput1, fitOutput1);
+            Driver(fitInput1, fitOutput1, seed1);
             SetFitOutput(fitInput1, fitOutput1, l1, l2, lph1, lph2, pTerrsZ1REFIT_, pTerrsZ1phREFIT_, covMatrixZ1_);
 
             SetFitInput(fitInput2, p4sZ2_, pTerrsZ2_, p4sZ2ph_, pTerrsZ2ph_);
-            Driver(fitInput2, fitOutput2);
+            Driver(fitInput2, fitOutput2, seed2);
             SetFitOutput(fitInput2, fitOutput2, l3, l4, lph3, lph4, pTerrsZ2REFIT_, pTerrsZ2phREFIT_, covMatrixZ2_);
 
+            fitStatus_ = FitStatus(max(fitOutput1.status, fitOutput2.status));
+
             }
 
   if(debug_) cout<<"l1 "<<l1<<"; l2 "<<l2<<" lph1 "<<lph1<<" lph2 "<<lph2<<endl;
@@ -633,39 +1165,274 @@ void KinZfitter::KinRefitZ()
   if(debug_) cout<<"Z refit done"<<endl;
 }
 
-void  KinZfitter::Driver(KinZfitter::FitInput &input, KinZfitter::FitOutput &output) {
+KinZfitter::RefitResult KinZfitter::GetRefitResult()
+{
+
+  RefitResult result;
 
-      MakeModel(input, output);
+  result.p4s = GetRefitP4s();
+  result.m4l = GetRefitM4l();
+  result.mZ1 = GetRefitMZ1();
+  result.mZ2 = GetRefitMZ2();
+  result.m4lErr = GetRefitM4lErrFullCov();
+  result.status = fitStatus_;
+
+  return result;
 
 }
 
+vector<KinZfitter::RefitResult> KinZfitter::KinRefitZVariations(const vector<KinZfitter::Variation> &variations)
+{
 
-void  KinZfitter::SetFitInput(KinZfitter::FitInput &input, 
-                              vector<TLorentzVector> ZLep, vector<double> ZLepErr,
-                              vector<TLorentzVector> ZGamma, vector<double> ZGammaErr) {
+  return RefitVariations(variations, true);
 
-      TLorentzVector lep1 = ZLep[0]; TLorentzVector lep2 = ZLep[1];
+}
 
-      input.pTRECO1_lep = lep1.Pt(); input.pTRECO2_lep = lep2.Pt();
-      input.pTErr1_lep = ZLepErr[0]; input.pTErr2_lep = ZLepErr[1];
-      input.theta1_lep = lep1.Theta(); input.theta2_lep = lep2.Theta();
-      input.phi1_lep = lep1.Phi(); input.phi2_lep = lep2.Phi();
-      input.m1 = lep1.M(); input.m2 = lep2.M();
+vector<KinZfitter::RefitResult> KinZfitter::RefitVariations(const vector<KinZfitter::Variation> &variations, bool warmStart)
+{
 
-      input.nFsr = 0;
-      TLorentzVector nullFourVector(0, 0, 0, 0);
-      TLorentzVector Gamma1, Gamma2;
-      Gamma1 = nullFourVector; Gamma2 = nullFourVector;
+  EnsureRefit();
 
-      input.pTRECO1_gamma = Gamma1.Pt(); input.pTErr1_gamma = 0;
-      input.theta1_gamma = Gamma1.Theta(); input.phi1_gamma = Gamma1.Phi();
-      input.pTRECO2_gamma = Gamma2.Pt(); input.pTErr2_gamma = 0;
-      input.theta2_gamma = Gamma2.Theta(); input.phi2_gamma = Gamma1.Phi();
+  // a missing parameter set would be fitted with the nominal lineshape under the new name;
+  // checked before anything is changed
+  for (unsigned int iv = 0; iv < variations.size(); iv++) {
+      if (variations[iv].PDFName == "" || store_->Parameters(variations[iv].PDFName.Data(), fs_.Data())) continue;
+      throw std::invalid_argument(("KinZfitter: no ParamZ1/" + variations[iv].PDFName + "_" + fs_
+                                   + ".txt for the variation " + variations[iv].name).Data());
+      }
 
+  vector<RefitResult> results;
 
-      if (int(ZGamma.size()) >= 1) {
+  // nominal state, restored at the end
+  bool twoZs = mass4lRECO_ > cutoff_;
+  FitOutput nominal1 = fitOutput1;
+  FitOutput nominal2 = fitOutput2;
 
-         input.nFsr = 1;
+  vector<double> pTerrsZ1 = pTerrsZ1_, pTerrsZ2 = pTerrsZ2_, pTerrsZ1ph = pTerrsZ1ph_, pTerrsZ2ph = pTerrsZ2ph_;
+  vector<TLorentzVector> p4sZ1REFIT = p4sZ1REFIT_, p4sZ2REFIT = p4sZ2REFIT_, p4sZ1phREFIT = p4sZ1phREFIT_, p4sZ2phREFIT = p4sZ2phREFIT_;
+  vector<double> pTerrsZ1REFIT = pTerrsZ1REFIT_, pTerrsZ2REFIT = pTerrsZ2REFIT_, pTerrsZ1phREFIT = pTerrsZ1phREFIT_, pTerrsZ2phREFIT = pTerrsZ2phREFIT_;
+  ZCovariance covMatrixZ1 = covMatrixZ1_, covMatrixZ2 = covMatrixZ2_;
+  double l[8] = {lZ1_l1_, lZ1_l2_, lZ2_l1_, lZ2_l2_, lZ1_ph1_, lZ1_ph2_, lZ2_ph1_, lZ2_ph2_};
+  FitStatus fitStatus = fitStatus_;
+
+  TString PDFName = PDFName_;
+  double bwMean = bwMean_, bwGamma = bwGamma_;
+  double pars[7] = {sgVal_, aVal_, nVal_, fVal_, meanVal_, sigmaVal_, f1Val_};
+
+  for (unsigned int iv = 0; iv < variations.size(); iv++) {
+
+      const Variation &var = variations[iv];
+      if (debug_) cout << "refit variation " << var.name << endl;
+
+      for (unsigned int i = 0; i < pTerrsZ1.size(); i++) pTerrsZ1_[i] = var.pTErrScale*pTerrsZ1[i];
+      for (unsigned int i = 0; i < pTerrsZ2.size(); i++) pTerrsZ2_[i] = var.pTErrScale*pTerrsZ2[i];
+      for (unsigned int i = 0; i < pTerrsZ1ph.size(); i++) pTerrsZ1ph_[i] = var.pTErrScalePhoton*pTerrsZ1ph[i];
+      for (unsigned int i = 0; i < pTerrsZ2ph.size(); i++) pTerrsZ2ph_[i] = var.pTErrScalePhoton*pTerrsZ2ph[i];
+
+      TString varPDFName = var.PDFName == "" ? PDFName : var.PDFName;
+      if (varPDFName != PDFName_) {
+         PDFName_ = varPDFName;
+         ReadParamZ1();
+         }
+
+      bwMean_ = var.bwMean > 0 ? var.bwMean : bwMean;
+      bwGamma_ = var.bwGamma > 0 ? var.bwGamma : bwGamma;
+
+      p4sZ1REFIT_.clear(); p4sZ2REFIT_.clear(); p4sZ1phREFIT_.clear(); p4sZ2phREFIT_.clear();
+      pTerrsZ1REFIT_.clear(); pTerrsZ2REFIT_.clear(); pTerrsZ1phREFIT_.clear(); pTerrsZ2phREFIT_.clear();
+
+      if (warmStart) RefitZs(&nominal1, twoZs ? &nominal2 : 0);
+      else RefitZs(0, 0);
+
+      results.push_back(GetRefitResult());
+
+      }
+
+  pTerrsZ1_ = pTerrsZ1; pTerrsZ2_ = pTerrsZ2; pTerrsZ1ph_ = pTerrsZ1ph; pTerrsZ2ph_ = pTerrsZ2ph;
+  p4sZ1REFIT_ = p4sZ1REFIT; p4sZ2REFIT_ = p4sZ2REFIT; p4sZ1phREFIT_ = p4sZ1phREFIT; p4sZ2phREFIT_ = p4sZ2phREFIT;
+  pTerrsZ1REFIT_ = pTerrsZ1REFIT; pTerrsZ2REFIT_ = pTerrsZ2REFIT; pTerrsZ1phREFIT_ = pTerrsZ1phREFIT; pTerrsZ2phREFIT_ = pTerrsZ2phREFIT;
+
+  covMatrixZ1_ = covMatrixZ1; covMatrixZ2_ = covMatrixZ2;
+  CopyFitOutput(nominal1, fitOutput1);
+  CopyFitOutput(nominal2, fitOutput2);
+
+  lZ1_l1_ = l[0]; lZ1_l2_ = l[1]; lZ2_l1_ = l[2]; lZ2_l2_ = l[3];
+  lZ1_ph1_ = l[4]; lZ1_ph2_ = l[5]; lZ2_ph1_ = l[6]; lZ2_ph2_ = l[7];
+  fitStatus_ = fitStatus;
+
+  PDFName_ = PDFName;
+  bwMean_ = bwMean; bwGamma_ = bwGamma;
+  sgVal_ = pars[0]; aVal_ = pars[1]; nVal_ = pars[2]; fVal_ = pars[3];
+  meanVal_ = pars[4]; sigmaVal_ = pars[5]; f1Val_ = pars[6];
+
+  return results;
+
+}
+
+void  KinZfitter::Driver(KinZfitter::FitInput &input, KinZfitter::FitOutput &output, const KinZfitter::FitOutput *seed) {
+
+      ZFitKey key = MakeZFitKey(input);
+
+      std::map<ZFitKey, FitOutput>::const_iterator it = zFitCache_.find(key);
+      if (it != zFitCache_.end()) {
+
+         if (debug_) cout << "reuse cached Z fit result" << endl;
+         CopyFitOutput(it->second, output);
+         return;
+
+         }
+
+      if (zFitCache_.size() >= maxZFitCacheSize_) zFitCache_.clear();
+
+      RefitDiskCache::Key diskKey;
+      if (diskCache_) {
+
+         diskKey = MakeDiskKey(key);
+         if (ReadDiskCache(diskKey, output)) {
+
+            if (debug_) cout << "reuse Z fit result from disk cache" << endl;
+            zFitCache_.insert(std::make_pair(key, output));
+            return;
+
+            }
+
+         }
+
+      // the minimization only, without the cache lookups
+      FitBudget timer(0, 0, 0);
+
+      if (fitEngine_ == kTabulatedEngine) MakeModelTabulated(input, output, seed);
+      else MakeModel(input, output, seed);
+
+      double seconds = timer.Seconds();
+      if (trackLatency_) latency_.Add(LatencyCategory(input), seconds, key.values);
+      if (recorder_ && (seconds > recordMinSeconds_ || output.status != kFitOK)) RecordFit(input, output, seconds);
+
+      // a fallback depends on the budget, which is not in the key: fitted again next time
+      if (output.status == kFitOK) zFitCache_.insert(std::make_pair(key, output));
+      if (diskCache_) WriteDiskCache(diskKey, output);
+
+}
+
+KinZfitter::ZFitKey KinZfitter::MakeZFitKey(KinZfitter::FitInput &input) {
+
+      ZFitKey key;
+
+      double values[] = { input.pTRECO1_lep, input.pTRECO2_lep, input.pTErr1_lep, input.pTErr2_lep,
+                          input.theta1_lep, input.theta2_lep, input.phi1_lep, input.phi2_lep,
+                          input.m1, input.m2, double(input.nFsr),
+                          input.pTRECO1_gamma, input.pTRECO2_gamma, input.pTErr1_gamma, input.pTErr2_gamma,
+                          input.theta1_gamma, input.theta2_gamma, input.phi1_gamma, input.phi2_gamma,
+                          bwMean_, bwGamma_ };
+      key.values.assign(values, values + sizeof(values)/sizeof(double));
+
+      // MakeModel picks the lineshape from mass4lRECO_
+      key.model = PDFName_ + "_" + fs_ + (mass4lRECO_ > 140 ? "_RelBW" : "_RelBWxCBxgauss");
+      key.model += (fitEngine_ == kTabulatedEngine ? (floatKernel_ ? "_tabulated_float" : "_tabulated") : "_roofit");
+      if (analyticCovariance_) key.model += "_analyticCov";
+
+      return key;
+
+}
+
+bool KinZfitter::ZFitKey::operator<(const KinZfitter::ZFitKey &other) const {
+
+      if (model != other.model) return model < other.model;
+      return values < other.values;
+
+}
+
+RefitDiskCache::Key KinZfitter::MakeDiskKey(const KinZfitter::ZFitKey &key) {
+
+      // the parameter file behind PDFName_ may change between jobs, hash the values
+      vector<double> values = key.values;
+      double pars[] = { sgVal_, aVal_, nVal_, fVal_, meanVal_, sigmaVal_, f1Val_ };
+      values.insert(values.end(), pars, pars + sizeof(pars)/sizeof(double));
+
+      return RefitDiskCache::MakeKey(values, key.model.Data());
+
+}
+
+bool KinZfitter::ReadDiskCache(const RefitDiskCache::Key &key, KinZfitter::FitOutput &output) {
+
+      RefitDiskCache::Record record;
+      if (!diskCache_->Find(key, record)) return false;
+
+      output.pT1_lep = record.pT[0]; output.pT2_lep = record.pT[1];
+      output.pTErr1_lep = record.pT[2]; output.pTErr2_lep = record.pT[3];
+      output.pT1_gamma = record.pT[4]; output.pT2_gamma = record.pT[5];
+      output.pTErr1_gamma = record.pT[6]; output.pTErr2_gamma = record.pT[7];
+      output.status = kFitOK;
+
+      int size = record.nCov, k = 0;
+      output.covMatrixZ = ZCovariance();
+      output.covMatrixZ.size = size;
+      for (int i = 0; i < size; i++) {
+          for (int j = i; j < size; j++, k++) output.covMatrixZ.matrix(i,j) = record.cov[k];
+          }
+
+      return true;
+
+}
+
+void KinZfitter::WriteDiskCache(const RefitDiskCache::Key &key, const KinZfitter::FitOutput &output) {
+
+      // only minimized fits are worth keeping
+      if (output.status != kFitOK) return;
+
+      RefitDiskCache::Record record;
+      memset(&record, 0, sizeof(record));
+      record.key = key;
+
+      record.pT[0] = output.pT1_lep; record.pT[1] = output.pT2_lep;
+      record.pT[2] = output.pTErr1_lep; record.pT[3] = output.pTErr2_lep;
+      record.pT[4] = output.pT1_gamma; record.pT[5] = output.pT2_gamma;
+      record.pT[6] = output.pTErr1_gamma; record.pT[7] = output.pTErr2_gamma;
+
+      int size = output.covMatrixZ.size, k = 0;
+      record.nCov = size;
+      for (int i = 0; i < size; i++) {
+          for (int j = i; j < size; j++, k++) record.cov[k] = output.covMatrixZ(i,j);
+          }
+
+      diskCache_->Append(record);
+
+}
+
+void KinZfitter::CopyFitOutput(const KinZfitter::FitOutput &from, KinZfitter::FitOutput &to) {
+
+      // plain data, the covariance has a fixed size
+      to = from;
+
+}
+
+
+void  KinZfitter::SetFitInput(KinZfitter::FitInput &input, 
+                              vector<TLorentzVector> ZLep, vector<double> ZLepErr,
+                              vector<TLorentzVector> ZGamma, vector<double> ZGammaErr) {
+
+      TLorentzVector lep1 = ZLep[0]; TLorentzVector lep2 = ZLep[1];
+
+      input.pTRECO1_lep = lep1.Pt(); input.pTRECO2_lep = lep2.Pt();
+      input.pTErr1_lep = ZLepErr[0]; input.pTErr2_lep = ZLepErr[1];
+      input.theta1_lep = lep1.Theta(); input.theta2_lep = lep2.Theta();
+      input.phi1_lep = lep1.Phi(); input.phi2_lep = lep2.Phi();
+      input.m1 = lep1.M(); input.m2 = lep2.M();
+
+      input.nFsr = 0;
+      TLorentzVector nullFourVector(0, 0, 0, 0);
+      TLorentzVector Gamma1, Gamma2;
+      Gamma1 = nullFourVector; Gamma2 = nullFourVector;
+
+      input.pTRECO1_gamma = Gamma1.Pt(); input.pTErr1_gamma = 0;
+      input.theta1_gamma = Gamma1.Theta(); input.phi1_gamma = Gamma1.Phi();
+      input.pTRECO2_gamma = Gamma2.Pt(); input.pTErr2_gamma = 0;
+      input.theta2_gamma = Gamma2.Theta(); input.phi2_gamma = Gamma1.Phi();
+
+
+      if (int(ZGamma.size()) >= 1) {
+
+         input.nFsr = 1;
          TLorentzVector gamma1 = ZGamma[0];
          input.pTRECO1_gamma = gamma1.Pt(); input.pTErr1_gamma = ZGammaErr[0];
          input.theta1_gamma = gamma1.Theta(); input.phi1_gamma = gamma1.Phi();
@@ -685,10 +1452,32 @@ void  KinZfitter::SetFitInput(KinZfitter::FitInput &input,
 }
 
 
+void KinZfitter::ZCovariance::Set(const TMatrixDSym &from) {
+
+    // a Z fit floats at most 4 pTs
+    matrix = ROOT::Math::SMatrix<double, 4, 4, ROOT::Math::MatRepSym<double, 4> >();
+    size = min(from.GetNcols(), 4);
+    for (int i = 0; i < size; i++) {
+        for (int j = i; j < size; j++) matrix(i,j) = from(i,j);
+        }
+
+}
+
+TMatrixDSym KinZfitter::ZCovariance::ToTMatrixDSym() const {
+
+    TMatrixDSym to(size);
+    for (int i = 0; i < size; i++) {
+        for (int j = 0; j < size; j++) to(i,j) = matrix(i,j);
+        }
+
+    return to;
+
+}
+
 void KinZfitter::SetFitOutput(KinZfitter::FitInput &input, KinZfitter::FitOutput &output,
                               double &l1, double &l2, double &lph1, double &lph2, 
                               vector<double> &pTerrsREFIT_lep, vector<double> &pTerrsREFIT_gamma,
-                              TMatrixDSym &covMatrixZ) {
+                              KinZfitter::ZCovariance &covMatrixZ) {
 
      l1 = output.pT1_lep/input.pTRECO1_lep;
      l2 = output.pT2_lep/input.pTRECO2_lep;
@@ -720,198 +1509,531 @@ void KinZfitter::SetFitOutput(KinZfitter::FitInput &input, KinZfitter::FitOutput
 
         }
 
-    int size = output.covMatrixZ.GetNcols();
-    covMatrixZ.ResizeTo(size,size);
     covMatrixZ = output.covMatrixZ;
 
 }
 
 
-void KinZfitter::MakeModel(/*RooWorkspace &w,*/ KinZfitter::FitInput &input, KinZfitter::FitOutput &output) {
-
-     //lep
-     RooRealVar pTRECO1_lep("pTRECO1_lep", "pTRECO1_lep", input.pTRECO1_lep, 5, 500);
-     RooRealVar pTRECO2_lep("pTRECO2_lep", "pTRECO2_lep", input.pTRECO2_lep, 5, 500);
-     RooRealVar pTMean1_lep("pTMean1_lep", "pTMean1_lep", 
-                            input.pTRECO1_lep, max(5.0, input.pTRECO1_lep-2*input.pTErr1_lep), input.pTRECO1_lep+2*input.pTErr1_lep);
-     RooRealVar pTMean2_lep("pTMean2_lep", "pTMean2_lep", 
-                            input.pTRECO2_lep, max(5.0, input.pTRECO2_lep-2*input.pTErr2_lep), input.pTRECO2_lep+2*input.pTErr2_lep);
-     RooRealVar pTSigma1_lep("pTSigma1_lep", "pTSigma1_lep", input.pTErr1_lep);
-     RooRealVar pTSigma2_lep("pTSigma2_lep", "pTSigma2_lep", input.pTErr2_lep);
-     RooRealVar theta1_lep("theta1_lep", "theta1_lep", input.theta1_lep);
-     RooRealVar theta2_lep("theta2_lep", "theta2_lep", input.theta2_lep);
-     RooRealVar phi1_lep("phi1_lep", "phi1_lep", input.phi1_lep);
-     RooRealVar phi2_lep("phi2_lep", "phi2_lep", input.phi2_lep);
-     RooRealVar m1("m1", "m1", input.m1);
-     RooRealVar m2("m2", "m2", input.m2);
-
-     //gamma
-     RooRealVar pTRECO1_gamma("pTRECO1_gamma", "pTRECO1_gamma", input.pTRECO1_gamma, 5, 500);
-     RooRealVar pTRECO2_gamma("pTRECO2_gamma", "pTRECO2_gamma", input.pTRECO2_gamma, 5, 500);
-     RooRealVar pTMean1_gamma("pTMean1_gamma", "pTMean1_gamma", 
-                              input.pTRECO1_gamma, max(0.5, input.pTRECO1_gamma-2*input.pTErr1_gamma), input.pTRECO1_gamma+2*input.pTErr1_gamma);
-     RooRealVar pTMean2_gamma("pTMean2_gamma", "pTMean2_gamma", 
-                              input.pTRECO2_gamma, max(0.5, input.pTRECO2_gamma-2*input.pTErr2_gamma), input.pTRECO2_gamma+2*input.pTErr2_gamma);
-     RooRealVar pTSigma1_gamma("pTSigma1_gamma", "pTSigma1_gamma", input.pTErr1_gamma);
-     RooRealVar pTSigma2_gamma("pTSigma2_gamma", "pTSigma2_gamma", input.pTErr2_gamma);
-     RooRealVar theta1_gamma("theta1_gamma", "theta1_gamma", input.theta1_gamma);
-     RooRealVar theta2_gamma("theta2_gamma", "theta2_gamma", input.theta2_gamma);
-     RooRealVar phi1_gamma("phi1_gamma", "phi1_gamma", input.phi1_gamma);
-     RooRealVar phi2_gamma("phi2_gamma", "phi2_gamma", input.phi2_gamma);
-
-     //gauss
-     RooGaussian gauss1_lep("gauss1_lep", "gauss1_lep", pTRECO1_lep, pTMean1_lep, pTSigma1_lep);
-     RooGaussian gauss2_lep("gauss2_lep", "gauss2_lep", pTRECO2_lep, pTMean2_lep, pTSigma2_lep);
-     RooGaussian gauss1_gamma("gauss1_gamma", "gauss1_gamma", pTRECO1_gamma, pTMean1_gamma, pTSigma1_gamma);
-     RooGaussian gauss2_gamma("gauss2_gamma", "gauss2_gamma", pTRECO2_gamma, pTMean2_gamma, pTSigma2_gamma);
-
-
-     TString makeE_lep = "TMath::Sqrt((@0*@0)/((TMath::Sin(@1))*(TMath::Sin(@1)))+@2*@2)";
-     RooFormulaVar E1_lep("E1_lep", makeE_lep, RooArgList(pTMean1_lep, theta1_lep, m1));  //w.import(E1_lep);
-     RooFormulaVar E2_lep("E2_lep", makeE_lep, RooArgList(pTMean2_lep, theta2_lep, m2));  //w.import(E2_lep);
-
-     TString makeE_gamma = "TMath::Sqrt((@0*@0)/((TMath::Sin(@1))*(TMath::Sin(@1))))";
-     RooFormulaVar E1_gamma("E1_gamma", makeE_gamma, RooArgList(pTMean1_gamma, theta1_gamma));  //w.import(E1_gamma);
-     RooFormulaVar E2_gamma("E2_gamma", makeE_gamma, RooArgList(pTMean2_gamma, theta2_gamma));  //w.import(E2_gamma);
-
-     //dotProduct 3d
-     TString dotProduct_3d = "@0*@1*( ((TMath::Cos(@2))*(TMath::Cos(@3)))/((TMath::Sin(@2))*(TMath::Sin(@3)))+(TMath::Cos(@4-@5)))";
-     RooFormulaVar p1v3D2("p1v3D2", dotProduct_3d, RooArgList(pTMean1_lep, pTMean2_lep, theta1_lep, theta2_lep, phi1_lep, phi2_lep));
-     RooFormulaVar p1v3Dph1("p1v3Dph1", dotProduct_3d, RooArgList(pTMean1_lep, pTMean1_gamma, theta1_lep, theta1_gamma, phi1_lep, phi1_gamma));
-     RooFormulaVar p2v3Dph1("p2v3Dph1", dotProduct_3d, RooArgList(pTMean2_lep, pTMean1_gamma, theta2_lep, theta1_gamma, phi2_lep, phi1_gamma));
-     RooFormulaVar p1v3Dph2("p1v3Dph2", dotProduct_3d, RooArgList(pTMean1_lep, pTMean2_gamma, theta1_lep, theta2_gamma, phi1_lep, phi2_gamma));
-     RooFormulaVar p2v3Dph2("p2v3Dph2", dotProduct_3d, RooArgList(pTMean2_lep, pTMean2_gamma, theta2_lep, theta2_gamma, phi2_lep, phi2_gamma));
-     RooFormulaVar ph1v3Dph2("ph1v3Dph2", dotProduct_3d, RooArgList(pTMean1_gamma, pTMean2_gamma, theta1_gamma, theta2_gamma, phi1_gamma, phi2_gamma));
-
-     TString dotProduct_4d = "@0*@1-@2";
-     RooFormulaVar p1D2("p1D2", dotProduct_4d, RooArgList(E1_lep, E2_lep, p1v3D2));  //w.import(p1D2);
-     RooFormulaVar p1Dph1("p1Dph1", dotProduct_4d, RooArgList(E1_lep, E1_gamma, p1v3Dph1));//  w.import(p1Dph1);
-     RooFormulaVar p2Dph1("p2Dph1", dotProduct_4d, RooArgList(E2_lep, E1_gamma, p2v3Dph1)); // w.import(p2Dph1);
-     RooFormulaVar p1Dph2("p1Dph2", dotProduct_4d, RooArgList(E1_lep, E2_gamma, p1v3Dph2));  //w.import(p1Dph2);
-     RooFormulaVar p2Dph2("p2Dph2", dotProduct_4d, RooArgList(E2_lep, E2_gamma, p2v3Dph2));  //w.import(p2Dph2);
-     RooFormulaVar ph1Dph2("ph1Dph2", dotProduct_4d, RooArgList(E1_gamma, E2_gamma, ph1v3Dph2)); // w.import(ph1Dph2);
-
-     RooRealVar bwMean("bwMean", "m_{Z^{0}}", 91.187); //w.import(bwMean);
-     RooRealVar bwGamma("bwGamma", "#Gamma", 2.5); 
-
-
-     RooProdPdf* PDFRelBW;  
-     RooFormulaVar* mZ;
-     RooGenericPdf* RelBW;
-
-     //mZ
-     mZ = new RooFormulaVar("mZ", "TMath::Sqrt(2*@0+@1*@1+@2*@2)", RooArgList(p1D2, m1, m2));
-     RelBW = new RooGenericPdf("RelBW","1/( pow(mZ*mZ-bwMean*bwMean,2)+pow(mZ,4)*pow(bwGamma/bwMean,2) )", RooArgSet(*mZ,bwMean,bwGamma) );
-     PDFRelBW = new RooProdPdf("PDFRelBW", "PDFRelBW", RooArgList(gauss1_lep, gauss2_lep, *RelBW));     
-
-     if (input.nFsr == 1) {
-
-        mZ = new RooFormulaVar("mZ", "TMath::Sqrt(2*@0+2*@1+2*@2+@3*@3+@4*@4)", RooArgList(p1D2, p1Dph1, p2Dph1, m1, m2));
-        RelBW = new RooGenericPdf("RelBW","1/( pow(mZ*mZ-bwMean*bwMean,2)+pow(mZ,4)*pow(bwGamma/bwMean,2) )", RooArgSet(*mZ,bwMean,bwGamma) );
-//        PDFRelBW = new RooProdPdf("PDFRelBW", "PDFRelBW", RooArgList(gauss1_lep, gauss2_lep, gauss1_gamma, *RelBW));
-
-        } 
+void KinZfitter::MakeModel(/*RooWorkspace &w,*/ KinZfitter::FitInput &input, KinZfitter::FitOutput &output, const KinZfitter::FitOutput *seed) {
 
-     if (input.nFsr == 2) {
+     // one model per number of fsr photons, built on first use and reused for all events
+     int nFsr = min(max(input.nFsr, 0), 2);
+     if (!rooFitModels_[nFsr]) rooFitModels_[nFsr].reset(new RooFitZModel(nFsr));
+
+     ZLineshape::Parameters pars;
+     pars.bwMean = bwMean_; pars.bwGamma = bwGamma_;
+     pars.sg = sgVal_; pars.a = aVal_; pars.n = nVal_; pars.f = fVal_;
+     pars.mean = meanVal_; pars.sigma = sigmaVal_; pars.f1 = f1Val_;
 
-        mZ = new RooFormulaVar("mZ", "TMath::Sqrt(2*@0+2*@1+2*@2+2*@3+2*@4+2*@5+@6*@6+@7*@7)", RooArgList(p1D2,p1Dph1,p2Dph1,p1Dph2,p2Dph2,ph1Dph2, m1, m2));
-        RelBW = new RooGenericPdf("RelBW","1/( pow(mZ*mZ-bwMean*bwMean,2)+pow(mZ,4)*pow(bwGamma/bwMean,2) )", RooArgSet(*mZ,bwMean,bwGamma) );
-//        PDFRelBW = new RooProdPdf("PDFRelBW", "PDFRelBW", RooArgList(gauss1_lep, gauss2_lep, gauss1_gamma, gauss2_gamma, *RelBW));
+     // RooMinimizer stops at the call limit (keeping its best point), the time limit is checked afterwards
+     FitBudget budget(0, 0, 0);
+     int nCalls = rooFitModels_[nFsr]->Fit(input, output, seed, mass4lRECO_ > 140, pars, maxFitCalls_, !analyticCovariance_, debug_);
+
+     if (analyticCovariance_) {
+
+        // the floating pTs of the RooFit model are those of the ZLikelihood
+        double pT[4] = {output.pT1_lep, output.pT2_lep, output.pT1_gamma, output.pT2_gamma};
+        ZCovariance cov;
+
+        if (AnalyticCovariance(input, pT, cov)) {
+           output.covMatrixZ = cov;
+           output.pTErr1_lep = sqrt(cov(0,0));
+           output.pTErr2_lep = sqrt(cov(1,1));
+           } else {
+                  // not positive definite: HESSE, from the minimum
+                  if (debug_) cout << "analytic hessian not positive definite, running HESSE" << endl;
+                  FitOutput start;
+                  CopyFitOutput(output, start);
+                  nCalls += rooFitModels_[nFsr]->Fit(input, output, &start, mass4lRECO_ > 140, pars, maxFitCalls_, true, debug_);
+                  }
 
         }
 
-     //true shape
-     RooRealVar sg("sg", "sg", sgVal_);
-     RooRealVar a("a", "a", aVal_);
-     RooRealVar n("n", "n", nVal_);
+     if (maxFitCalls_ <= 0 && maxFitSeconds_ <= 0) return;
 
-     RooCBShape CB("CB","CB",*mZ,bwMean,sg,a,n);
-     RooRealVar f("f","f", fVal_);
+     double seconds = budget.Seconds();
 
-     RooRealVar mean("mean","mean",meanVal_);
-     RooRealVar sigma("sigma","sigma",sigmaVal_);
-     RooRealVar f1("f1","f1",f1Val_);
+     bool callsHit = maxFitCalls_ > 0 && nCalls >= maxFitCalls_;
+     bool timeHit = maxFitSeconds_ > 0 && seconds > maxFitSeconds_;
+     double used = max(maxFitCalls_ > 0 ? double(nCalls)/maxFitCalls_ : 0.0, maxFitSeconds_ > 0 ? seconds/maxFitSeconds_ : 0.0);
 
-     RooAddPdf *RelBWxCB;
-     RelBWxCB = new RooAddPdf("RelBWxCB","RelBWxCB", *RelBW, CB, f);
-     RooGaussian *gauss;
-     gauss = new RooGaussian("gauss","gauss",*mZ,mean,sigma);
-     RooAddPdf *RelBWxCBxgauss;
-     RelBWxCBxgauss = new RooAddPdf("RelBWxCBxgauss","RelBWxCBxgauss", *RelBWxCB, *gauss, f1);
+     // only the call limit stops the minimizer; a fit that converged too slowly keeps its result
+     if (callsHit) {
+        double pT[4] = {output.pT1_lep, output.pT2_lep, output.pT1_gamma, output.pT2_gamma};
+        SetBudgetFallback(input, output, pT, output.covMatrixZ.size);
+        }
+     else if (timeHit) output.status = kFitBudgetHit;
 
-     RooProdPdf *PDFRelBWxCBxgauss;
-     PDFRelBWxCBxgauss = new RooProdPdf("PDFRelBWxCBxgauss","PDFRelBWxCBxgauss", 
-                                     RooArgList(gauss1_lep, gauss2_lep, *RelBWxCBxgauss) );
+     CountBudget(used, callsHit, timeHit, false);
 
+}
 
-    //make fit
-    RooArgSet *rastmp;
-    rastmp = new RooArgSet(pTRECO1_lep, pTRECO2_lep);
-/*
-    if(input.nFsr == 1) {
-      rastmp = new RooArgSet(pTRECO1_lep, pTRECO2_lep, pTRECO1_gamma);
-      }
+template <int NGAMMA, typename T>
+void KinZfitter::MakeModelTabulatedN(KinZfitter::FitInput &input, KinZfitter::FitOutput &output, const KinZfitter::FitOutput *seed) {
 
-    if(input.nFsr == 2) {
-      rastmp = new RooArgSet(pTRECO1_lep, pTRECO2_lep, pTRECO1_gamma, pTRECO2_gamma);
-      }
-*/
-    RooDataSet* pTs = new RooDataSet("pTs","pTs", *rastmp);
-    pTs->add(*rastmp);
+     ZLikelihood<NGAMMA, T> nll(FitLineshape());
+     AddLikelihoodParticles(input, nll);
+
+     double pTRECO[4] = {input.pTRECO1_lep, input.pTRECO2_lep, input.pTRECO1_gamma, input.pTRECO2_gamma};
+     double pTErr[4] = {input.pTErr1_lep, input.pTErr2_lep, input.pTErr1_gamma, input.pTErr2_gamma};
+     double pTMin[4] = {5.0, 5.0, 0.5, 0.5};
+     const char* names[4] = {"pTMean1_lep", "pTMean2_lep", "pTMean1_gamma", "pTMean2_gamma"};
+
+     ROOT::Minuit2::Minuit2Minimizer minimizer(ROOT::Minuit2::kMigrad);
+     minimizer.SetPrintLevel(-1);
+     minimizer.SetStrategy(1);
+     // NLL
+     minimizer.SetErrorDef(0.5);
+
+     // every NLL evaluation is counted against the budget, if any
+     FitBudget budget(maxFitCalls_, maxFitSeconds_, ZLikelihood<NGAMMA, T>::N);
+     BudgetedFunction<ZLikelihood<NGAMMA, T> > function(nll, budget);
+     bool budgeted = maxFitCalls_ > 0 || maxFitSeconds_ > 0;
+     if (budgeted) minimizer.SetFunction(function);
+     else minimizer.SetFunction(nll);
+
+     // warm start of the lepton pTs
+     double pTStart[4] = {pTRECO[0], pTRECO[1], pTRECO[2], pTRECO[3]};
+     if (seed) { pTStart[0] = seed->pT1_lep; pTStart[1] = seed->pT2_lep; }
+
+     const int size = ZLikelihood<NGAMMA, T>::N;
+     for (int i = 0; i < size; i++) {
+
+         // same ranges as the RooRealVars of MakeModel
+         double low = max(pTMin[i], pTRECO[i]-2*pTErr[i]);
+         double high = pTRECO[i]+2*pTErr[i];
+         minimizer.SetLimitedVariable(i, names[i], min(max(pTStart[i], low), high), 0.1*(high-low), low, high);
+
+         }
+
+     bool analytic = false;
+     ZCovariance cov;
+
+     try {
+
+         minimizer.Minimize();
+         // covariance from the analytic hessian, HESSE where it is not positive definite
+         analytic = analyticCovariance_ && AnalyticCovariance(input, minimizer.X(), cov);
+         if (!analytic) minimizer.Hesse();
+
+         } catch (FitBudget::Exceeded &) {
+
+                 // best point of the fit, or the reco pTs
+                 bool reco = !budget.HasBest();
+                 SetBudgetFallback(input, output, reco ? 0 : budget.Best(), size);
+                 if (NGAMMA < 1) output.pT1_gamma = input.pTRECO1_gamma;
+                 if (NGAMMA < 2) output.pT2_gamma = input.pTRECO2_gamma;
+                 output.pTErr1_gamma = input.pTErr1_gamma; output.pTErr2_gamma = input.pTErr2_gamma;
+
+                 CountBudget(1, budget.CallsHit(), budget.TimeHit(), reco);
+                 return;
 
-    RooFitResult* r;
-    if (mass4lRECO_ > 140) {
+                 }
 
-       r = PDFRelBW->fitTo(*pTs,RooFit::Save(),RooFit::PrintLevel(-1));
+     if (budgeted) CountBudget(budget.UsedFraction(), false, false, false);
 
-       } else {
+     if (debug_) cout << "tabulated fit status " << minimizer.Status() << " lineshape table max deviation " << FitLineshape().MaxDeviation() << endl;
 
-              r = PDFRelBWxCBxgauss->fitTo(*pTs,RooFit::Save(),RooFit::PrintLevel(-1));
+     const double *pT = minimizer.X();
 
+     if (analytic) output.covMatrixZ = cov;
+     else {
+          output.covMatrixZ = ZCovariance();
+          output.covMatrixZ.size = size;
+          for (int i = 0; i < size; i++) {
+              for (int j = i; j < size; j++) output.covMatrixZ.matrix(i,j) = minimizer.CovMatrix(i,j);
               }
-    //save fit result
-    const TMatrixDSym& covMatrix = r->covarianceMatrix();
-    const RooArgList& finalPars = r->floatParsFinal();
+          }
 
-    for (int i=0 ; i<finalPars.getSize(); i++){
- 
-        TString name = TString(((RooRealVar*)finalPars.at(i))->GetName());
-        if(debug_) cout<<"name list of RooRealVar for covariance matrix "<<name<<endl;
+     output.pT1_lep = pT[0];
+     output.pT2_lep = pT[1];
+     output.pTErr1_lep = sqrt(output.covMatrixZ(0,0));
+     output.pTErr2_lep = sqrt(output.covMatrixZ(1,1));
 
-    }
+     output.pT1_gamma = NGAMMA >= 1 ? pT[2] : input.pTRECO1_gamma; output.pTErr1_gamma = input.pTErr1_gamma;
+     output.pT2_gamma = NGAMMA == 2 ? pT[3] : input.pTRECO2_gamma; output.pTErr2_gamma = input.pTErr2_gamma;
 
-    int size = covMatrix.GetNcols();
-    output.covMatrixZ.ResizeTo(size,size);
-    output.covMatrixZ = covMatrix;
-    
-    output.pT1_lep = pTMean1_lep.getVal();
-    output.pT2_lep = pTMean2_lep.getVal();
-    output.pTErr1_lep = pTMean1_lep.getError();
-    output.pTErr2_lep = pTMean2_lep.getError();
-/*
-    if (input.nFsr >= 1) {
+     output.status = kFitOK;
 
-       output.pT1_gamma = pTMean1_gamma.getVal();
-       output.pTErr1_gamma = pTMean1_gamma.getError();
-    
-       }
+}
 
-    if (input.nFsr == 2) {
+void KinZfitter::MakeModelTabulated(KinZfitter::FitInput &input, KinZfitter::FitOutput &output, const KinZfitter::FitOutput *seed) {
 
-       output.pT2_gamma = pTMean2_gamma.getVal();
-       output.pTErr2_gamma = pTMean2_gamma.getError();
+     typedef void (KinZfitter::*Kernel)(FitInput &, FitOutput &, const FitOutput *);
+     static const Kernel kernels[2][3] = { { &KinZfitter::MakeModelTabulatedN<0, double>,
+                                           &KinZfitter::MakeModelTabulatedN<1, double>,
+                                           &KinZfitter::MakeModelTabulatedN<2, double> },
+                                         { &KinZfitter::MakeModelTabulatedN<0, float>,
+                                           &KinZfitter::MakeModelTabulatedN<1, float>,
+                                           &KinZfitter::MakeModelTabulatedN<2, float> } };
+
+     (this->*kernels[floatKernel_ ? 1 : 0][FitNGamma(input)])(input, output, seed);
+
+}
+
+const ZLineshape & KinZfitter::FitLineshape() {
+
+     // same choice as MakeModel
+     return GetLineshape(mass4lRECO_ > 140 ? ZLineshape::kRelBW : ZLineshape::kRelBWxCBxgauss);
+
+}
+
+int KinZfitter::FitNGamma(const KinZfitter::FitInput &input) const {
+
+     // as in MakeModel: the RelBW (above 140 GeV) uses the lepton-only mZ, the RelBWxCBxgauss
+     // the mZ including the fsr photons, whose pTs float without constraint
+     return mass4lRECO_ > 140 ? 0 : min(max(input.nFsr, 0), 2);
+
+}
+
+template <int NGAMMA, typename T>
+void KinZfitter::AddLikelihoodParticles(KinZfitter::FitInput &input, ZLikelihood<NGAMMA, T> &nll) {
+
+     nll.SetLepton(0, input.pTRECO1_lep, input.pTErr1_lep, input.theta1_lep, input.phi1_lep, input.m1);
+     nll.SetLepton(1, input.pTRECO2_lep, input.pTErr2_lep, input.theta2_lep, input.phi2_lep, input.m2);
+
+     if (NGAMMA >= 1) nll.SetPhoton(0, input.theta1_gamma, input.phi1_gamma);
+     if (NGAMMA == 2) nll.SetPhoton(1, input.theta2_gamma, input.phi2_gamma);
+
+     nll.Init();
+
+}
+
+const ZLineshape & KinZfitter::GetLineshape(ZLineshape::Model model) {
+
+     // keyed on the exact values as in the store: variations a few MeV apart get their own
+     // table, a replayed record with the parameters of a parameter set shares its table
+     double values[] = { double(model), bwMean_, bwGamma_, sgVal_, aVal_, nVal_, fVal_, meanVal_, sigmaVal_, f1Val_ };
+     std::vector<double> key(values, values + sizeof(values)/sizeof(double));
+
+     std::map<std::vector<double>, boost::shared_ptr<const ZLineshape> >::const_iterator it = lineshapes_.find(key);
+     if (it != lineshapes_.end()) return *it->second;
+
+     ZLineshape::Parameters pars;
+     pars.bwMean = bwMean_; pars.bwGamma = bwGamma_;
+     pars.sg = sgVal_; pars.a = aVal_; pars.n = nVal_; pars.f = fVal_;
+     pars.mean = meanVal_; pars.sigma = sigmaVal_; pars.f1 = f1Val_;
+
+     if (debug_) cout << "lineshape " << PDFName_ << "_" << fs_ << (model == ZLineshape::kRelBW ? "_RelBW" : "_RelBWxCBxgauss")
+                      << " " << bwMean_ << " " << bwGamma_ << " from the parameter store" << endl;
+
+     // tabulated once per process, this map only saves the lookup in the store
+     return *lineshapes_.insert(std::make_pair(key, store_->Lineshape(model, pars))).first->second;
+
+}
+
+namespace {
+
+  // solve A x = b for n <= 4 with partial pivoting, A and b are overwritten
+  bool SolveLinear(int n, double A[4][4], double b[4], double x[4]) {
+
+     for (int k = 0; k < n; k++) {
+
+         int p = k;
+         for (int i = k+1; i < n; i++) if (fabs(A[i][k]) > fabs(A[p][k])) p = i;
+         if (A[p][k] == 0) return false;
+
+         for (int j = 0; j < n; j++) std::swap(A[k][j], A[p][j]);
+         std::swap(b[k], b[p]);
+
+         for (int i = k+1; i < n; i++) {
+             double r = A[i][k]/A[k][k];
+             for (int j = k; j < n; j++) A[i][j] -= r*A[k][j];
+             b[i] -= r*b[k];
+             }
+
+         }
+
+     for (int i = n-1; i >= 0; i--) {
+         x[i] = b[i];
+         for (int j = i+1; j < n; j++) x[i] -= A[i][j]*x[j];
+         x[i] /= A[i][i];
+         }
+
+     return true;
+
+  }
+
+  // inverse of a symmetric positive definite A, n <= 4, by Cholesky; false if A is not
+  bool InvertPositive(int n, const double A[4][4], double inverse[4][4]) {
+
+     // A = L L^T
+     double L[4][4] = {{0}};
+     for (int j = 0; j < n; j++) {
+
+         double d = A[j][j];
+         for (int k = 0; k < j; k++) d -= L[j][k]*L[j][k];
+         if (!(d > 0)) return false;
+         L[j][j] = sqrt(d);
+
+         for (int i = j+1; i < n; i++) {
+             double v = A[i][j];
+             for (int k = 0; k < j; k++) v -= L[i][k]*L[j][k];
+             L[i][j] = v/L[j][j];
+             }
+
+         }
+
+     // L^-1, lower triangular
+     double Linv[4][4] = {{0}};
+     for (int j = 0; j < n; j++) {
+         Linv[j][j] = 1/L[j][j];
+         for (int i = j+1; i < n; i++) {
+             double v = 0;
+             for (int k = j; k < i; k++) v -= L[i][k]*Linv[k][j];
+             Linv[i][j] = v/L[i][i];
+             }
+         }
+
+     // A^-1 = L^-T L^-1
+     for (int i = 0; i < n; i++) {
+         for (int j = 0; j <= i; j++) {
+             double v = 0;
+             for (int k = i; k < n; k++) v += Linv[k][i]*Linv[k][j];
+             inverse[i][j] = v; inverse[j][i] = v;
+             }
+         }
+
+     return true;
+
+  }
+
+}
+
+template <int NGAMMA>
+void KinZfitter::ZFitHessianN(KinZfitter::FitInput &input, const double *pT, double H[4][4]) {
+
+     ZLikelihood<NGAMMA> nll(FitLineshape());
+     AddLikelihoodParticles(input, nll);
+     const int n = ZLikelihood<NGAMMA>::N;
+
+     double hess[n*n];
+     nll.Hessian(pT, hess);
+     for (int i = 0; i < n; i++) for (int j = 0; j < n; j++) H[i][j] = hess[i*n+j];
+
+}
+
+void KinZfitter::ZFitHessian(KinZfitter::FitInput &input, const double *pT, double H[4][4]) {
+
+     typedef void (KinZfitter::*Kernel)(FitInput &, const double *, double [4][4]);
+     static const Kernel kernels[3] = { &KinZfitter::ZFitHessianN<0>,
+                                        &KinZfitter::ZFitHessianN<1>,
+                                        &KinZfitter::ZFitHessianN<2> };
+
+     (this->*kernels[FitNGamma(input)])(input, pT, H);
+
+}
+
+bool KinZfitter::AnalyticCovariance(KinZfitter::FitInput &input, const double *pT, KinZfitter::ZCovariance &cov) {
+
+     // covariance = (d2 NLL)^-1, the NLL having errordef 0.5
+     const int n = 2 + FitNGamma(input);
+     double H[4][4], inverse[4][4];
+     ZFitHessian(input, pT, H);
+
+     if (!InvertPositive(n, H, inverse)) return false;
+
+     cov = ZCovariance();
+     cov.size = n;
+     for (int i = 0; i < n; i++) for (int j = i; j < n; j++) cov.matrix(i,j) = inverse[i][j];
+
+     return true;
+
+}
+
+template <int NGAMMA>
+double KinZfitter::ZFitNLLN(KinZfitter::FitInput &input, const KinZfitter::FitOutput *output) {
+
+     ZLikelihood<NGAMMA> nll(FitLineshape());
+     AddLikelihoodParticles(input, nll);
+
+     if (output) {
+        double pT[4] = {output->pT1_lep, output->pT2_lep, output->pT1_gamma, output->pT2_gamma};
+        return nll(pT);
+        }
+
+     // the fit ranges of MakeModel
+     double pTRECO[4] = {input.pTRECO1_lep, input.pTRECO2_lep, input.pTRECO1_gamma, input.pTRECO2_gamma};
+     double pTErr[4] = {input.pTErr1_lep, input.pTErr2_lep, input.pTErr1_gamma, input.pTErr2_gamma};
+     double pTMin[4] = {5.0, 5.0, 0.5, 0.5};
+     double low[4], high[4];
+     for (int i = 0; i < 4; i++) {
+         low[i] = max(pTMin[i], pTRECO[i]-2*pTErr[i]);
+         high[i] = pTRECO[i]+2*pTErr[i];
+         }
+
+     return nll.LowerBound(low, high);
+
+}
+
+double KinZfitter::ZFitNLL(KinZfitter::FitInput &input, const KinZfitter::FitOutput *output) {
+
+     typedef double (KinZfitter::*Kernel)(FitInput &, const FitOutput *);
+     static const Kernel kernels[3] = { &KinZfitter::ZFitNLLN<0>,
+                                        &KinZfitter::ZFitNLLN<1>,
+                                        &KinZfitter::ZFitNLLN<2> };
+
+     return (this->*kernels[FitNGamma(input)])(input, output);
+
+}
+
+template <int NGAMMA>
+void KinZfitter::ZFitSensitivityN(KinZfitter::FitInput &input, KinZfitter::FitOutput &output, double dpT[4][2]) {
+
+     // implicit function theorem at the minimum: grad_theta NLL(theta*, x) = 0
+     // => dtheta*/dx = - H^-1 d(grad_theta NLL)/dx, for x = lepton pTRECO1, pTRECO2, pTErr1, pTErr2;
+     // pTs sitting at a range boundary follow the boundary
+     const int n = ZLikelihood<NGAMMA>::N;
+
+     double theta[4] = {output.pT1_lep, output.pT2_lep, output.pT1_gamma, output.pT2_gamma};
+     double pTRECO[4] = {input.pTRECO1_lep, input.pTRECO2_lep, input.pTRECO1_gamma, input.pTRECO2_gamma};
+     double pTErr[4] = {input.pTErr1_lep, input.pTErr2_lep, input.pTErr1_gamma, input.pTErr2_gamma};
+     double pTMin[4] = {5.0, 5.0, 0.5, 0.5};
+
+     // which pTs are at a boundary, and how the boundary moves with the lepton inputs
+     int atBound[4];
+     for (int i = 0; i < n; i++) {
+         double low = max(pTMin[i], pTRECO[i]-2*pTErr[i]);
+         double high = pTRECO[i]+2*pTErr[i];
+         double eps = 1e-6*(high-low);
+         atBound[i] = theta[i] >= high-eps ? 1 : (theta[i] <= low+eps && low > pTMin[i] ? -1 : (theta[i] <= low+eps ? -2 : 0));
+         }
+
+     double H[4][4];
+     ZFitHessianN<NGAMMA>(input, theta, H);
+
+     for (int k = 0; k < 4; k++) {
+
+         // perturbed inputs
+         FitInput inUp = input, inDown = input;
+         double *xUp[4] = {&inUp.pTRECO1_lep, &inUp.pTRECO2_lep, &inUp.pTErr1_lep, &inUp.pTErr2_lep};
+         double *xDown[4] = {&inDown.pTRECO1_lep, &inDown.pTRECO2_lep, &inDown.pTErr1_lep, &inDown.pTErr2_lep};
+         double step = 1e-5*max(1.0, fabs(*xUp[k]));
+         *xUp[k] += step; *xDown[k] -= step;
+
+         ZLikelihood<NGAMMA> nllUp(FitLineshape()), nllDown(FitLineshape());
+         AddLikelihoodParticles(inUp, nllUp); AddLikelihoodParticles(inDown, nllDown);
+
+         double gUp[4], gDown[4], b[4];
+         nllUp.Gradient(theta, gUp); nllDown.Gradient(theta, gDown);
+         for (int i = 0; i < n; i++) b[i] = (gUp[i]-gDown[i])/(2*step);
+
+         // pTs at a boundary: boundary pTRECO +- 2 pTErr of the same lepton (photon boundaries do not move)
+         double dTheta[4] = {0, 0, 0, 0};
+         for (int i = 0; i < n && i < 2; i++) {
+             if (atBound[i] == 0 || atBound[i] == -2) continue;
+             if (k == i) dTheta[i] = 1;
+             if (k == i+2) dTheta[i] = atBound[i] == 1 ? 2 : -2;
+             }
+
+         // free pTs: H_ff dtheta_f = -(b_f + H_fb dtheta_b)
+         int free[4], nFree = 0;
+         for (int i = 0; i < n; i++) if (atBound[i] == 0) free[nFree++] = i;
+
+         double A[4][4], rhs[4], sol[4];
+         for (int a = 0; a < nFree; a++) {
+             rhs[a] = -b[free[a]];
+             for (int i = 0; i < n; i++) if (atBound[i] != 0) rhs[a] -= H[free[a]][i]*dTheta[i];
+             for (int c = 0; c < nFree; c++) A[a][c] = H[free[a]][free[c]];
+             }
+
+         if (nFree > 0 && SolveLinear(nFree, A, rhs, sol)) {
+            for (int a = 0; a < nFree; a++) dTheta[free[a]] = sol[a];
+            }
+
+         dpT[k][0] = dTheta[0];
+         dpT[k][1] = dTheta[1];
+
+         }
+
+}
+
+void KinZfitter::ZFitSensitivity(KinZfitter::FitInput &input, KinZfitter::FitOutput &output, double dpT[4][2]) {
+
+     typedef void (KinZfitter::*Kernel)(FitInput &, FitOutput &, double [4][2]);
+     static const Kernel kernels[3] = { &KinZfitter::ZFitSensitivityN<0>,
+                                        &KinZfitter::ZFitSensitivityN<1>,
+                                        &KinZfitter::ZFitSensitivityN<2> };
+
+     (this->*kernels[FitNGamma(input)])(input, output, dpT);
+
+}
+
+void KinZfitter::RefitMasses(const double *pT, double &m4l, double &mZ1, double &mZ2) {
+
+     // GetRefitP4s with the lepton pTs replaced
+     vector<TLorentzVector> p4s;
+     for (int i = 0; i < 4; i++) {
+         TLorentzVector p4 = i < 2 ? p4sZ1_[i] : p4sZ2_[i-2];
+         TLorentzVector lep;
+         lep.SetPtEtaPhiM(pT[i], p4.Eta(), p4.Phi(), p4.M());
+         p4s.push_back(lep);
+         }
+
+     for (unsigned int ifsr1 = 0; ifsr1<p4sZ1phREFIT_.size(); ifsr1++){
+         if(idsFsrZ1_[ifsr1]==idsZ1_[0]) p4s[0] = p4s[0] + p4sZ1phREFIT_[ifsr1];
+         if(idsFsrZ1_[ifsr1]==idsZ1_[1]) p4s[1] = p4s[1] + p4sZ1phREFIT_[ifsr1];
+         }
+     for (unsigned int ifsr2 = 0; ifsr2<p4sZ2phREFIT_.size(); ifsr2++){
+         if(idsFsrZ2_[ifsr2]==idsZ2_[0]) p4s[2] = p4s[2] + p4sZ2phREFIT_[ifsr2];
+         if(idsFsrZ2_[ifsr2]==idsZ2_[1]) p4s[3] = p4s[3] + p4sZ2phREFIT_[ifsr2];
+         }
+
+     mZ1 = (p4s[0] + p4s[1]).M();
+     mZ2 = (p4s[2] + p4s[3]).M();
+     m4l = (p4s[0] + p4s[1] + p4s[2] + p4s[3]).M();
+
+}
+
+KinZfitter::Sensitivity KinZfitter::GetRefitSensitivity() {
+
+     EnsureRefit();
+
+     Sensitivity sens;
+
+     bool twoZs = mass4lRECO_ > cutoff_;
+
+     // fitted lepton pTs and their derivatives w.r.t. the inputs of their own Z
+     double pT[4] = {p4sZ1REFIT_[0].Pt(), p4sZ1REFIT_[1].Pt(), p4sZ2REFIT_[0].Pt(), p4sZ2REFIT_[1].Pt()};
+     double dpTZ1[4][2], dpTZ2[4][2];
+
+     ZFitSensitivity(fitInput1, fitOutput1, dpTZ1);
+     if (twoZs) ZFitSensitivity(fitInput2, fitOutput2, dpTZ2);
+
+     double pTInput[4] = {p4sZ1_[0].Pt(), p4sZ1_[1].Pt(), p4sZ2_[0].Pt(), p4sZ2_[1].Pt()};
+
+     for (int il = 0; il < 4; il++) {
+         for (int type = 0; type < 2; type++) {
+
+             // linearized change of the fitted pTs for a small change of pT (type 0) or pT error (type 1)
+             double dir[4] = {0, 0, 0, 0};
+             int iz = il/2, k = type*2 + il%2;
+
+             if (iz == 0) { dir[0] = dpTZ1[k][0]; dir[1] = dpTZ1[k][1]; }
+             else if (twoZs) { dir[2] = dpTZ2[k][0]; dir[3] = dpTZ2[k][1]; }
+             // Z2 not refitted: its leptons keep the reco pT
+             else if (type == 0) dir[il] = 1;
+
+             double step = 1e-4*pTInput[il];
+             double pTUp[4], pTDown[4];
+             for (int i = 0; i < 4; i++) { pTUp[i] = pT[i] + step*dir[i]; pTDown[i] = pT[i] - step*dir[i]; }
+
+             double m4lUp, mZ1Up, mZ2Up, m4lDown, mZ1Down, mZ2Down;
+             RefitMasses(pTUp, m4lUp, mZ1Up, mZ2Up);
+             RefitMasses(pTDown, m4lDown, mZ1Down, mZ2Down);
+
+             double dM4l = (m4lUp-m4lDown)/(2*step);
+             double dMZ1 = (mZ1Up-mZ1Down)/(2*step);
+             double dMZ2 = (mZ2Up-mZ2Down)/(2*step);
+
+             if (type == 0) { sens.dM4l_dPt[il] = dM4l; sens.dMZ1_dPt[il] = dMZ1; sens.dMZ2_dPt[il] = dMZ2; }
+             else { sens.dM4l_dPtErr[il] = dM4l; sens.dMZ1_dPtErr[il] = dMZ1; sens.dMZ2_dPtErr[il] = dMZ2; }
+
+             }
+         }
+
+     return sens;
 
-       }
-*/
-    delete rastmp;
-    delete pTs;
-    delete PDFRelBW;
-    delete mZ;
-    delete RelBW;
-    delete RelBWxCB;
-    delete gauss;
-    delete RelBWxCBxgauss;
-    delete PDFRelBWxCBxgauss;
 }
 
 bool KinZfitter::IsFourEFourMu(vector<int> &Z1id, vector<int> &Z2id) {
@@ -1011,6 +2133,84 @@ void  KinZfitter::RepairZ1Z2(vector<TLorentzVector> &Z1Lep, vector<double> &Z1Le
 }
 
 
+void KinZfitter::SetPairingMode(KinZfitter::PairingMode mode)
+{
+
+  pairingMode_ = mode;
+
+  pairingReport_.nCandidates = 0;
+  pairingReport_.nPruned = 0;
+  pairingReport_.nChanged = 0;
+
+}
+
+void KinZfitter::SwapPairing(vector<TLorentzVector> &Z1Lep, vector<double> &Z1LepErr,
+                             vector<TLorentzVector> &Z2Lep, vector<double> &Z2LepErr,
+                             vector<int> &Z1id, vector<int> &Z2id) {
+
+      int partner = (Z1id[0] + Z2id[0] == 0) ? 0 : 1;
+
+      vector<TLorentzVector> lep1 = Z1Lep, lep2 = Z2Lep;
+      vector<double> lepErr1 = Z1LepErr, lepErr2 = Z2LepErr;
+      vector<int> id1 = Z1id, id2 = Z2id;
+
+      Z1Lep[1] = lep2[partner]; Z1LepErr[1] = lepErr2[partner]; Z1id[1] = id2[partner];
+      Z2Lep[0] = lep1[1]; Z2LepErr[0] = lepErr1[1]; Z2id[0] = id1[1];
+      Z2Lep[1] = lep2[1-partner]; Z2LepErr[1] = lepErr2[1-partner]; Z2id[1] = id2[1-partner];
+
+}
+
+void KinZfitter::LikelihoodPairing() {
+
+      // pairing 0: the mass pairing of KinRefitZ, 1: the other one
+      vector<TLorentzVector> Z1Lep[2] = {p4sZ1_, p4sZ1_}, Z2Lep[2] = {p4sZ2_, p4sZ2_};
+      vector<double> Z1LepErr[2] = {pTerrsZ1_, pTerrsZ1_}, Z2LepErr[2] = {pTerrsZ2_, pTerrsZ2_};
+      vector<int> Z1id[2] = {idsZ1_, idsZ1_}, Z2id[2] = {idsZ2_, idsZ2_};
+      SwapPairing(Z1Lep[1], Z1LepErr[1], Z2Lep[1], Z2LepErr[1], Z1id[1], Z2id[1]);
+
+      FitInput input1[2], input2[2];
+      double bound[2], nll[2];
+      for (int i = 0; i < 2; i++) {
+          SetFitInput(input1[i], Z1Lep[i], Z1LepErr[i], p4sZ1ph_, pTerrsZ1ph_);
+          SetFitInput(input2[i], Z2Lep[i], Z2LepErr[i], p4sZ2ph_, pTerrsZ2ph_);
+          bound[i] = ZFitNLL(input1[i], 0) + ZFitNLL(input2[i], 0);
+          }
+
+      // the fits land in the per-event cache, RefitZs reuses those of the chosen pairing
+      int first = bound[1] < bound[0] ? 1 : 0, second = 1 - first;
+      FitOutput output1, output2;
+
+      Driver(input1[first], output1); Driver(input2[first], output2);
+      nll[first] = ZFitNLL(input1[first], &output1) + ZFitNLL(input2[first], &output2);
+
+      int best = first;
+      pairingReport_.nCandidates++;
+
+      if (bound[second] >= nll[first]) {
+
+         pairingReport_.nPruned++;
+
+         } else {
+
+                Driver(input1[second], output1); Driver(input2[second], output2);
+                nll[second] = ZFitNLL(input1[second], &output1) + ZFitNLL(input2[second], &output2);
+                if (nll[second] < nll[first]) best = second;
+
+                }
+
+      if (debug_) cout << "pairing NLL bounds " << bound[0] << " " << bound[1] << ", fitted pairing " << first
+                       << " NLL " << nll[first] << ", chosen pairing " << best << endl;
+
+      if (best == 1) {
+
+         pairingReport_.nChanged++;
+         p4sZ1_ = Z1Lep[1]; pTerrsZ1_ = Z1LepErr[1]; idsZ1_ = Z1id[1];
+         p4sZ2_ = Z2Lep[1]; pTerrsZ2_ = Z2LepErr[1]; idsZ2_ = Z2id[1];
+
+         }
+
+}
+
 int KinZfitter::PerZ1Likelihood(double & l1, double & l2, double & lph1, double & lph2)
 {
 
@@ -1162,13 +2362,14 @@ int KinZfitter::PerZ1Likelihood(double & l1, double & l2, double & lph1, double
     // mZ1
 
     RooFormulaVar* mZ1;
-    mZ1 = new RooFormulaVar("mZ1","TMath::Sqrt(2*@0+@1*@1+@2*@2)",RooArgList(p1D2,*m1,*m2));
     if(p4sZ1ph_.size()==1)
       mZ1 = new RooFormulaVar("mZ1","TMath::Sqrt(2*@0+2*@1+2*@2+@3*@3+@4*@4)",
                                     RooArgList(p1D2, p1Dph1, p2Dph1, *m1,*m2));
-    if(p4sZ1ph_.size()==2)
+    else if(p4sZ1ph_.size()==2)
       mZ1 = new RooFormulaVar("mZ1","TMath::Sqrt(2*@0+2*@1+2*@2+2*@3+2*@4+2*@5+@6*@6+@7*@7)",
                               RooArgList(p1D2,p1Dph1,p2Dph1,p1Dph2,p2Dph2,ph1Dph2, *m1,*m2));
+    else
+      mZ1 = new RooFormulaVar("mZ1","TMath::Sqrt(2*@0+@1*@1+@2*@2)",RooArgList(p1D2,*m1,*m2));
 
     if(debug_) cout<<"mZ1 is "<<mZ1->getVal()<<endl;
 
@@ -1186,8 +2387,8 @@ int KinZfitter::PerZ1Likelihood(double & l1, double & l2, double & lph1, double
     RooGaussian gaussph1("gaussph1","gaussian PDF", *pTph1RECO, *pTph1, sigmaZ1_ph1);
     RooGaussian gaussph2("gaussph2","gaussian PDF", *pTph2RECO, *pTph2, sigmaZ1_ph2);
 
-    RooRealVar bwMean("bwMean", "m_{Z^{0}}", 91.187);
-    RooRealVar bwGamma("bwGamma", "#Gamma", 2.5);
+    RooRealVar bwMean("bwMean", "m_{Z^{0}}", bwMean_);
+    RooRealVar bwGamma("bwGamma", "#Gamma", bwGamma_);
 
     RooRealVar sg("sg", "sg", sgVal_);
     RooRealVar a("a", "a", aVal_);
@@ -1206,23 +2407,26 @@ int KinZfitter::PerZ1Likelihood(double & l1, double & l2, double & lph1, double
     RooGaussian gauss("gauss","gauss",*mZ1,mean,sigma);
     RooAddPdf RelBWxCBxgauss("RelBWxCBxgauss","RelBWxCBxgauss", RelBWxCB, gauss, f1);
 
+    // one model and observable set per call, chosen before allocating
     RooProdPdf *PDFRelBWxCBxgauss;
-    PDFRelBWxCBxgauss = new RooProdPdf("PDFRelBWxCBxgauss","PDFRelBWxCBxgauss", 
-                                     RooArgList(gauss1, gauss2, RelBWxCBxgauss) );
     if(p4sZ1ph_.size()==1)    
       PDFRelBWxCBxgauss = new RooProdPdf("PDFRelBWxCBxgauss","PDFRelBWxCBxgauss", 
                                      RooArgList(gauss1, gauss2, gaussph1, RelBWxCBxgauss) );
-    if(p4sZ1ph_.size()==2)
+    else if(p4sZ1ph_.size()==2)
       PDFRelBWxCBxgauss = new RooProdPdf("PDFRelBWxCBxgauss","PDFRelBWxCBxgauss", 
                                      RooArgList(gauss1, gauss2, gaussph1, gaussph2, RelBWxCBxgauss) );
+    else
+      PDFRelBWxCBxgauss = new RooProdPdf("PDFRelBWxCBxgauss","PDFRelBWxCBxgauss", 
+                                     RooArgList(gauss1, gauss2, RelBWxCBxgauss) );
 
     // observable set
     RooArgSet *rastmp;
-      rastmp = new RooArgSet(*pT1RECO,*pT2RECO);
     if(p4sZ1ph_.size()==1)
       rastmp = new RooArgSet(*pT1RECO,*pT2RECO,*pTph1RECO);
-    if(p4sZ1ph_.size()>=2)
+    else if(p4sZ1ph_.size()>=2)
       rastmp = new RooArgSet(*pT1RECO,*pT2RECO,*pTph1RECO,*pTph2RECO);
+    else
+      rastmp = new RooArgSet(*pT1RECO,*pT2RECO);
 
     RooDataSet* pTs = new RooDataSet("pTs","pTs", *rastmp);
     pTs->add(*rastmp); 
@@ -1242,10 +2446,7 @@ int KinZfitter::PerZ1Likelihood(double & l1, double & l2, double & lph1, double
 
     }
 
-    int size = covMatrix.GetNcols();
-    //TMatrixDSym covMatrixTest_(size);
-    covMatrixZ1_.ResizeTo(size,size);
-    covMatrixZ1_ = covMatrix;   
+    covMatrixZ1_.Set(covMatrix);
 
     if(debug_) cout<<"save the covariance matrix"<<endl;
     
@@ -1279,7 +2480,10 @@ int KinZfitter::PerZ1Likelihood(double & l1, double & l2, double & lph1, double
     delete mZ1;
     delete pT1; delete pT2; delete pTph1; delete pTph2;
     delete pT1RECO; delete pT2RECO; delete pTph1RECO; delete pTph2RECO;
-    delete ph1v3Dph2; delete p1v3Dph1; delete p2v3Dph1; delete p1v3Dph2; delete p2v3Dph2;
+    delete ph1v3Dph2; delete p1v3Dph1; delete p2v3Dph1; delete p1v3Dph2; delete p2v3Dph2; delete p1v3D2;
+    delete m1; delete m2;
+    delete theta1; delete phi1; delete theta2; delete phi2;
+    delete thetaph1; delete phiph1; delete thetaph2; delete phiph2;
     delete PDFRelBWxCBxgauss;
     delete pTs;
     delete rastmp;
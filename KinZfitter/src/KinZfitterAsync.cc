@@ -0,0 +1,153 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#include "KinZfitter/KinZfitter/interface/KinZfitterAsync.h"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+using namespace std;
+
+KinZfitterAsync::KinZfitterAsync(bool isData, int nThreads, int maxInFlight, const std::function<void (KinZfitter &)> &configure)
+    : inFlight_(0), maxInFlight_(max(maxInFlight, 1)), stop_(false)
+{
+
+     for (int i = 0; i < max(nThreads, 1); i++) {
+
+         boost::shared_ptr<KinZfitter> fitter(new KinZfitter(isData));
+         if (configure) configure(*fitter);
+
+         // the caller keeps running while the worker fits, RooFit would run on two threads
+         if (fitter->GetFitEngine() == KinZfitter::kRooFitEngine)
+            throw std::invalid_argument("KinZfitterAsync: kRooFitEngine is not thread-safe, use KinZfitterBatch or a KinZfitter");
+
+         fitters_.push_back(fitter);
+
+         }
+
+     for (unsigned int i = 0; i < fitters_.size(); i++) threads_.push_back(std::thread(&KinZfitterAsync::Work, this, int(i)));
+
+}
+
+KinZfitterAsync::~KinZfitterAsync()
+{
+
+     {
+       std::lock_guard<std::mutex> lock(mutex_);
+       stop_ = true;
+     }
+     notEmpty_.notify_all();
+
+     for (unsigned int i = 0; i < threads_.size(); i++) threads_[i].join();
+
+}
+
+std::future<KinZfitter::RefitResult> KinZfitterAsync::Submit(const KinZfitter::RefitCandidate &candidate)
+{
+
+     std::unique_lock<std::mutex> lock(mutex_);
+     notFull_.wait(lock, [this] { return inFlight_ < maxInFlight_; });
+
+     return Enqueue(candidate);
+
+}
+
+bool KinZfitterAsync::TrySubmit(const KinZfitter::RefitCandidate &candidate, std::future<KinZfitter::RefitResult> &result)
+{
+
+     std::lock_guard<std::mutex> lock(mutex_);
+     if (inFlight_ >= maxInFlight_) return false;
+
+     result = Enqueue(candidate);
+     return true;
+
+}
+
+std::future<KinZfitter::RefitResult> KinZfitterAsync::Enqueue(const KinZfitter::RefitCandidate &candidate)
+{
+
+     // called with mutex_ held
+     boost::shared_ptr<Task> task(new Task);
+     task->candidate = candidate;
+     std::future<KinZfitter::RefitResult> result = task->result.get_future();
+
+     tasks_.push_back(task);
+     inFlight_++;
+     notEmpty_.notify_one();
+
+     return result;
+
+}
+
+int KinZfitterAsync::InFlight()
+{
+
+     std::lock_guard<std::mutex> lock(mutex_);
+     return inFlight_;
+
+}
+
+void KinZfitterAsync::Wait()
+{
+
+     std::unique_lock<std::mutex> lock(mutex_);
+     notFull_.wait(lock, [this] { return inFlight_ == 0; });
+
+}
+
+void KinZfitterAsync::Work(int thread)
+{
+
+     KinZfitter &fitter = *fitters_[thread];
+
+     while (true) {
+
+           boost::shared_ptr<Task> task;
+
+           {
+             std::unique_lock<std::mutex> lock(mutex_);
+             notEmpty_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+             // on stop, the queue is drained first
+             if (tasks_.empty()) return;
+             task = tasks_.front();
+             tasks_.pop_front();
+           }
+
+           try {
+
+               fitter.ClearCache();
+               fitter.Setup(task->candidate);
+               fitter.KinRefitZ();
+               task->result.set_value(fitter.GetRefitResult());
+
+               }
+           catch (...) {
+
+               task->result.set_exception(std::current_exception());
+
+               }
+
+           {
+             std::lock_guard<std::mutex> lock(mutex_);
+             inFlight_--;
+           }
+           // Submit waits for a free slot, Wait for none in flight
+           notFull_.notify_all();
+
+           }
+
+}
+
+FitLatency KinZfitterAsync::Latency() const
+{
+
+     FitLatency latency(0);
+     for (unsigned int i = 0; i < fitters_.size(); i++) {
+         if (i == 0) latency = fitters_[i]->GetLatency();
+         else latency.Merge(fitters_[i]->GetLatency());
+         }
+
+     return latency;
+
+}
@@ -0,0 +1,150 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#include "KinZfitter/KinZfitter/interface/KinZfitterBatch.h"
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+using namespace std;
+
+struct KinZfitterBatch::Queue {
+
+       // candidate indices by decreasing cost
+       std::deque<int> tasks;
+       std::mutex mutex;
+
+};
+
+KinZfitterBatch::KinZfitterBatch(bool isData, int nThreads, const std::function<void (KinZfitter &)> &configure)
+    : failed_(false)
+{
+
+     for (int i = 0; i < max(nThreads, 1); i++) {
+
+         boost::shared_ptr<KinZfitter> fitter(new KinZfitter(isData));
+         if (configure) configure(*fitter);
+
+         if (i > 0 && fitter->GetFitEngine() == KinZfitter::kRooFitEngine) {
+            cout << "KinZfitterBatch: kRooFitEngine is not thread-safe, using one thread" << endl;
+            break;
+            }
+
+         fitters_.push_back(fitter);
+
+         }
+
+}
+
+vector<KinZfitter::RefitResult> KinZfitterBatch::Refit(const vector<KinZfitter::RefitCandidate> &candidates)
+{
+
+     int nThreads = fitters_.size();
+     vector<KinZfitter::RefitResult> results(candidates.size());
+
+     // deal by decreasing cost, round robin: every queue starts with expensive candidates
+     vector<pair<double, int> > order;
+     for (unsigned int i = 0; i < candidates.size(); i++) order.push_back(make_pair(-fitters_[0]->EstimateFitCost(candidates[i]), int(i)));
+     std::sort(order.begin(), order.end());
+
+     vector<Queue> queues(nThreads);
+     for (unsigned int i = 0; i < order.size(); i++) queues[i % nThreads].tasks.push_back(order[i].second);
+
+     nDone_.assign(nThreads, 0);
+     nStolen_.assign(nThreads, 0);
+     error_ = std::exception_ptr();
+     failed_ = false;
+
+     vector<std::thread> threads;
+     for (int t = 1; t < nThreads; t++) {
+         threads.push_back(std::thread(&KinZfitterBatch::Work, this, t, std::ref(queues), std::cref(candidates), std::ref(results)));
+         }
+
+     Work(0, queues, candidates, results);
+
+     for (unsigned int t = 0; t < threads.size(); t++) threads[t].join();
+
+     if (error_) std::rethrow_exception(error_);
+
+     return results;
+
+}
+
+void KinZfitterBatch::Work(int thread, vector<Queue> &queues,
+                           const vector<KinZfitter::RefitCandidate> &candidates,
+                           vector<KinZfitter::RefitResult> &results)
+{
+
+     KinZfitter &fitter = *fitters_[thread];
+     int nThreads = queues.size();
+
+     while (!failed_) {
+
+           int task = -1;
+           bool stolen = false;
+
+           {
+             std::lock_guard<std::mutex> lock(queues[thread].mutex);
+             if (!queues[thread].tasks.empty()) {
+                task = queues[thread].tasks.front();
+                queues[thread].tasks.pop_front();
+                }
+           }
+
+           // steal the cheapest candidate of another queue; nothing is added
+           // while running, so all queues empty means done
+           for (int i = 1; task < 0 && i < nThreads; i++) {
+
+               Queue &victim = queues[(thread + i) % nThreads];
+               std::lock_guard<std::mutex> lock(victim.mutex);
+               if (!victim.tasks.empty()) {
+                  task = victim.tasks.back();
+                  victim.tasks.pop_back();
+                  stolen = true;
+                  }
+
+               }
+
+           if (task < 0) break;
+
+           try {
+
+               // candidates are independent, no per-event cache sharing
+               fitter.ClearCache();
+               fitter.Setup(candidates[task]);
+               fitter.KinRefitZ();
+               results[task] = fitter.GetRefitResult();
+
+               }
+           catch (...) {
+
+               // nothing may leave a thread; the others stop at their next candidate
+               std::lock_guard<std::mutex> lock(errorMutex_);
+               if (!error_) error_ = std::current_exception();
+               failed_ = true;
+               break;
+
+               }
+
+           nDone_[thread]++;
+           if (stolen) nStolen_[thread]++;
+
+           }
+
+}
+
+FitLatency KinZfitterBatch::Latency() const
+{
+
+     FitLatency latency(0);
+     for (unsigned int i = 0; i < fitters_.size(); i++) {
+         if (i == 0) latency = fitters_[i]->GetLatency();
+         else latency.Merge(fitters_[i]->GetLatency());
+         }
+
+     return latency;
+
+}
@@ -0,0 +1,285 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#include "KinZfitter/KinZfitter/interface/ParameterStore.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include "FWCore/ParameterSet/interface/FileInPath.h"
+
+using namespace std;
+
+std::string ParameterStore::imageFile_;
+
+namespace {
+
+  const char kImageMagic[4] = {'K', 'Z', 'P', 'S'};
+  const uint32_t kImageVersion = 1;
+
+  // all blocks are multiples of 8 bytes, the doubles stay aligned
+  struct ImageHeader {
+
+     char magic[4];
+     uint32_t version;
+     uint32_t nParameterSets;
+     uint32_t nTables;
+
+  };
+
+  struct ImageParameterSet {
+
+     // <PDFName>_<fs>
+     char name[120];
+     double pars[7];
+
+  };
+
+  // followed by (nx+1) + (ny+1) + nx*ny doubles
+  struct ImageTable {
+
+     char name[16];
+     int32_t nx, ny;
+
+  };
+
+  struct Unmap {
+
+     size_t size;
+     explicit Unmap(size_t s) : size(s) {}
+     void operator()(const void *p) const { munmap(const_cast<void*>(p), size); }
+
+  };
+
+  const char * kTableNames[4] = {"mu_reco53x", "mu_mc53x", "el_reco53x", "el_mc53x"};
+
+}
+
+boost::shared_ptr<const ParameterStore> ParameterStore::Instance() {
+
+     // thread-safe initialization of function-local statics
+     static const boost::shared_ptr<const ParameterStore> store(imageFile_.empty() ? new ParameterStore()
+                                                                                   : new ParameterStore(imageFile_));
+     return store;
+
+}
+
+void ParameterStore::SetImage(const std::string &fileName) {
+
+     imageFile_ = fileName;
+
+}
+
+ParameterStore::ParameterStore() {
+
+     ReadParamZ1();
+     corrections_ = HelperFunction::defaultPtErrCorrections();
+
+}
+
+ParameterStore::ParameterStore(const std::string &imageFile) {
+
+     if (!ReadImage(imageFile)) {
+
+        cout << "ParameterStore: cannot use image " << imageFile << ", reading the parameter files" << endl;
+        parameters_.clear();
+        ReadParamZ1();
+        corrections_ = HelperFunction::defaultPtErrCorrections();
+
+        }
+
+}
+
+void ParameterStore::ReadParamZ1() {
+
+     // same location as KinZfitter used to read them from
+     edm::FileInPath pdfFileWithFullPath("KinZfitter/KinZfitter/ParamZ1/dummy.txt");
+     string paramZ1_dummy = pdfFileWithFullPath.fullPath();
+     string dir = paramZ1_dummy.substr(0,paramZ1_dummy.length() - 9);
+
+     DIR *d = opendir(dir.c_str());
+     if (!d) { cout << "ParameterStore: cannot list " << dir << endl; return; }
+
+     struct dirent *entry;
+     while ((entry = readdir(d)) != 0) {
+
+           string file = entry->d_name;
+           if (file.size() <= 4 || file.substr(file.size()-4) != ".txt" || file == "dummy.txt") continue;
+
+           LineshapeParameters pars;
+           memset(&pars, 0, sizeof(pars));
+
+           std::ifstream input((dir + file).c_str());
+           std::string line;
+           while (std::getline(input,line)) {
+                 std::istringstream iss(line);
+                 string p; double val;
+                 if(iss >> p >> val) {
+                   if(p=="sg")  pars.sg = val;
+                   if(p=="a" )  pars.a = val;
+                   if(p=="n" )  pars.n = val;
+                   if(p=="f")   pars.f = val;
+                   if(p=="mean" )  pars.mean = val;
+                   if(p=="sigma" )  pars.sigma = val;
+                   if(p=="f1")   pars.f1 = val;
+                   }
+                 }
+
+           parameters_[file.substr(0, file.size()-4)] = pars;
+
+           }
+
+     closedir(d);
+
+}
+
+bool ParameterStore::ReadImage(const std::string &imageFile) {
+
+     int fd = open(imageFile.c_str(), O_RDONLY);
+     if (fd < 0) return false;
+
+     struct stat st;
+     if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ImageHeader)) { close(fd); return false; }
+
+     size_t size = st.st_size;
+     void *map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+     close(fd);
+     if (map == MAP_FAILED) return false;
+
+     // released with the last table using it
+     boost::shared_ptr<const void> owner(map, Unmap(size));
+
+     const char *p = static_cast<const char*>(map), *end = p + size;
+     const ImageHeader *header = reinterpret_cast<const ImageHeader*>(p);
+     if (memcmp(header->magic, kImageMagic, 4) != 0 || header->version != kImageVersion || header->nTables != 4) return false;
+     p += sizeof(ImageHeader);
+
+     for (uint32_t i = 0; i < header->nParameterSets; i++) {
+
+         if (p + sizeof(ImageParameterSet) > end) return false;
+         const ImageParameterSet *set = reinterpret_cast<const ImageParameterSet*>(p);
+         p += sizeof(ImageParameterSet);
+
+         LineshapeParameters pars;
+         pars.sg = set->pars[0]; pars.a = set->pars[1]; pars.n = set->pars[2]; pars.f = set->pars[3];
+         pars.mean = set->pars[4]; pars.sigma = set->pars[5]; pars.f1 = set->pars[6];
+         parameters_[string(set->name, strnlen(set->name, sizeof(set->name)))] = pars;
+
+         }
+
+     boost::shared_ptr<const PtErrCorrectionTable> *tables[4] = {&corrections_.muData, &corrections_.muMC,
+                                                                 &corrections_.elData, &corrections_.elMC};
+
+     for (int i = 0; i < 4; i++) {
+
+         if (p + sizeof(ImageTable) > end) return false;
+         const ImageTable *table = reinterpret_cast<const ImageTable*>(p);
+         p += sizeof(ImageTable);
+
+         if (strncmp(table->name, kTableNames[i], sizeof(table->name)) != 0) return false;
+
+         // empty table: the map was missing when the image was written
+         if (table->nx <= 0 || table->ny <= 0) continue;
+
+         const double *xEdges = reinterpret_cast<const double*>(p);
+         const double *yEdges = xEdges + table->nx+1;
+         const double *values = yEdges + table->ny+1;
+         p = reinterpret_cast<const char*>(values + table->nx*table->ny);
+         if (p > end) return false;
+
+         tables[i]->reset(new PtErrCorrectionTable(table->nx, table->ny, xEdges, yEdges, values, owner));
+
+         }
+
+     return true;
+
+}
+
+bool ParameterStore::WriteImage(const std::string &fileName) const {
+
+     FILE *file = fopen(fileName.c_str(), "wb");
+     if (!file) { cout << "ParameterStore: cannot write " << fileName << endl; return false; }
+
+     ImageHeader header;
+     memcpy(header.magic, kImageMagic, 4);
+     header.version = kImageVersion;
+     header.nParameterSets = parameters_.size();
+     header.nTables = 4;
+     bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+     for (std::map<std::string, LineshapeParameters>::const_iterator it = parameters_.begin(); it != parameters_.end(); ++it) {
+
+         ImageParameterSet set;
+         memset(&set, 0, sizeof(set));
+         strncpy(set.name, it->first.c_str(), sizeof(set.name)-1);
+         const LineshapeParameters &pars = it->second;
+         double values[7] = {pars.sg, pars.a, pars.n, pars.f, pars.mean, pars.sigma, pars.f1};
+         memcpy(set.pars, values, sizeof(values));
+         ok = ok && fwrite(&set, sizeof(set), 1, file) == 1;
+
+         }
+
+     const boost::shared_ptr<const PtErrCorrectionTable> *tables[4] = {&corrections_.muData, &corrections_.muMC,
+                                                                       &corrections_.elData, &corrections_.elMC};
+
+     for (int i = 0; i < 4; i++) {
+
+         const PtErrCorrectionTable *corr = tables[i]->get();
+
+         ImageTable table;
+         memset(&table, 0, sizeof(table));
+         strncpy(table.name, kTableNames[i], sizeof(table.name)-1);
+         table.nx = corr ? corr->nBinsX() : 0;
+         table.ny = corr ? corr->nBinsY() : 0;
+         ok = ok && fwrite(&table, sizeof(table), 1, file) == 1;
+
+         if (!corr) continue;
+         ok = ok && fwrite(corr->xEdges(), sizeof(double), table.nx+1, file) == size_t(table.nx+1);
+         ok = ok && fwrite(corr->yEdges(), sizeof(double), table.ny+1, file) == size_t(table.ny+1);
+         ok = ok && fwrite(corr->values(), sizeof(double), table.nx*table.ny, file) == size_t(table.nx*table.ny);
+
+         }
+
+     ok = fclose(file) == 0 && ok;
+     if (!ok) cout << "ParameterStore: failed to write " << fileName << endl;
+
+     return ok;
+
+}
+
+const ParameterStore::LineshapeParameters * ParameterStore::Parameters(const std::string &pdfName, const std::string &fs) const {
+
+     std::map<std::string, LineshapeParameters>::const_iterator it = parameters_.find(pdfName + "_" + fs);
+     return it == parameters_.end() ? 0 : &it->second;
+
+}
+
+boost::shared_ptr<const ZLineshape> ParameterStore::Lineshape(ZLineshape::Model model, const ZLineshape::Parameters &pars) const {
+
+     double values[] = { double(model), pars.bwMean, pars.bwGamma, pars.sg, pars.a, pars.n, pars.f, pars.mean, pars.sigma, pars.f1 };
+     std::vector<double> key(values, values + sizeof(values)/sizeof(double));
+
+     {
+       std::lock_guard<std::mutex> lock(lineshapeMutex_);
+       std::map<std::vector<double>, boost::shared_ptr<const ZLineshape> >::const_iterator it = lineshapes_.find(key);
+       if (it != lineshapes_.end()) return it->second;
+     }
+
+     // tabulated without the lock, so different tables build in parallel (KinZfitter::Warmup);
+     // of two threads building the same table the first one inserted is kept
+     boost::shared_ptr<const ZLineshape> built(new ZLineshape(model, pars));
+
+     std::lock_guard<std::mutex> lock(lineshapeMutex_);
+     return lineshapes_.insert(std::make_pair(key, built)).first->second;
+
+}
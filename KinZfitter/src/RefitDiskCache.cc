@@ -0,0 +1,254 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#include "KinZfitter/KinZfitter/interface/RefitDiskCache.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+  const char kStoreMagic[4] = {'K', 'Z', 'F', 'S'};
+  const char kJournalMagic[4] = {'K', 'Z', 'F', 'J'};
+
+  // splitmix64 finalizer
+  uint64_t Mix(uint64_t x) {
+
+     x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+     x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+     x ^= x >> 31;
+     return x;
+
+  }
+
+  void HashWord(uint64_t h[2], uint64_t w) {
+
+     h[0] = Mix(h[0] ^ w) + 0x9e3779b97f4a7c15ULL;
+     h[1] = Mix(h[1] + w*0xff51afd7ed558ccdULL) ^ (h[1] >> 29);
+
+  }
+
+  bool KeyLess(const RefitDiskCache::Record &a, const RefitDiskCache::Record &b) { return a.key < b.key; }
+
+  bool WriteAll(int fd, const void *data, size_t size) {
+
+     const char *p = static_cast<const char*>(data);
+     while (size > 0) {
+           ssize_t n = write(fd, p, size);
+           if (n <= 0) return false;
+           p += n; size -= n;
+           }
+     return true;
+
+  }
+
+}
+
+RefitDiskCache::RefitDiskCache(const string &storeFile, const string &journalFile)
+    : map_(0), mapSize_(0), records_(0), nRecords_(0), journal_(-1)
+{
+
+     int fd = open(storeFile.c_str(), O_RDONLY);
+     if (fd >= 0) {
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+
+           void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+           if (map != MAP_FAILED) {
+
+              const Header *header = static_cast<const Header*>(map);
+              if (memcmp(header->magic, kStoreMagic, 4) == 0 && header->version == kFitterVersion
+                  && header->recordSize == sizeof(Record)) {
+
+                 map_ = map; mapSize_ = st.st_size;
+                 records_ = reinterpret_cast<const Record*>(static_cast<const char*>(map) + sizeof(Header));
+                 nRecords_ = (mapSize_ - sizeof(Header))/sizeof(Record);
+
+                 }
+              else {
+
+                 cout << "RefitDiskCache: " << storeFile << " is not a version " << kFitterVersion << " store, ignored" << endl;
+                 munmap(map, st.st_size);
+
+                 }
+
+              }
+
+           }
+
+        // the mapping stays valid after close
+        close(fd);
+
+        }
+
+     if (!journalFile.empty()) {
+
+        journal_ = open(journalFile.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (journal_ < 0) cout << "RefitDiskCache: cannot open journal " << journalFile << endl;
+        else if (!OpenJournal(journalFile)) {
+           close(journal_);
+           journal_ = -1;
+           }
+
+        }
+
+}
+
+bool RefitDiskCache::OpenJournal(const string &journalFile) {
+
+     struct stat st;
+     if (fstat(journal_, &st) != 0) { cout << "RefitDiskCache: cannot stat journal " << journalFile << endl; return false; }
+
+     Header header;
+     bool hasHeader = size_t(st.st_size) >= sizeof(Header) && pread(journal_, &header, sizeof(header), 0) == ssize_t(sizeof(header));
+
+     if (hasHeader && memcmp(header.magic, kJournalMagic, 4) != 0) {
+        cout << "RefitDiskCache: " << journalFile << " is not a journal, not written" << endl;
+        return false;
+        }
+
+     if (hasHeader && header.version == kFitterVersion && header.recordSize == sizeof(Record)) {
+
+        // a job killed while writing leaves a partial record, the next ones would be misaligned
+        off_t complete = sizeof(Header) + (st.st_size - sizeof(Header))/sizeof(Record)*sizeof(Record);
+        if (complete != st.st_size) {
+           cout << "RefitDiskCache: truncated record at the end of " << journalFile << " dropped" << endl;
+           if (ftruncate(journal_, complete) != 0) { cout << "RefitDiskCache: cannot truncate " << journalFile << endl; return false; }
+           }
+
+        return true;
+
+        }
+
+     // empty, a partial header or another version, whose records Merge would not read anyway
+     if (st.st_size > 0) cout << "RefitDiskCache: " << journalFile << " is not a version " << kFitterVersion << " journal, started again" << endl;
+     if (ftruncate(journal_, 0) != 0) { cout << "RefitDiskCache: cannot truncate " << journalFile << endl; return false; }
+
+     memcpy(header.magic, kJournalMagic, 4);
+     header.version = kFitterVersion; header.recordSize = sizeof(Record); header.reserved = 0;
+     return WriteAll(journal_, &header, sizeof(header));
+
+}
+
+RefitDiskCache::~RefitDiskCache() {
+
+     if (map_) munmap(map_, mapSize_);
+     if (journal_ >= 0) close(journal_);
+
+}
+
+RefitDiskCache::Key RefitDiskCache::MakeKey(const vector<double> &values, const string &model) {
+
+     Key key;
+     uint64_t h[2] = {0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL};
+
+     HashWord(h, kFitterVersion);
+     HashWord(h, values.size());
+     for (unsigned int i = 0; i < values.size(); i++) {
+         // hash the bit pattern, -0 and 0 are the same input
+         double v = values[i] == 0 ? 0 : values[i];
+         uint64_t w; memcpy(&w, &v, sizeof(w));
+         HashWord(h, w);
+         }
+
+     HashWord(h, model.size());
+     for (unsigned int i = 0; i < model.size(); i++) HashWord(h, (unsigned char)model[i]);
+
+     key.h[0] = Mix(h[0] ^ h[1]); key.h[1] = Mix(h[1] + h[0]);
+     return key;
+
+}
+
+bool RefitDiskCache::Find(const Key &key, Record &record) const {
+
+     if (nRecords_ == 0) return false;
+
+     Record probe; probe.key = key;
+     const Record *it = std::lower_bound(records_, records_ + nRecords_, probe, KeyLess);
+     if (it == records_ + nRecords_ || !(it->key == key)) return false;
+
+     record = *it;
+     return true;
+
+}
+
+void RefitDiskCache::Append(const Record &record) {
+
+     // single write per record, O_APPEND keeps records whole
+     if (journal_ >= 0 && !WriteAll(journal_, &record, sizeof(record)))
+        cout << "RefitDiskCache: journal write failed" << endl;
+
+}
+
+bool RefitDiskCache::ReadFile(const string &fileName, vector<Record> &records) {
+
+     FILE *file = fopen(fileName.c_str(), "rb");
+     if (!file) return false;
+
+     Header header;
+     bool ok = fread(&header, sizeof(header), 1, file) == 1
+               && (memcmp(header.magic, kStoreMagic, 4) == 0 || memcmp(header.magic, kJournalMagic, 4) == 0)
+               && header.version == kFitterVersion && header.recordSize == sizeof(Record);
+
+     if (ok) {
+        Record record;
+        // a truncated last record (job killed while writing) is dropped
+        while (fread(&record, sizeof(record), 1, file) == 1) records.push_back(record);
+        }
+
+     fclose(file);
+     return ok;
+
+}
+
+bool RefitDiskCache::Merge(const vector<string> &inputs, const string &output) {
+
+     vector<Record> records;
+     for (unsigned int i = 0; i < inputs.size(); i++) {
+         if (!ReadFile(inputs[i], records)) cout << "RefitDiskCache::Merge: skip " << inputs[i] << endl;
+         }
+
+     // stable: the first input wins on duplicates
+     std::stable_sort(records.begin(), records.end(), KeyLess);
+     vector<Record> unique;
+     unique.reserve(records.size());
+     for (unsigned int i = 0; i < records.size(); i++) {
+         if (unique.empty() || !(unique.back().key == records[i].key)) unique.push_back(records[i]);
+         }
+
+     // write next to the output and rename, readers keep the file they mapped
+     char pid[32]; snprintf(pid, sizeof(pid), ".tmp%d", int(getpid()));
+     string tmp = output + pid;
+
+     int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+     if (fd < 0) { cout << "RefitDiskCache::Merge: cannot write " << tmp << endl; return false; }
+
+     Header header;
+     memcpy(header.magic, kStoreMagic, 4);
+     header.version = kFitterVersion; header.recordSize = sizeof(Record); header.reserved = 0;
+
+     bool ok = WriteAll(fd, &header, sizeof(header));
+     if (ok && !unique.empty()) ok = WriteAll(fd, &unique[0], unique.size()*sizeof(Record));
+     ok = fsync(fd) == 0 && ok;
+     ok = close(fd) == 0 && ok;
+
+     if (!ok || rename(tmp.c_str(), output.c_str()) != 0) {
+        cout << "RefitDiskCache::Merge: failed to write " << output << endl;
+        unlink(tmp.c_str());
+        return false;
+        }
+
+     cout << "RefitDiskCache::Merge: " << unique.size() << " records in " << output << endl;
+     return true;
+
+}
@@ -0,0 +1,213 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#include "KinZfitter/KinZfitter/src/RooFitZModel.h"
+
+#include "RooFitResult.h"
+#include "RooMinimizer.h"
+
+using namespace std;
+
+namespace {
+
+  const char * kMakeE_lep = "TMath::Sqrt((@0*@0)/((TMath::Sin(@1))*(TMath::Sin(@1)))+@2*@2)";
+  const char * kMakeE_gamma = "TMath::Sqrt((@0*@0)/((TMath::Sin(@1))*(TMath::Sin(@1))))";
+  const char * kDotProduct_3d = "@0*@1*( ((TMath::Cos(@2))*(TMath::Cos(@3)))/((TMath::Sin(@2))*(TMath::Sin(@3)))+(TMath::Cos(@4-@5)))";
+  const char * kDotProduct_4d = "@0*@1-@2";
+  const char * kRelBW = "1/( pow(mZ*mZ-bwMean*bwMean,2)+pow(mZ,4)*pow(bwGamma/bwMean,2) )";
+
+  // floating pT in [min, max] starting at val, with the step size chosen by the minimizer
+  void ResetMean(RooRealVar &var, double val, double min, double max) {
+
+       var.setRange(min, max);
+       var.setVal(val);
+       var.setError(0);
+
+  }
+
+}
+
+KinZfitter::RooFitZModel::RooFitZModel(int nFsr)
+    : nFsr_(nFsr),
+      pTRECO1_lep_("pTRECO1_lep", "pTRECO1_lep", 5, 5, 500),
+      pTRECO2_lep_("pTRECO2_lep", "pTRECO2_lep", 5, 5, 500),
+      pTMean1_lep_("pTMean1_lep", "pTMean1_lep", 5, 5, 500),
+      pTMean2_lep_("pTMean2_lep", "pTMean2_lep", 5, 5, 500),
+      pTSigma1_lep_("pTSigma1_lep", "pTSigma1_lep", 1),
+      pTSigma2_lep_("pTSigma2_lep", "pTSigma2_lep", 1),
+      theta1_lep_("theta1_lep", "theta1_lep", 1),
+      theta2_lep_("theta2_lep", "theta2_lep", 1),
+      phi1_lep_("phi1_lep", "phi1_lep", 0),
+      phi2_lep_("phi2_lep", "phi2_lep", 0),
+      m1_("m1", "m1", 0),
+      m2_("m2", "m2", 0),
+      pTMean1_gamma_("pTMean1_gamma", "pTMean1_gamma", 0.5, 0.5, 500),
+      pTMean2_gamma_("pTMean2_gamma", "pTMean2_gamma", 0.5, 0.5, 500),
+      theta1_gamma_("theta1_gamma", "theta1_gamma", 1),
+      theta2_gamma_("theta2_gamma", "theta2_gamma", 1),
+      phi1_gamma_("phi1_gamma", "phi1_gamma", 0),
+      phi2_gamma_("phi2_gamma", "phi2_gamma", 0),
+      gauss1_lep_("gauss1_lep", "gauss1_lep", pTRECO1_lep_, pTMean1_lep_, pTSigma1_lep_),
+      gauss2_lep_("gauss2_lep", "gauss2_lep", pTRECO2_lep_, pTMean2_lep_, pTSigma2_lep_),
+      E1_lep_("E1_lep", kMakeE_lep, RooArgList(pTMean1_lep_, theta1_lep_, m1_)),
+      E2_lep_("E2_lep", kMakeE_lep, RooArgList(pTMean2_lep_, theta2_lep_, m2_)),
+      E1_gamma_("E1_gamma", kMakeE_gamma, RooArgList(pTMean1_gamma_, theta1_gamma_)),
+      E2_gamma_("E2_gamma", kMakeE_gamma, RooArgList(pTMean2_gamma_, theta2_gamma_)),
+      p1v3D2_("p1v3D2", kDotProduct_3d, RooArgList(pTMean1_lep_, pTMean2_lep_, theta1_lep_, theta2_lep_, phi1_lep_, phi2_lep_)),
+      p1v3Dph1_("p1v3Dph1", kDotProduct_3d, RooArgList(pTMean1_lep_, pTMean1_gamma_, theta1_lep_, theta1_gamma_, phi1_lep_, phi1_gamma_)),
+      p2v3Dph1_("p2v3Dph1", kDotProduct_3d, RooArgList(pTMean2_lep_, pTMean1_gamma_, theta2_lep_, theta1_gamma_, phi2_lep_, phi1_gamma_)),
+      p1v3Dph2_("p1v3Dph2", kDotProduct_3d, RooArgList(pTMean1_lep_, pTMean2_gamma_, theta1_lep_, theta2_gamma_, phi1_lep_, phi2_gamma_)),
+      p2v3Dph2_("p2v3Dph2", kDotProduct_3d, RooArgList(pTMean2_lep_, pTMean2_gamma_, theta2_lep_, theta2_gamma_, phi2_lep_, phi2_gamma_)),
+      ph1v3Dph2_("ph1v3Dph2", kDotProduct_3d, RooArgList(pTMean1_gamma_, pTMean2_gamma_, theta1_gamma_, theta2_gamma_, phi1_gamma_, phi2_gamma_)),
+      p1D2_("p1D2", kDotProduct_4d, RooArgList(E1_lep_, E2_lep_, p1v3D2_)),
+      p1Dph1_("p1Dph1", kDotProduct_4d, RooArgList(E1_lep_, E1_gamma_, p1v3Dph1_)),
+      p2Dph1_("p2Dph1", kDotProduct_4d, RooArgList(E2_lep_, E1_gamma_, p2v3Dph1_)),
+      p1Dph2_("p1Dph2", kDotProduct_4d, RooArgList(E1_lep_, E2_gamma_, p1v3Dph2_)),
+      p2Dph2_("p2Dph2", kDotProduct_4d, RooArgList(E2_lep_, E2_gamma_, p2v3Dph2_)),
+      ph1Dph2_("ph1Dph2", kDotProduct_4d, RooArgList(E1_gamma_, E2_gamma_, ph1v3Dph2_)),
+      bwMean_("bwMean", "m_{Z^{0}}", 91.187),
+      bwGamma_("bwGamma", "#Gamma", 2.5),
+      mZLep_("mZ", MZFormula(0), MZArgs(0)),
+      RelBWLep_("RelBW", kRelBW, RooArgSet(mZLep_, bwMean_, bwGamma_)),
+      PDFRelBW_("PDFRelBW", "PDFRelBW", RooArgList(gauss1_lep_, gauss2_lep_, RelBWLep_)),
+      mZ_("mZ", MZFormula(nFsr), MZArgs(nFsr)),
+      RelBW_("RelBW", kRelBW, RooArgSet(mZ_, bwMean_, bwGamma_)),
+      sg_("sg", "sg", 0), a_("a", "a", 0), n_("n", "n", 0), f_("f", "f", 0),
+      mean_("mean", "mean", 0), sigma_("sigma", "sigma", 1), f1_("f1", "f1", 0),
+      CB_("CB", "CB", mZ_, bwMean_, sg_, a_, n_),
+      RelBWxCB_("RelBWxCB", "RelBWxCB", RelBW_, CB_, f_),
+      gauss_("gauss", "gauss", mZ_, mean_, sigma_),
+      RelBWxCBxgauss_("RelBWxCBxgauss", "RelBWxCBxgauss", RelBWxCB_, gauss_, f1_),
+      PDFRelBWxCBxgauss_("PDFRelBWxCBxgauss", "PDFRelBWxCBxgauss", RooArgList(gauss1_lep_, gauss2_lep_, RelBWxCBxgauss_)),
+      rastmp_(pTRECO1_lep_, pTRECO2_lep_),
+      pTs_("pTs", "pTs", rastmp_)
+{
+
+}
+
+TString KinZfitter::RooFitZModel::MZFormula(int nFsr) {
+
+     if (nFsr == 1) return "TMath::Sqrt(2*@0+2*@1+2*@2+@3*@3+@4*@4)";
+     if (nFsr == 2) return "TMath::Sqrt(2*@0+2*@1+2*@2+2*@3+2*@4+2*@5+@6*@6+@7*@7)";
+     return "TMath::Sqrt(2*@0+@1*@1+@2*@2)";
+
+}
+
+RooArgList KinZfitter::RooFitZModel::MZArgs(int nFsr) {
+
+     if (nFsr == 1) return RooArgList(p1D2_, p1Dph1_, p2Dph1_, m1_, m2_);
+     if (nFsr == 2) return RooArgList(p1D2_, p1Dph1_, p2Dph1_, p1Dph2_, p2Dph2_, ph1Dph2_, m1_, m2_);
+     return RooArgList(p1D2_, m1_, m2_);
+
+}
+
+int KinZfitter::RooFitZModel::Fit(const KinZfitter::FitInput &input, KinZfitter::FitOutput &output, const KinZfitter::FitOutput *seed,
+                                  bool relBW, const ZLineshape::Parameters &pars, int maxCalls, bool hesse, bool debug) {
+
+     //lep
+     pTRECO1_lep_.setVal(input.pTRECO1_lep);
+     pTRECO2_lep_.setVal(input.pTRECO2_lep);
+     ResetMean(pTMean1_lep_, input.pTRECO1_lep, max(5.0, input.pTRECO1_lep-2*input.pTErr1_lep), input.pTRECO1_lep+2*input.pTErr1_lep);
+     ResetMean(pTMean2_lep_, input.pTRECO2_lep, max(5.0, input.pTRECO2_lep-2*input.pTErr2_lep), input.pTRECO2_lep+2*input.pTErr2_lep);
+     // warm start, within the ranges
+     if (seed) {
+        pTMean1_lep_.setVal(min(max(seed->pT1_lep, pTMean1_lep_.getMin()), pTMean1_lep_.getMax()));
+        pTMean2_lep_.setVal(min(max(seed->pT2_lep, pTMean2_lep_.getMin()), pTMean2_lep_.getMax()));
+        }
+     pTSigma1_lep_.setVal(input.pTErr1_lep);
+     pTSigma2_lep_.setVal(input.pTErr2_lep);
+     theta1_lep_.setVal(input.theta1_lep); theta2_lep_.setVal(input.theta2_lep);
+     phi1_lep_.setVal(input.phi1_lep); phi2_lep_.setVal(input.phi2_lep);
+     m1_.setVal(input.m1); m2_.setVal(input.m2);
+
+     //gamma, only those of this model
+     if (nFsr_ >= 1) {
+        ResetMean(pTMean1_gamma_, input.pTRECO1_gamma,
+                  max(0.5, input.pTRECO1_gamma-2*input.pTErr1_gamma), input.pTRECO1_gamma+2*input.pTErr1_gamma);
+        theta1_gamma_.setVal(input.theta1_gamma); phi1_gamma_.setVal(input.phi1_gamma);
+        }
+     if (nFsr_ == 2) {
+        ResetMean(pTMean2_gamma_, input.pTRECO2_gamma,
+                  max(0.5, input.pTRECO2_gamma-2*input.pTErr2_gamma), input.pTRECO2_gamma+2*input.pTErr2_gamma);
+        theta2_gamma_.setVal(input.theta2_gamma); phi2_gamma_.setVal(input.phi2_gamma);
+        }
+
+     bwMean_.setVal(pars.bwMean); bwGamma_.setVal(pars.bwGamma);
+
+     //true shape
+     sg_.setVal(pars.sg); a_.setVal(pars.a); n_.setVal(pars.n); f_.setVal(pars.f);
+     mean_.setVal(pars.mean); sigma_.setVal(pars.sigma); f1_.setVal(pars.f1);
+
+     //make fit
+     pTs_.reset();
+     pTs_.add(rastmp_);
+
+     RooAbsPdf &pdf = relBW ? static_cast<RooAbsPdf&>(PDFRelBW_) : static_cast<RooAbsPdf&>(PDFRelBWxCBxgauss_);
+
+     RooFitResult* r;
+     int nCalls = 0;
+     if (maxCalls <= 0) {
+
+        r = pdf.fitTo(pTs_,RooFit::Save(),RooFit::PrintLevel(-1),RooFit::Hesse(hesse));
+
+        } else {
+
+               // what fitTo does, with the call limit
+               RooAbsReal *nll = pdf.createNLL(pTs_);
+               RooMinimizer minimizer(*nll);
+               minimizer.setPrintLevel(-1);
+               minimizer.setMaxFunctionCalls(maxCalls);
+               minimizer.setMaxIterations(maxCalls);
+               minimizer.migrad();
+               if (hesse) minimizer.hesse();
+               r = minimizer.save();
+               nCalls = minimizer.fitter()->Result().NCalls();
+               delete nll;
+
+               }
+
+     //save fit result
+     const TMatrixDSym& covMatrix = r->covarianceMatrix();
+     const RooArgList& finalPars = r->floatParsFinal();
+
+     // floatParsFinal is sorted by name, keep the lepton pTs first
+     const char* covOrder[] = {"pTMean1_lep", "pTMean2_lep", "pTMean1_gamma", "pTMean2_gamma"};
+     vector<int> covIndex;
+
+     for (int j=0 ; j<4; j++){
+      for (int i=0 ; i<finalPars.getSize(); i++){
+
+         TString name = TString(((RooRealVar*)finalPars.at(i))->GetName());
+         if(debug && j==0) cout<<"name list of RooRealVar for covariance matrix "<<name<<endl;
+         if(name==covOrder[j]) covIndex.push_back(i);
+
+      }
+     }
+
+     int size = covIndex.size();
+     output.covMatrixZ = ZCovariance();
+     output.covMatrixZ.size = size;
+     for (int i=0 ; i<size; i++){
+         for (int j=i ; j<size; j++) output.covMatrixZ.matrix(i,j) = covMatrix(covIndex[i],covIndex[j]);
+     }
+
+     delete r;
+
+     output.pT1_lep = pTMean1_lep_.getVal();
+     output.pT2_lep = pTMean2_lep_.getVal();
+     output.pTErr1_lep = pTMean1_lep_.getError();
+     output.pTErr2_lep = pTMean2_lep_.getError();
+
+     // fsr photon pTs are not used for the refit 4-vectors (see SetFitOutput),
+     // the fitted values are kept for GetRefitSensitivity
+     output.pT1_gamma = input.pTRECO1_gamma; output.pTErr1_gamma = input.pTErr1_gamma;
+     output.pT2_gamma = input.pTRECO2_gamma; output.pTErr2_gamma = input.pTErr2_gamma;
+
+     if (nFsr_ >= 1) output.pT1_gamma = pTMean1_gamma_.getVal();
+     if (nFsr_ == 2) output.pT2_gamma = pTMean2_gamma_.getVal();
+
+     output.status = kFitOK;
+
+     return nCalls;
+
+}
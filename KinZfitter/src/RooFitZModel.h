@@ -0,0 +1,89 @@
+/*************************************************************************
+*  Authors:   Tongguang CHeng(IHEP, Beijing) Hualin Mei(UF)
+*************************************************************************/
+#ifndef RooFitZModel_h
+#define RooFitZModel_h
+
+#include "KinZfitter/KinZfitter/interface/KinZfitter.h"
+
+#include "RooRealVar.h"
+#include "RooArgSet.h"
+#include "RooArgList.h"
+#include "RooGaussian.h"
+#include "RooProdPdf.h"
+#include "RooAddPdf.h"
+#include "RooCBShape.h"
+#include "RooGenericPdf.h"
+#include "RooFormulaVar.h"
+#include "RooDataSet.h"
+
+/// The RooFit Z likelihood of KinZfitter::MakeModel for a given number of fsr photons.
+/// All RooFit objects are members, built once and owned by the model: a fit only
+/// resets the values and ranges of the variables and the one-entry dataset, so a
+/// fitter reuses the same three models (nFsr = 0, 1, 2) for all its events.
+/// Members are declared servers first, so clients are destroyed first.
+class KinZfitter::RooFitZModel {
+public:
+
+        explicit RooFitZModel(int nFsr);
+
+        /// fit of one Z, relBW: the lepton-only RelBW lineshape instead of RelBWxCBxgauss.
+        /// maxCalls > 0: MIGRAD and HESSE limited to maxCalls NLL calls, returns the calls used.
+        /// hesse false: no HESSE, the covariance is the MIGRAD estimate
+        int Fit(const FitInput &input, FitOutput &output, const FitOutput *seed,
+                bool relBW, const ZLineshape::Parameters &pars, int maxCalls, bool hesse, bool debug);
+
+private:
+
+        RooFitZModel(const RooFitZModel &);
+        RooFitZModel & operator=(const RooFitZModel &);
+
+        static TString MZFormula(int nFsr);
+        RooArgList MZArgs(int nFsr);
+
+        int nFsr_;
+
+        //lep
+        RooRealVar pTRECO1_lep_, pTRECO2_lep_, pTMean1_lep_, pTMean2_lep_, pTSigma1_lep_, pTSigma2_lep_;
+        RooRealVar theta1_lep_, theta2_lep_, phi1_lep_, phi2_lep_, m1_, m2_;
+
+        //gamma
+        RooRealVar pTMean1_gamma_, pTMean2_gamma_;
+        RooRealVar theta1_gamma_, theta2_gamma_, phi1_gamma_, phi2_gamma_;
+
+        //gauss
+        RooGaussian gauss1_lep_, gauss2_lep_;
+
+        RooFormulaVar E1_lep_, E2_lep_, E1_gamma_, E2_gamma_;
+
+        //dotProduct 3d
+        RooFormulaVar p1v3D2_, p1v3Dph1_, p2v3Dph1_, p1v3Dph2_, p2v3Dph2_, ph1v3Dph2_;
+        //dotProduct 4d
+        RooFormulaVar p1D2_, p1Dph1_, p2Dph1_, p1Dph2_, p2Dph2_, ph1Dph2_;
+
+        RooRealVar bwMean_, bwGamma_;
+
+        // lepton-only mZ of the RelBW model
+        RooFormulaVar mZLep_;
+        RooGenericPdf RelBWLep_;
+        RooProdPdf PDFRelBW_;
+
+        // mZ with the nFsr_ photons of the RelBWxCBxgauss model
+        RooFormulaVar mZ_;
+        RooGenericPdf RelBW_;
+
+        //true shape
+        RooRealVar sg_, a_, n_, f_, mean_, sigma_, f1_;
+        RooCBShape CB_;
+        RooAddPdf RelBWxCB_;
+        RooGaussian gauss_;
+        RooAddPdf RelBWxCBxgauss_;
+        RooProdPdf PDFRelBWxCBxgauss_;
+
+        // observables and the one-entry dataset, refilled every fit
+        RooArgSet rastmp_;
+        RooDataSet pTs_;
+
+};
+
+#endif
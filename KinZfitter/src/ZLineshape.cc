@@ -0,0 +1,202 @@
+/*************************************************************************
+ *  Authors:   Tongguang Cheng
+ *************************************************************************/
+#ifndef ZLineshape_cpp
+#define ZLineshape_cpp
+
+#include "KinZfitter/KinZfitter/interface/ZLineshape.h"
+
+#include <cmath>
+#include <limits>
+#include <iostream>
+
+using namespace std;
+
+ZLineshape::ZLineshape(ZLineshape::Model model, const ZLineshape::Parameters &pars)
+{
+
+     model_ = model;
+     pars_ = pars;
+
+     mLow_ = 1.0; mHigh_ = 300.0;
+     tolerance_ = 1e-5; minStep_ = 1e-4;
+
+     Tabulate();
+
+}
+
+double ZLineshape::NLLExact(double m, double &d1, double &d2) const {
+
+     double M = pars_.bwMean;
+     double gM2 = pow(pars_.bwGamma/M, 2);
+
+     // RelBW
+     double m2 = m*m;
+     double D = pow(m2-M*M, 2) + m2*m2*gM2;
+     double dD = 4*m*(m2-M*M) + 4*m2*m*gM2;
+     double d2D = 12*m2 - 4*M*M + 12*m2*gM2;
+     double L = 1/D;
+     double dL = -dD/(D*D);
+     double d2L = -d2D/(D*D) + 2*dD*dD/(D*D*D);
+
+     if (model_ == kRelBWxCBxgauss) {
+
+        // RooCBShape
+        double t = (m-M)/pars_.sg;
+        double dt = 1/pars_.sg;
+        if (pars_.a < 0) { t = -t; dt = -dt; }
+        double absA = fabs(pars_.a);
+
+        double CB, dCB, d2CB;
+        if (t >= -absA) {
+           CB = exp(-0.5*t*t);
+           dCB = -t*CB*dt;
+           d2CB = (t*t-1)*CB*dt*dt;
+           } else {
+                  double A = pow(pars_.n/absA, pars_.n)*exp(-0.5*absA*absA);
+                  double B = pars_.n/absA - absA;
+                  CB = A/pow(B-t, pars_.n);
+                  dCB = pars_.n*CB/(B-t)*dt;
+                  d2CB = pars_.n*(pars_.n+1)*CB/((B-t)*(B-t))*dt*dt;
+                  }
+
+        // RooGaussian
+        double z = (m-pars_.mean)/pars_.sigma;
+        double G = exp(-0.5*z*z);
+        double dG = -z/pars_.sigma*G;
+        double d2G = (z*z-1)/(pars_.sigma*pars_.sigma)*G;
+
+        d2L = pars_.f1*(pars_.f*d2L + (1-pars_.f)*d2CB) + (1-pars_.f1)*d2G;
+        dL = pars_.f1*(pars_.f*dL + (1-pars_.f)*dCB) + (1-pars_.f1)*dG;
+        L = pars_.f1*(pars_.f*L + (1-pars_.f)*CB) + (1-pars_.f1)*G;
+
+        }
+
+     if (!(L > 0)) {
+        d1 = 0; d2 = 0;
+        return -log(numeric_limits<double>::min());
+        }
+
+     d1 = -dL/L;
+     d2 = -d2L/L + d1*d1;
+     return -log(L);
+
+}
+
+double ZLineshape::MinNLL(double mLow, double mHigh) const {
+
+     if (model_ != kRelBW) return -numeric_limits<double>::max();
+
+     // log((x-M^2)^2 + x^2 (Gamma/M)^2) is smallest at x = mZ^2 = M^2/(1+(Gamma/M)^2)
+     double M = pars_.bwMean;
+     double mMin = M/sqrt(1 + pow(pars_.bwGamma/M, 2));
+
+     double d1;
+     double exact = NLLExact(min(max(mMin, mLow), mHigh), d1);
+
+     // NLL, which the fits minimize, is the table: it may be below the exact form by its
+     // interpolation error, taken as twice the deviation found by the check
+     return tabulated_ ? exact - max(2*maxDeviation_, tolerance_) : exact;
+
+}
+
+double ZLineshape::NLL(double m, double &d1, double &d2) const {
+
+     if (!tabulated_ || m < mLow_ || m >= mHigh_) return NLLExact(m, d1, d2);
+
+     // fixed-trip binary search of the knot interval
+     const double *base = &knots_[0];
+     int n = knots_.size() - 1;
+     while (n > 1) {
+           int half = n/2;
+           base = (base[half] <= m) ? base + half : base;
+           n -= half;
+           }
+     int k = base - &knots_[0];
+
+     double h = knots_[k+1] - knots_[k];
+     double s = (m - knots_[k])/h;
+     double g0 = values_[k], g1 = values_[k+1];
+     double hd0 = h*derivatives_[k], hd1 = h*derivatives_[k+1];
+
+     d1 = ((6*s*s-6*s)*g0 + (3*s*s-4*s+1)*hd0 + (-6*s*s+6*s)*g1 + (3*s*s-2*s)*hd1)/h;
+     d2 = ((12*s-6)*g0 + (6*s-4)*hd0 + (-12*s+6)*g1 + (6*s-2)*hd1)/(h*h);
+
+     return Hermite(s, h, g0, derivatives_[k], g1, derivatives_[k+1]);
+
+}
+
+double ZLineshape::Hermite(double s, double h, double g0, double d0, double g1, double d1) {
+
+     double s2 = s*s, s3 = s2*s;
+     return (2*s3-3*s2+1)*g0 + (s3-2*s2+s)*h*d0 + (-2*s3+3*s2)*g1 + (s3-s2)*h*d1;
+
+}
+
+void ZLineshape::Refine(double xa, double ga, double da, double xb, double gb, double db) {
+
+     double h = xb - xa;
+
+     bool good = true;
+     if (h > minStep_) {
+        for (int i = 1; i < 4 && good; i++) {
+            double d, s = 0.25*i;
+            double exact = NLLExact(xa + s*h, d);
+            if (fabs(Hermite(s, h, ga, da, gb, db) - exact) > tolerance_) good = false;
+            // the derivative enters the fit gradient
+            double dH = ((6*s*s-6*s)*ga + (3*s*s-4*s+1)*h*da + (-6*s*s+6*s)*gb + (3*s*s-2*s)*h*db)/h;
+            if (fabs(dH - d) > 1e3*tolerance_*(1 + fabs(d))) good = false;
+            }
+        }
+
+     if (!good) {
+        double xm = 0.5*(xa + xb), dm;
+        double gm = NLLExact(xm, dm);
+        Refine(xa, ga, da, xm, gm, dm);
+        Refine(xm, gm, dm, xb, gb, db);
+        return;
+        }
+
+     // knot xa is already in the table
+     knots_.push_back(xb); values_.push_back(gb); derivatives_.push_back(db);
+
+}
+
+void ZLineshape::Tabulate() {
+
+     knots_.clear(); values_.clear(); derivatives_.clear();
+
+     // start from a 1 GeV grid and split the intervals where the cubic is off
+     double d0;
+     double g0 = NLLExact(mLow_, d0);
+     knots_.push_back(mLow_); values_.push_back(g0); derivatives_.push_back(d0);
+
+     int nStart = int(mHigh_ - mLow_);
+     for (int i = 0; i < nStart; i++) {
+
+         double xa = knots_.back(), ga = values_.back(), da = derivatives_.back();
+         double xb = mLow_ + (i+1)*(mHigh_ - mLow_)/nStart, db;
+         double gb = NLLExact(xb, db);
+         Refine(xa, ga, da, xb, gb, db);
+
+         }
+
+     // check against the exact form off the knots
+     tabulated_ = true;
+     maxDeviation_ = 0;
+     for (double m = mLow_ + 1.234567e-4; m < mHigh_; m += 1.0371e-3) {
+
+         double d1, d2, dExact;
+         double dev = fabs(NLL(m, d1, d2) - NLLExact(m, dExact));
+         if (dev > maxDeviation_) maxDeviation_ = dev;
+
+         }
+
+     if (maxDeviation_ > 10*tolerance_) {
+        cout << "ZLineshape: table deviates by " << maxDeviation_ << " from the exact lineshape, using the exact form" << endl;
+        tabulated_ = false;
+        }
+
+}
+
+#endif